@@ -0,0 +1,258 @@
+/**************************************************************************************************
+* @file        avi_writer.h
+* @version     0.1.1
+* @type:       MJPEG AVI muxer of the recorder
+* @brief       Writes JPEG frames that are already encoded (the encode stage's) into an AVI file
+*              as they are, nothing is decoded or encoded again. Readers (VideoCapture, players)
+*              see an MJPG video stream with an idx1 index:
+*                 RIFF 'AVI ' | LIST 'hdrl' (avih, LIST 'strl' (strh, strf)) |
+*                 LIST 'movi' ('00dc' JPEG)... | idx1
+*              Frames collect in an AVI_BUFFER_SIZE page aligned buffer written out whole, the
+*              index is kept in memory and appended on close, which also fills in the sizes and
+*              frame counts of the headers. A file closed uncleanly has no index.
+*              AVI 1.0 files stay below AVI_MAX_BYTES.
+*              All fields are little endian. Needs no OpenCV.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [AVI RIFF File Reference](https://learn.microsoft.com/en-us/windows/win32/directshow/avi-riff-file-reference)
+*
+**************************************************************************************************/
+
+#ifndef AVI_WRITER_H
+#define AVI_WRITER_H
+
+#include <algorithm>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#define AVI_BUFFER_SIZE		(1024 * 1024)	// Bytes written to the file at once
+#define AVI_BUFFER_ALIGN	4096
+#define AVI_MAX_BYTES		(1024u * 1024 * 1024)	// AVI 1.0 readers handle up to 1 GB safely
+#define AVI_HEADER_BYTES	224				// RIFF header up to the first frame of movi
+
+// avih.dwFlags
+#define AVIF_HASINDEX		0x00000010
+#define AVIF_ISINTERLEAVED	0x00000100
+// idx1 flags
+#define AVIIF_KEYFRAME		0x00000010
+
+#define AVI_FOURCC(a, b, c, d)	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+// Offsets in the header of the fields filled in on close
+#define AVI_RIFF_SIZE		4
+#define AVI_AVIH_FRAMES		48
+#define AVI_STRH_LENGTH		140
+#define AVI_MOVI_SIZE		216
+
+typedef struct
+{
+	uint32_t ckid;
+	uint32_t flags;
+	uint32_t offset;		// From the 'movi' fourcc
+	uint32_t size;
+} AviIndexEntry;
+
+typedef struct
+{
+	int fd;
+	uint8_t *buf;			// AVI_BUFFER_SIZE bytes, AVI_BUFFER_ALIGN aligned
+	size_t used;			// Bytes of buf not written yet
+	uint64_t bytes;			// File size, buffered bytes included
+	std::vector<AviIndexEntry> index;
+	uint32_t max_frame;		// Largest JPEG, for the suggested buffer sizes
+	bool failed;			// A write failed, nothing more is written
+} AviWriter;
+
+
+static inline void avi_put32(uint8_t *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, 4);
+}
+
+static inline void avi_put16(uint8_t *p, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p, &v, 2);
+}
+
+// Write the buffered bytes
+static int avi_flush(AviWriter *w)
+{
+	size_t off = 0;
+	while (off < w->used && !w->failed)
+	{
+		ssize_t n = write(w->fd, w->buf + off, w->used - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			w->failed = true;
+		else
+			off += n;
+	}
+	w->used = 0;
+	return w->failed ? -1 : 0;
+}
+
+// Append bytes through the buffer
+static int avi_append(AviWriter *w, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	while (len > 0 && !w->failed)
+	{
+		size_t n = std::min(len, (size_t)AVI_BUFFER_SIZE - w->used);
+		memcpy(w->buf + w->used, p, n);
+		w->used += n;
+		w->bytes += n;
+		p += n;
+		len -= n;
+		if (w->used == AVI_BUFFER_SIZE)
+			avi_flush(w);
+	}
+	return w->failed ? -1 : 0;
+}
+
+// Create path for width x height frames played back at fps, the headers are written at once
+// with the frame counts and sizes left to avi_writer_close()
+// Returns 0 on success, -1 on failure
+int avi_writer_open(AviWriter *w, const char *path, int width, int height, double fps)
+{
+	uint8_t h[AVI_HEADER_BYTES];
+	uint32_t rate = (uint32_t)(fps * 1000 + 0.5);	// dwRate / dwScale is the frame rate
+
+	w->fd = -1;
+	w->used = 0;
+	w->bytes = 0;
+	w->index.clear();
+	w->max_frame = 0;
+	w->failed = false;
+	if (posix_memalign((void**)&w->buf, AVI_BUFFER_ALIGN, AVI_BUFFER_SIZE) != 0)
+		return -1;
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w->fd < 0)
+	{
+		free(w->buf);
+		return -1;
+	}
+
+	memset(h, 0, sizeof(h));
+	avi_put32(h + 0, AVI_FOURCC('R','I','F','F'));
+	avi_put32(h + 8, AVI_FOURCC('A','V','I',' '));
+	avi_put32(h + 12, AVI_FOURCC('L','I','S','T'));
+	avi_put32(h + 16, 192);							// hdrl
+	avi_put32(h + 20, AVI_FOURCC('h','d','r','l'));
+	// MainAVIHeader
+	avi_put32(h + 24, AVI_FOURCC('a','v','i','h'));
+	avi_put32(h + 28, 56);
+	avi_put32(h + 32, (uint32_t)(1e6 / fps));		// dwMicroSecPerFrame
+	avi_put32(h + 44, AVIF_HASINDEX | AVIF_ISINTERLEAVED);
+	avi_put32(h + 56, 1);							// dwStreams
+	avi_put32(h + 64, width);
+	avi_put32(h + 68, height);
+	avi_put32(h + 88, AVI_FOURCC('L','I','S','T'));
+	avi_put32(h + 92, 116);							// strl
+	avi_put32(h + 96, AVI_FOURCC('s','t','r','l'));
+	// AVIStreamHeader
+	avi_put32(h + 100, AVI_FOURCC('s','t','r','h'));
+	avi_put32(h + 104, 56);
+	avi_put32(h + 108, AVI_FOURCC('v','i','d','s'));
+	avi_put32(h + 112, AVI_FOURCC('M','J','P','G'));
+	avi_put32(h + 128, 1000);						// dwScale
+	avi_put32(h + 132, rate);						// dwRate
+	avi_put32(h + 148, 0xffffffff);					// dwQuality: default
+	avi_put16(h + 160, width);						// rcFrame
+	avi_put16(h + 162, height);
+	// BITMAPINFOHEADER
+	avi_put32(h + 164, AVI_FOURCC('s','t','r','f'));
+	avi_put32(h + 168, 40);
+	avi_put32(h + 172, 40);
+	avi_put32(h + 176, width);
+	avi_put32(h + 180, height);
+	avi_put16(h + 184, 1);							// biPlanes
+	avi_put16(h + 186, 24);							// biBitCount, of the decoded frames
+	avi_put32(h + 188, AVI_FOURCC('M','J','P','G'));
+	avi_put32(h + 192, width * height * 3);			// biSizeImage
+	avi_put32(h + 212, AVI_FOURCC('L','I','S','T'));
+	avi_put32(h + 220, AVI_FOURCC('m','o','v','i'));
+	return avi_append(w, h, sizeof(h));
+}
+
+// Append one JPEG frame
+// Returns 0 on success, -1 if it was not written (write error, or the file would pass AVI_MAX_BYTES)
+int avi_writer_frame(AviWriter *w, const void *jpeg, uint32_t len)
+{
+	uint8_t ck[8];
+	uint32_t padded = len + (len & 1);				// Chunks start on even offsets
+
+	if (w->bytes + 8 + padded + (w->index.size() + 1) * sizeof(AviIndexEntry) + 8 > AVI_MAX_BYTES)
+		return -1;
+	AviIndexEntry e;
+	e.ckid = htole32(AVI_FOURCC('0','0','d','c'));
+	e.flags = htole32(AVIIF_KEYFRAME);				// Every JPEG decodes on its own
+	e.offset = htole32((uint32_t)(w->bytes - (AVI_HEADER_BYTES - 4)));
+	e.size = htole32(len);
+	w->index.push_back(e);
+	if (len > w->max_frame)
+		w->max_frame = len;
+
+	avi_put32(ck, AVI_FOURCC('0','0','d','c'));
+	avi_put32(ck + 4, len);
+	avi_append(w, ck, sizeof(ck));
+	avi_append(w, jpeg, len);
+	if (padded != len)
+		avi_append(w, "", 1);
+	return w->failed ? -1 : 0;
+}
+
+// Write the index and the header fields only known now, then flush the file to disk and
+// close it
+// Returns 0 on success, -1 if any write failed (the file is closed either way)
+int avi_writer_close(AviWriter *w)
+{
+	uint8_t ck[8];
+	uint8_t v[4];
+	uint32_t frames = w->index.size();
+	uint32_t movi = (uint32_t)(w->bytes - (AVI_HEADER_BYTES - 4));
+
+	avi_put32(ck, AVI_FOURCC('i','d','x','1'));
+	avi_put32(ck + 4, frames * sizeof(AviIndexEntry));
+	avi_append(w, ck, sizeof(ck));
+	if (frames > 0)
+		avi_append(w, w->index.data(), frames * sizeof(AviIndexEntry));
+	avi_flush(w);
+
+	// Patch the sizes and counts in place, the recorder keeps the first page cached for this
+	struct { off_t off; uint32_t value; } fields[] = {
+		{ AVI_RIFF_SIZE, (uint32_t)(w->bytes - 8) },
+		{ AVI_AVIH_FRAMES, frames },
+		{ AVI_AVIH_FRAMES + 12, w->max_frame + 8 },	// avih.dwSuggestedBufferSize
+		{ AVI_STRH_LENGTH, frames },
+		{ AVI_STRH_LENGTH + 4, w->max_frame + 8 },	// strh.dwSuggestedBufferSize
+		{ AVI_MOVI_SIZE, movi },
+	};
+	for (unsigned i = 0; i < sizeof(fields) / sizeof(fields[0]) && !w->failed; i++)
+	{
+		avi_put32(v, fields[i].value);
+		if (pwrite(w->fd, v, 4, fields[i].off) != 4)
+			w->failed = true;
+	}
+	if (fdatasync(w->fd) < 0)
+		w->failed = true;
+	close(w->fd);
+	w->fd = -1;
+	free(w->buf);
+	w->buf = NULL;
+	w->index.clear();
+	return w->failed ? -1 : 0;
+}
+
+#endif // AVI_WRITER_H
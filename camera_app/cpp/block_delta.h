@@ -0,0 +1,186 @@
+/**************************************************************************************************
+* @file        block_delta.h
+* @version     0.1.1
+* @type:       Block-delta encoding of greyscale frames
+* @brief       Most frames of a static scene differ from the previous one in a few blocks only.
+*              A delta frame carries just the DELTA_BLOCK x DELTA_BLOCK blocks whose sum of
+*              absolute differences against the viewer's reference exceeds the threshold:
+*                 uint16 block_size | uint16 num_blocks | num_blocks x (uint16 index | pixels)
+*              index counts blocks row by row, pixels are the block's rows (clipped at the right
+*              and bottom edges), all little endian. The reference is the viewer's reconstructed
+*              image: the encoder patches its copy with the same blocks, so the two never drift.
+*              Shared with the bundled C++ client, which applies deltas with delta_apply().
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef BLOCK_DELTA_H
+#define BLOCK_DELTA_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace cv;
+
+#define DELTA_BLOCK				16		// Block edge in pixels
+#define DELTA_PIXEL_THRESHOLD	4		// Mean absolute difference per pixel that marks a block changed
+#define DELTA_HEADER_LEN		4		// block_size, num_blocks
+#define DELTA_KEYFRAME_INTERVAL	150		// Full frame at least every N frames (5 s at 30 fps)
+#define DELTA_KEYFRAME_SHARE	0.5		// Send a full frame instead when more blocks changed
+
+
+// Sum of absolute differences of two full 16x16 blocks
+static inline uint32_t block_sad16(const uchar *a, size_t stride_a, const uchar *b, size_t stride_b)
+{
+#if defined(__SSE2__)
+	__m128i sum = _mm_setzero_si128();
+	for (int y = 0; y < DELTA_BLOCK; y++)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + y * stride_a));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + y * stride_b));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+	}
+	return (uint32_t)(_mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4));
+#elif defined(__ARM_NEON)
+	uint16x8_t sum = vdupq_n_u16(0);
+	for (int y = 0; y < DELTA_BLOCK; y++)
+	{
+		uint8x16_t va = vld1q_u8(a + y * stride_a);
+		uint8x16_t vb = vld1q_u8(b + y * stride_b);
+		sum = vabal_u8(sum, vget_low_u8(va), vget_low_u8(vb));
+		sum = vabal_u8(sum, vget_high_u8(va), vget_high_u8(vb));
+	}
+	uint32x4_t sum32 = vpaddlq_u16(sum);
+	uint64x2_t sum64 = vpaddlq_u32(sum32);
+	return (uint32_t)(vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1));
+#else
+	uint32_t sum = 0;
+	for (int y = 0; y < DELTA_BLOCK; y++)
+		for (int x = 0; x < DELTA_BLOCK; x++)
+			sum += abs(a[y * stride_a + x] - b[y * stride_b + x]);
+	return sum;
+#endif
+}
+
+// Sum of absolute differences of a w x h block clipped at the frame edge
+static inline uint32_t block_sad(const uchar *a, size_t stride_a, const uchar *b, size_t stride_b, int w, int h)
+{
+	if (w == DELTA_BLOCK && h == DELTA_BLOCK)
+		return block_sad16(a, stride_a, b, stride_b);
+	uint32_t sum = 0;
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+			sum += abs(a[y * stride_a + x] - b[y * stride_b + x]);
+	return sum;
+}
+
+// List the blocks of cur (CV_8UC1) that changed against ref in changed, stopping as soon as more
+// than max_blocks did: past that the frame goes out whole and the rest of the scan is wasted
+// Returns the number of blocks that changed, -1 if more than max_blocks
+int delta_changed(const Mat &cur, const Mat &ref, int max_blocks, std::vector<uint16_t> &changed)
+{
+	int bcols = (cur.cols + DELTA_BLOCK - 1) / DELTA_BLOCK;
+	int brows = (cur.rows + DELTA_BLOCK - 1) / DELTA_BLOCK;
+
+	changed.clear();
+	for (int by = 0; by < brows; by++)
+	{
+		int y0 = by * DELTA_BLOCK;
+		int h = std::min(DELTA_BLOCK, cur.rows - y0);
+		for (int bx = 0; bx < bcols; bx++)
+		{
+			int x0 = bx * DELTA_BLOCK;
+			int w = std::min(DELTA_BLOCK, cur.cols - x0);
+			if (block_sad(cur.ptr<uchar>(y0) + x0, cur.step, ref.ptr<uchar>(y0) + x0, ref.step, w, h) <=
+				(uint32_t)(DELTA_PIXEL_THRESHOLD * w * h))
+				continue;
+			if ((int)changed.size() >= max_blocks)
+				return -1;
+			changed.push_back(by * bcols + bx);
+		}
+	}
+	return changed.size();
+}
+
+// Pack the changed blocks of cur (from delta_changed()) into out, and copy them into ref
+// Returns the number of blocks sent
+int delta_encode(const Mat &cur, Mat &ref, const std::vector<uint16_t> &changed, std::vector<uchar> &out)
+{
+	int bcols = (cur.cols + DELTA_BLOCK - 1) / DELTA_BLOCK;
+	uint16_t num_blocks = changed.size();
+
+	out.resize(DELTA_HEADER_LEN);
+	for (size_t i = 0; i < changed.size(); i++)
+	{
+		int y0 = (changed[i] / bcols) * DELTA_BLOCK;
+		int x0 = (changed[i] % bcols) * DELTA_BLOCK;
+		int h = std::min(DELTA_BLOCK, cur.rows - y0);
+		int w = std::min(DELTA_BLOCK, cur.cols - x0);
+		const uchar *src = cur.ptr<uchar>(y0) + x0;
+		uchar *dst = ref.ptr<uchar>(y0) + x0;
+
+		uint16_t index = htole16(changed[i]);
+		size_t off = out.size();
+		out.resize(off + sizeof(index) + w * h);
+		memcpy(&out[off], &index, sizeof(index));
+		off += sizeof(index);
+		for (int y = 0; y < h; y++, off += w)
+		{
+			memcpy(&out[off], src + y * cur.step, w);
+			memcpy(dst + y * ref.step, src + y * cur.step, w);
+		}
+	}
+	uint16_t hdr[2] = { htole16(DELTA_BLOCK), htole16(num_blocks) };
+	memcpy(out.data(), hdr, sizeof(hdr));
+	return num_blocks;
+}
+
+// Patch ref (CV_8UC1, the size of the frame) with a delta payload
+// Returns 0 on success, -1 if the payload is malformed
+int delta_apply(const uchar *payload, size_t len, Mat &ref)
+{
+	uint16_t hdr[2];
+	if (len < DELTA_HEADER_LEN)
+		return -1;
+	memcpy(hdr, payload, sizeof(hdr));
+	int block = le16toh(hdr[0]);
+	int num_blocks = le16toh(hdr[1]);
+	if (block <= 0)
+		return -1;
+	int bcols = (ref.cols + block - 1) / block;
+	int brows = (ref.rows + block - 1) / block;
+
+	size_t off = DELTA_HEADER_LEN;
+	for (int i = 0; i < num_blocks; i++)
+	{
+		uint16_t index;
+		if (off + sizeof(index) > len)
+			return -1;
+		memcpy(&index, payload + off, sizeof(index));
+		index = le16toh(index);
+		off += sizeof(index);
+		if (index >= bcols * brows)
+			return -1;
+		int x0 = (index % bcols) * block;
+		int y0 = (index / bcols) * block;
+		int w = std::min(block, ref.cols - x0);
+		int h = std::min(block, ref.rows - y0);
+		if (off + (size_t)w * h > len)
+			return -1;
+		for (int y = 0; y < h; y++, off += w)
+			memcpy(ref.ptr<uchar>(y0 + y) + x0, payload + off, w);
+	}
+	return 0;
+}
+
+#endif // BLOCK_DELTA_H
@@ -0,0 +1,105 @@
+/**************************************************************************************************
+* @file        capture_sched.h
+* @version     0.1.1
+* @type:       Capture pacing on absolute CLOCK_MONOTONIC deadlines
+* @brief       Replaces the usleep(time_sleep) pacing of the capture loop. Deadlines advance by
+*              exactly one frame period, so the time spent grabbing, detecting and drawing a frame
+*              no longer adds to the period. A frame that finishes after its successor's deadline
+*              is counted as an overrun and the schedule restarts from the current time instead
+*              of trying to catch up with a burst of frames.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef CAPTURE_SCHED_H
+#define CAPTURE_SCHED_H
+
+#include <atomic>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_SEC	1000000000L
+
+typedef struct
+{
+	struct timespec next;				// Absolute deadline of the next frame
+	long period_ns;						// Frame period in nanoseconds
+	std::atomic<uint64_t> frames;		// Deadlines reached
+	std::atomic<uint64_t> overruns;		// Frames that finished after the following deadline
+	std::atomic<long> max_late_ns;		// Worst lateness seen since the last stats report
+} CaptureSched;
+
+
+// Add ns nanoseconds to a timespec
+static inline void timespec_add_ns(struct timespec *t, long ns)
+{
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= NSEC_PER_SEC)
+	{
+		t->tv_nsec -= NSEC_PER_SEC;
+		t->tv_sec++;
+	}
+}
+
+// Return a - b in nanoseconds
+static inline long timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+// Change the frame period, takes effect from the next deadline
+void capture_sched_set_rate(CaptureSched *sched, float frame_rate)
+{
+	if (frame_rate <= 0)
+		frame_rate = 1;
+	sched->period_ns = (long)(NSEC_PER_SEC / frame_rate);
+}
+
+// Start the schedule: the first deadline is one period from now
+void capture_sched_init(CaptureSched *sched, float frame_rate)
+{
+	capture_sched_set_rate(sched, frame_rate);
+	clock_gettime(CLOCK_MONOTONIC, &sched->next);
+	timespec_add_ns(&sched->next, sched->period_ns);
+	sched->frames.store(0);
+	sched->overruns.store(0);
+	sched->max_late_ns.store(0);
+}
+
+// Sleep until the next deadline and advance it by one period
+// Returns how late the caller was in nanoseconds (0 when the deadline was met)
+long capture_sched_wait(CaptureSched *sched)
+{
+	struct timespec now;
+	long late;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = timespec_diff_ns(&now, &sched->next);
+	if (late < 0)
+	{
+		// On time, sleep to the absolute deadline (restart if interrupted by a signal)
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sched->next, NULL) == EINTR);
+		late = 0;
+	}
+	else if (late > sched->max_late_ns.load(std::memory_order_relaxed))
+	{
+		sched->max_late_ns.store(late, std::memory_order_relaxed);
+	}
+
+	sched->frames.fetch_add(1, std::memory_order_relaxed);
+	timespec_add_ns(&sched->next, sched->period_ns);
+
+	// Missed the following deadline as well: count the overrun and restart the schedule from now
+	if (late >= sched->period_ns)
+	{
+		sched->overruns.fetch_add(1, std::memory_order_relaxed);
+		sched->next = now;
+		timespec_add_ns(&sched->next, sched->period_ns);
+	}
+	return late;
+}
+
+#endif // CAPTURE_SCHED_H
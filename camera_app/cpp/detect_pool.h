@@ -0,0 +1,266 @@
+/**************************************************************************************************
+* @file        detect_pool.h
+* @version     0.1.1
+* @type:       Multi-core face cascade evaluation
+* @brief       Worker pool that splits one detectMultiScale call across CPU cores by pyramid scale.
+*                 - The scale levels detectMultiScale would visit are computed up front and cut
+*                   into contiguous bands of roughly equal cost (cost ~ pixels of the scaled image)
+*                 - Each band is one job: the worker runs the cascade with minSize/maxSize set to
+*                   the band's first and last window size and minNeighbors = 0, so it returns the
+*                   raw candidates of exactly those levels
+*                 - The candidates of all bands are grouped with groupRectangles(minNeighbors,
+*                   0.2), the same grouping detectMultiScale applies, so the result matches the
+*                   single threaded call
+*                 - Every worker owns its own CascadeClassifier (a classifier must not be used by
+*                   two threads at once); the pool is shared by all cameras
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef DETECT_POOL_H
+#define DETECT_POOL_H
+
+#include <atomic>
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "opencv2/opencv.hpp"
+
+using namespace cv;
+
+#define DETECT_SCALE_FACTOR		1.1		// Same pyramid step as runCascade()
+#define DETECT_MIN_NEIGHBORS	2		// Same grouping as runCascade()
+#define DETECT_GROUP_EPS		0.2		// detectMultiScale's grouping tolerance
+
+struct DetectBatch;
+
+typedef struct
+{
+	const Mat *img;					// Detection frame
+	Rect roi;						// Area of img to search
+	int region;						// Index of roi in the caller's region list
+	Size minSize;					// Band: smallest window
+	Size maxSize;					// Band: largest window
+	std::vector<Rect> found;		// Raw candidates in img coordinates
+	struct DetectBatch *batch;
+} DetectJob;
+
+typedef struct DetectBatch
+{
+	int remaining;					// Jobs not finished yet (pool lock)
+} DetectBatch;
+
+typedef struct
+{
+	int nworkers;
+	pthread_t *threads;
+	CascadeClassifier *cascades;	// One classifier per worker
+	Size window;					// Cascade's original window size
+	pthread_mutex_t lock;
+	pthread_cond_t work;			// Jobs queued or shutdown
+	pthread_cond_t done;			// A batch finished
+	std::deque<DetectJob*> jobs;
+	bool shutdown;
+	std::atomic<uint64_t> batches;	// detect_pool_run() calls
+	std::atomic<uint64_t> bands;	// Jobs run by the workers
+} DetectPool;
+
+typedef struct
+{
+	DetectPool *pool;
+	int id;
+} DetectWorkerArg;
+
+
+static void *detect_worker(void *ptr)
+{
+	DetectWorkerArg *arg = (DetectWorkerArg*) ptr;
+	DetectPool *pool = arg->pool;
+	CascadeClassifier &cascade = pool->cascades[arg->id];
+	delete arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->shutdown)
+	{
+		if (pool->jobs.empty())
+		{
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		DetectJob *job = pool->jobs.front();
+		pool->jobs.pop_front();
+		pthread_mutex_unlock(&pool->lock);
+
+		cascade.detectMultiScale((*job->img)(job->roi), job->found, DETECT_SCALE_FACTOR, 0,
+								 CASCADE_SCALE_IMAGE, job->minSize, job->maxSize);
+		for (size_t i = 0; i < job->found.size(); i++)
+		{
+			job->found[i].x += job->roi.x;
+			job->found[i].y += job->roi.y;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (--job->batch->remaining == 0)
+			pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Load one copy of the cascade per worker and start nworkers threads
+// Returns 0 on success, -1 if the cascade could not be loaded
+int detect_pool_init(DetectPool *pool, int nworkers, const String &cascade_path)
+{
+	pool->nworkers = nworkers;
+	pool->cascades = new CascadeClassifier[nworkers];
+	for (int i = 0; i < nworkers; i++)
+	{
+		if (!pool->cascades[i].load(cascade_path))
+		{
+			syslog(LOG_DEBUG, "Detect pool: failed to load %s", cascade_path.c_str());
+			delete[] pool->cascades;
+			return -1;
+		}
+	}
+	pool->window = pool->cascades[0].getOriginalWindowSize();
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->shutdown = false;
+	pool->batches.store(0);
+	pool->bands.store(0);
+
+	pool->threads = new pthread_t[nworkers];
+	for (int i = 0; i < nworkers; i++)
+	{
+		DetectWorkerArg *arg = new DetectWorkerArg;
+		arg->pool = pool;
+		arg->id = i;
+		pthread_create(&pool->threads[i], NULL, detect_worker, arg);
+	}
+	return 0;
+}
+
+// Stop and join the workers
+void detect_pool_destroy(DetectPool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->threads[i], NULL);
+	delete[] pool->threads;
+	delete[] pool->cascades;
+}
+
+// Cut the pyramid levels detectMultiScale visits on an image of size sz into at most nbands
+// contiguous bands of similar cost, returned as (minSize, maxSize) window pairs
+static void detect_pool_bands(DetectPool *pool, Size sz, Size minSize, int nbands,
+							  std::vector<std::pair<Size, Size> > &bands)
+{
+	std::vector<Size> windows;
+	std::vector<double> costs;
+	double total = 0;
+
+	// Same level walk as CascadeClassifier::detectMultiScale
+	for (double factor = 1; ; factor *= DETECT_SCALE_FACTOR)
+	{
+		Size win(cvRound(pool->window.width * factor), cvRound(pool->window.height * factor));
+		Size scaled(cvRound(sz.width / factor), cvRound(sz.height / factor));
+		if (win.width > sz.width || win.height > sz.height)
+			break;
+		if (scaled.width < pool->window.width || scaled.height < pool->window.height)
+			break;
+		if (win.width < minSize.width || win.height < minSize.height)
+			continue;
+		windows.push_back(win);
+		costs.push_back((double)scaled.width * scaled.height);
+		total += costs.back();
+	}
+
+	bands.clear();
+	double target = total / nbands;
+	double acc = 0;
+	size_t first = 0;
+	for (size_t i = 0; i < windows.size(); i++)
+	{
+		acc += costs[i];
+		if (acc >= target || i + 1 == windows.size())
+		{
+			bands.push_back(std::make_pair(windows[first], windows[i]));
+			first = i + 1;
+			acc = 0;
+		}
+	}
+}
+
+// Detect faces in the given regions of img (the whole image when regions is NULL) using every
+// worker, faces are appended in img coordinates. Safe to call from several threads at once
+// Returns the number of faces found
+int detect_pool_run(DetectPool *pool, const Mat &img, const std::vector<Rect> *regions,
+					Size minSize, std::vector<Rect> &faces)
+{
+	std::vector<Rect> rois;
+	std::vector<std::pair<Size, Size> > bands;
+	std::vector<DetectJob> jobs;
+	DetectBatch batch;
+	Rect bounds(0, 0, img.cols, img.rows);
+
+	faces.clear();
+	if (regions == NULL)
+		rois.push_back(bounds);
+	else
+		for (size_t i = 0; i < regions->size(); i++)
+			rois.push_back((*regions)[i] & bounds);
+
+	// Build every job first, the vector must not reallocate once workers hold pointers into it
+	for (size_t r = 0; r < rois.size(); r++)
+	{
+		if (rois[r].width < minSize.width || rois[r].height < minSize.height)
+			continue;
+		detect_pool_bands(pool, rois[r].size(), minSize, pool->nworkers, bands);
+		for (size_t b = 0; b < bands.size(); b++)
+		{
+			DetectJob job;
+			job.img = &img;
+			job.roi = rois[r];
+			job.region = (int)r;
+			job.minSize = bands[b].first;
+			job.maxSize = bands[b].second;
+			job.batch = &batch;
+			jobs.push_back(job);
+		}
+	}
+	if (jobs.empty())
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	batch.remaining = (int)jobs.size();
+	for (size_t i = 0; i < jobs.size(); i++)
+		pool->jobs.push_back(&jobs[i]);
+	pthread_cond_broadcast(&pool->work);
+	while (batch.remaining > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	pool->batches.fetch_add(1, std::memory_order_relaxed);
+	pool->bands.fetch_add(jobs.size(), std::memory_order_relaxed);
+
+	// Group the raw candidates of each region the way detectMultiScale does
+	std::vector<Rect> candidates;
+	for (size_t r = 0; r < rois.size(); r++)
+	{
+		candidates.clear();
+		for (size_t i = 0; i < jobs.size(); i++)
+			if (jobs[i].region == (int)r)
+				candidates.insert(candidates.end(), jobs[i].found.begin(), jobs[i].found.end());
+		groupRectangles(candidates, DETECT_MIN_NEIGHBORS, DETECT_GROUP_EPS);
+		faces.insert(faces.end(), candidates.begin(), candidates.end());
+	}
+	return (int)faces.size();
+}
+
+#endif // DETECT_POOL_H
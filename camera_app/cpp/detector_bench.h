@@ -0,0 +1,120 @@
+/**************************************************************************************************
+* @file        detector_bench.h
+* @version     0.1.1
+* @type:       Face detector backend comparison
+* @brief       Runs every detector backend over the same local clip (-B <clip>) and prints, per
+*              backend:
+*                 - ms/frame: average and worst detect() time at the detection resolution
+*                 - memory:   resident set growth from loading the model and from running it
+*                 - hit rate: share of frames with at least one face, and with at least one face
+*                             that passes eye verification
+*              Frames go through the same greyscale / resize / equalize path as the live pipeline.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef DETECTOR_BENCH_H
+#define DETECTOR_BENCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include "opencv2/opencv.hpp"
+#include "face_detector.h"
+#include "face_verify.h"
+
+using namespace cv;
+
+// Resident set size of this process in kB, 0 if /proc is unavailable
+static long resident_kb()
+{
+	char line[128];
+	long kb = 0;
+	FILE *fp = fopen("/proc/self/status", "r");
+	if (fp == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (strncmp(line, "VmRSS:", 6) == 0)
+		{
+			kb = atol(line + 6);
+			break;
+		}
+	}
+	fclose(fp);
+	return kb;
+}
+
+// Benchmark every backend on clip. Frames are scaled to 640x480 like the capture stage
+// Returns 0 on success, -1 if the clip could not be opened
+int benchmark_detectors(const char *clip, const String &model_dir, Size detect_size, int nworkers,
+						const String &eyes_path)
+{
+	FaceVerifier verifier;
+	Mat frame, gray, smallImg;
+	std::vector<Rect> faces;
+	Size frame_size(640, 480);
+
+	verifier_init(&verifier, 0);
+	bool eyes = verifier_load(&verifier, eyes_path) == 0;
+	printf("%-6s %8s %10s %10s %10s %12s %9s %9s\n",
+		   "model", "frames", "avg ms", "max ms", "load MB", "run MB", "hit rate", "eyes");
+	for (int type = 0; type < DETECTOR_COUNT; type++)
+	{
+		VideoCapture cap(clip);
+		if (!cap.isOpened())
+		{
+			fprintf(stderr, "Cannot open benchmark clip %s\n", clip);
+			return -1;
+		}
+
+		long rss_start = resident_kb();
+		FaceDetector *detector = create_detector(type, model_dir, nworkers);
+		if (detector == NULL)
+		{
+			printf("%-6s model not found in %s\n", detector_name(type), model_dir.c_str());
+			continue;
+		}
+		long rss_loaded = resident_kb();
+
+		uint64_t frames = 0, hits = 0, verified = 0;
+		double total_ms = 0, max_ms = 0;
+		Size minSize = detectMinSize(detect_size, frame_size);
+		while (cap.read(frame) && !frame.empty())
+		{
+			if (frame.size() != frame_size)
+				resize(frame, frame, frame_size);
+			if (frame.channels() == 1)
+				gray = frame;
+			else
+				cvtColor(frame, gray, COLOR_BGR2GRAY);
+			prepareDetectFrame(gray, detect_size, smallImg);
+
+			double t = (double)getTickCount();
+			int found = detector->detect(smallImg, NULL, minSize, faces);
+			double ms = ((double)getTickCount() - t) * 1000 / getTickFrequency();
+
+			frames++;
+			hits += found > 0;
+			if (found > 0 && eyes)
+			{
+				mapRects(faces, smallImg.size(), gray.size());
+				verified += verify_faces(&verifier, gray, faces) > 0;
+			}
+			total_ms += ms;
+			if (ms > max_ms)
+				max_ms = ms;
+		}
+		long rss_run = resident_kb();
+
+		printf("%-6s %8llu %10.2f %10.2f %10.1f %12.1f %8.1f%% %8.1f%%\n", detector->name(),
+			   (unsigned long long)frames, frames ? total_ms / frames : 0.0, max_ms,
+			   (rss_loaded - rss_start) / 1024.0, (rss_run - rss_loaded) / 1024.0,
+			   frames ? 100.0 * hits / frames : 0.0, frames ? 100.0 * verified / frames : 0.0);
+		delete detector;
+	}
+	return 0;
+}
+
+#endif // DETECTOR_BENCH_H
@@ -0,0 +1,270 @@
+/**************************************************************************************************
+* @file        face_detector.h
+* @version     0.1.1
+* @type:       Face detector backends
+* @brief       Common interface in front of the face detection models selectable with -m.
+*                 - DETECTOR_HAAR: haarcascade_frontalface_alt.xml (the original detector)
+*                 - DETECTOR_LBP:  lbpcascade_frontalface_improved.xml, integer features, several
+*                                  times cheaper than Haar on ARM
+*                 - DETECTOR_DNN:  OpenCV res10 SSD face model (Caffe), CPU only
+*              All model files are read from one model directory (-M). Cascade backends run on
+*              the multi-core detect pool when it has more than one worker.
+*              A detector is used by one detect thread at a time: every camera runs its own
+*              clone(), with its own copy of the model, so cameras never wait on each other.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [OpenCV Cascade Classifier](https://docs.opencv.org/4.x/db/d28/tutorial_cascade_classifier.html)
+*					- [OpenCV face detector model](https://github.com/opencv/opencv/tree/4.x/samples/dnn/face_detector)
+*
+**************************************************************************************************/
+
+#ifndef FACE_DETECTOR_H
+#define FACE_DETECTOR_H
+
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+#include "opencv2/opencv.hpp"
+#include "opencv2/dnn.hpp"
+#include "detect_pool.h"
+#include "facedetect.h"
+
+using namespace cv;
+
+// Detector backends selectable with -m
+enum { DETECTOR_HAAR, DETECTOR_LBP, DETECTOR_DNN, DETECTOR_COUNT };
+
+#define HAAR_FACE_XML		"haarcascade_frontalface_alt.xml"
+#define LBP_FACE_XML		"lbpcascade_frontalface_improved.xml"
+#define DNN_FACE_CONFIG		"deploy.prototxt"
+#define DNN_FACE_MODEL		"res10_300x300_ssd_iter_140000_fp16.caffemodel"
+#define DNN_INPUT_SIZE		300		// SSD input resolution
+#define DNN_CONFIDENCE		0.5		// Minimum score of a reported face
+
+class FaceDetector
+{
+public:
+	virtual ~FaceDetector() {}
+	// Backend name used in logs and benchmark reports
+	virtual const char *name() const = 0;
+	// Find faces in a prepared detection frame (see prepareDetectFrame), only inside regions
+	// when regions is not NULL. Faces are in detection frame coordinates
+	// Not to be called from two threads at once. Returns the number of faces
+	virtual int detect(const Mat &img, const std::vector<Rect> *regions, Size minSize,
+					   std::vector<Rect> &faces) = 0;
+	// Detector for another detect thread: its own copy of the model, sharing the worker pool
+	// Returns NULL if the model could not be loaded again
+	virtual FaceDetector *clone() const = 0;
+	// Worker pool behind the detector, NULL if it runs on the calling thread
+	virtual DetectPool *pool() const { return NULL; }
+};
+
+// Haar or LBP cascade, split across the detect pool or run on the detector's own classifier
+class CascadeDetector : public FaceDetector
+{
+public:
+	CascadeDetector(const char *label) : label(label), workers(NULL), owns_pool(false)
+	{
+	}
+
+	~CascadeDetector()
+	{
+		if (workers != NULL && owns_pool)
+		{
+			detect_pool_destroy(workers);
+			delete workers;
+		}
+	}
+
+	// Load the cascade, with a pool of nworkers threads when nworkers > 1
+	// Returns 0 on success, -1 if the cascade could not be loaded
+	int load(const String &path, int nworkers)
+	{
+		this->path = path;
+		if (!cascade.load(path))
+		{
+			syslog(LOG_DEBUG, "Failed to load face cascade %s", path.c_str());
+			return -1;
+		}
+		if (nworkers > 1)
+		{
+			workers = new DetectPool;
+			owns_pool = true;
+			if (detect_pool_init(workers, nworkers, path) < 0)
+			{
+				delete workers;
+				workers = NULL;
+				owns_pool = false;
+			}
+		}
+		return 0;
+	}
+
+	const char *name() const { return label; }
+	DetectPool *pool() const { return workers; }
+
+	// The pool takes jobs from every camera at once and has a classifier per worker: clones share
+	// it, and it stays owned by this detector. Without a pool the clone loads its own classifier
+	FaceDetector *clone() const
+	{
+		CascadeDetector *copy = new CascadeDetector(label);
+		copy->path = path;
+		copy->workers = workers;
+		if (workers == NULL && copy->load(path, 1) < 0)
+		{
+			delete copy;
+			return NULL;
+		}
+		return copy;
+	}
+
+	int detect(const Mat &img, const std::vector<Rect> *regions, Size minSize, std::vector<Rect> &faces)
+	{
+		// Pyramid scales split across the worker pool, same faces as a single cascade run
+		if (workers != NULL)
+			return detect_pool_run(workers, img, regions, minSize, faces);
+
+		// The classifier is this detector's own, no other camera runs it
+		if (regions == NULL)
+			runCascade(img, cascade, minSize, faces);
+		else
+			runCascadeInRegions(img, cascade, minSize, *regions, faces);
+		return (int)faces.size();
+	}
+
+private:
+	const char *label;
+	String path;
+	CascadeClassifier cascade;
+	DetectPool *workers;
+	bool owns_pool;				// Clones share the pool of the detector they were made from
+};
+
+// SSD face network, every search area is scaled to DNN_INPUT_SIZE
+class DnnDetector : public FaceDetector
+{
+public:
+	// Returns 0 on success, -1 if the network could not be read
+	int load(const String &config, const String &model)
+	{
+		this->config = config;
+		this->model = model;
+		try
+		{
+			net = dnn::readNetFromCaffe(config, model);
+		}
+		catch (const cv::Exception &e)
+		{
+			syslog(LOG_DEBUG, "Failed to load face network %s: %s", model.c_str(), e.what());
+			return -1;
+		}
+		if (net.empty())
+			return -1;
+		net.setPreferableBackend(dnn::DNN_BACKEND_OPENCV);
+		net.setPreferableTarget(dnn::DNN_TARGET_CPU);
+		return 0;
+	}
+
+	const char *name() const { return "dnn"; }
+
+	FaceDetector *clone() const
+	{
+		DnnDetector *copy = new DnnDetector;
+		if (copy->load(config, model) < 0)
+		{
+			delete copy;
+			return NULL;
+		}
+		return copy;
+	}
+
+	int detect(const Mat &img, const std::vector<Rect> *regions, Size minSize, std::vector<Rect> &faces)
+	{
+		faces.clear();
+		// Net::forward() keeps per-network state, every camera has its own network
+		if (regions == NULL)
+			detectIn(img, Rect(0, 0, img.cols, img.rows), minSize, faces);
+		else
+			for (size_t i = 0; i < regions->size(); i++)
+				detectIn(img, (*regions)[i] & Rect(0, 0, img.cols, img.rows), minSize, faces);
+		return (int)faces.size();
+	}
+
+private:
+	// Run the network on img(roi) and append the faces found, in img coordinates
+	void detectIn(const Mat &img, Rect roi, Size minSize, std::vector<Rect> &faces)
+	{
+		if (roi.width < minSize.width || roi.height < minSize.height)
+			return;
+		// The model was trained on BGR images, mean values from the model's deploy notes
+		cvtColor(img(roi), bgr, COLOR_GRAY2BGR);
+		blob = dnn::blobFromImage(bgr, 1.0, Size(DNN_INPUT_SIZE, DNN_INPUT_SIZE),
+								  Scalar(104.0, 177.0, 123.0), false, false);
+		net.setInput(blob);
+		Mat out = net.forward();
+
+		// Output 1x1xNx7: [image, label, confidence, x1, y1, x2, y2], corners normalized to 0..1
+		Mat det(out.size[2], out.size[3], CV_32F, out.ptr<float>());
+		for (int i = 0; i < det.rows; i++)
+		{
+			if (det.at<float>(i, 2) < DNN_CONFIDENCE)
+				continue;
+			Rect r(Point(cvRound(det.at<float>(i, 3) * roi.width), cvRound(det.at<float>(i, 4) * roi.height)),
+				   Point(cvRound(det.at<float>(i, 5) * roi.width), cvRound(det.at<float>(i, 6) * roi.height)));
+			r &= Rect(0, 0, roi.width, roi.height);
+			if (r.width < minSize.width || r.height < minSize.height)
+				continue;
+			faces.push_back(Rect(r.x + roi.x, r.y + roi.y, r.width, r.height));
+		}
+	}
+
+	String config, model;
+	dnn::Net net;
+	Mat bgr;					// Scratch buffers
+	Mat blob;
+};
+
+// Backend name as given to -m, NULL for an unknown type
+const char *detector_name(int type)
+{
+	static const char *names[DETECTOR_COUNT] = { "haar", "lbp", "dnn" };
+	return type >= 0 && type < DETECTOR_COUNT ? names[type] : NULL;
+}
+
+// Backend type for a -m argument, -1 if unknown
+int detector_type(const char *name)
+{
+	for (int type = 0; type < DETECTOR_COUNT; type++)
+		if (strcmp(name, detector_name(type)) == 0)
+			return type;
+	return -1;
+}
+
+// Create and load a detector backend from the files in model_dir (with trailing '/')
+// Cascade backends use nworkers threads. Returns NULL if the model could not be loaded
+FaceDetector *create_detector(int type, const String &model_dir, int nworkers)
+{
+	if (type == DETECTOR_DNN)
+	{
+		DnnDetector *dnn = new DnnDetector;
+		if (dnn->load(model_dir + DNN_FACE_CONFIG, model_dir + DNN_FACE_MODEL) < 0)
+		{
+			delete dnn;
+			return NULL;
+		}
+		return dnn;
+	}
+
+	CascadeDetector *cascade = new CascadeDetector(detector_name(type));
+	if (cascade->load(model_dir + (type == DETECTOR_LBP ? LBP_FACE_XML : HAAR_FACE_XML), nworkers) < 0)
+	{
+		delete cascade;
+		return NULL;
+	}
+	return cascade;
+}
+
+#endif // FACE_DETECTOR_H
@@ -0,0 +1,183 @@
+/**************************************************************************************************
+* @file        face_tracker.h
+* @version     0.1.1
+* @type:       Lightweight face tracking between cascade detections
+* @brief       Follows the faces found by the last cascade run so the cascade only has to run
+*              every detect_interval frames, or sooner when tracking confidence drops.
+*                 - TRACKER_TEMPLATE: normalized cross correlation of the face patch from the
+*                   last detection, searched in a window around each face
+*                 - TRACKER_FLOW: sparse Lucas-Kanade optical flow of corner points inside each
+*                   face, the face moves by the median point displacement
+*              All rectangles are in detection resolution coordinates.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [OpenCV Template Matching](https://docs.opencv.org/4.x/de/da9/tutorial_template_matching.html)
+*					- [OpenCV Optical Flow](https://docs.opencv.org/4.x/d4/dee/tutorial_optical_flow.html)
+*
+**************************************************************************************************/
+
+#ifndef FACE_TRACKER_H
+#define FACE_TRACKER_H
+
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include "opencv2/opencv.hpp"
+#include "opencv2/video.hpp"
+
+using namespace cv;
+
+// Tracker types selectable with -t
+enum { TRACKER_TEMPLATE, TRACKER_FLOW };
+
+#define TRACK_SEARCH_MARGIN		0.5		// Template search window: face grown by this fraction per side
+#define TRACK_MIN_CONFIDENCE	0.6		// Re-run the cascade when any face falls below this
+#define TRACK_FLOW_POINTS		20		// Corner points tracked per face
+
+typedef struct
+{
+	int type;							// TRACKER_TEMPLATE or TRACKER_FLOW
+	int detect_interval;				// Run the cascade every N frames (1 = every frame)
+	int since_detect;					// Frames since the last cascade run
+	std::vector<Rect> rects;			// Tracked faces
+	std::vector<Mat> templates;			// TRACKER_TEMPLATE: face patches from the last detection
+	Mat prev;							// TRACKER_FLOW: previous frame
+	std::atomic<uint64_t> detections;	// Frames that ran the cascade
+	std::atomic<uint64_t> tracked;		// Frames handled by the tracker alone
+	std::atomic<uint64_t> lost;			// Early cascade runs forced by low confidence
+} FaceTracker;
+
+
+void tracker_init(FaceTracker *tracker, int type, int detect_interval)
+{
+	tracker->type = type;
+	tracker->detect_interval = detect_interval < 1 ? 1 : detect_interval;
+	tracker->since_detect = tracker->detect_interval;	// First frame always runs the cascade
+	tracker->rects.clear();
+	tracker->templates.clear();
+	tracker->detections.store(0);
+	tracker->tracked.store(0);
+	tracker->lost.store(0);
+}
+
+// True when the next frame has to go through the cascade
+bool tracker_needs_detect(FaceTracker *tracker)
+{
+	return tracker->since_detect >= tracker->detect_interval;
+}
+
+// Restart tracking from a fresh cascade result on frame
+void tracker_reset(FaceTracker *tracker, const Mat &frame, const std::vector<Rect> &faces)
+{
+	tracker->rects = faces;
+	tracker->since_detect = 0;
+	tracker->detections.fetch_add(1, std::memory_order_relaxed);
+	if (tracker->type == TRACKER_TEMPLATE)
+	{
+		tracker->templates.resize(faces.size());
+		for (size_t i = 0; i < faces.size(); i++)
+			frame(faces[i]).copyTo(tracker->templates[i]);
+	}
+	else
+	{
+		frame.copyTo(tracker->prev);
+	}
+}
+
+// Locate each face template in a window around its last position
+static double track_template(FaceTracker *tracker, const Mat &frame)
+{
+	Rect bounds(0, 0, frame.cols, frame.rows);
+	double confidence = 1.0;
+	Mat result;
+
+	for (size_t i = 0; i < tracker->rects.size(); i++)
+	{
+		Rect &r = tracker->rects[i];
+		int mx = cvRound(r.width * TRACK_SEARCH_MARGIN);
+		int my = cvRound(r.height * TRACK_SEARCH_MARGIN);
+		Rect window = Rect(r.x - mx, r.y - my, r.width + 2 * mx, r.height + 2 * my) & bounds;
+		if (window.width < r.width || window.height < r.height)
+			return 0;
+
+		double maxVal;
+		Point maxLoc;
+		matchTemplate(frame(window), tracker->templates[i], result, TM_CCOEFF_NORMED);
+		minMaxLoc(result, NULL, &maxVal, NULL, &maxLoc);
+		r.x = window.x + maxLoc.x;
+		r.y = window.y + maxLoc.y;
+		confidence = std::min(confidence, maxVal);
+	}
+	return confidence;
+}
+
+// Move each face by the median optical flow of the corners found inside it
+static double track_flow(FaceTracker *tracker, const Mat &frame)
+{
+	Rect bounds(0, 0, frame.cols, frame.rows);
+	double confidence = 1.0;
+	std::vector<Point2f> p0, p1;
+	std::vector<uchar> status;
+	std::vector<float> err;
+
+	for (size_t i = 0; i < tracker->rects.size(); i++)
+	{
+		Rect &r = tracker->rects[i];
+		Mat mask = Mat::zeros(frame.rows, frame.cols, CV_8UC1);
+		mask(r & bounds).setTo(Scalar(255));
+		goodFeaturesToTrack(tracker->prev, p0, TRACK_FLOW_POINTS, 0.01, 3, mask);
+		if (p0.empty())
+			return 0;
+
+		calcOpticalFlowPyrLK(tracker->prev, frame, p0, p1, status, err);
+		std::vector<float> dx, dy;
+		for (size_t k = 0; k < p0.size(); k++)
+		{
+			if (status[k])
+			{
+				dx.push_back(p1[k].x - p0[k].x);
+				dy.push_back(p1[k].y - p0[k].y);
+			}
+		}
+		// Confidence: share of the face's corners that were found again
+		confidence = std::min(confidence, (double)dx.size() / p0.size());
+		if (dx.empty())
+			return 0;
+		std::nth_element(dx.begin(), dx.begin() + dx.size() / 2, dx.end());
+		std::nth_element(dy.begin(), dy.begin() + dy.size() / 2, dy.end());
+		r.x += cvRound(dx[dx.size() / 2]);
+		r.y += cvRound(dy[dy.size() / 2]);
+		r &= bounds;
+	}
+	frame.copyTo(tracker->prev);
+	return confidence;
+}
+
+// Follow the tracked faces onto frame
+// Returns false when confidence dropped and the cascade should run on this frame instead
+bool tracker_update(FaceTracker *tracker, const Mat &frame, std::vector<Rect> &faces)
+{
+	tracker->since_detect++;
+	if (!tracker->rects.empty())
+	{
+		double confidence = tracker->type == TRACKER_TEMPLATE ?
+				track_template(tracker, frame) : track_flow(tracker, frame);
+		if (confidence < TRACK_MIN_CONFIDENCE)
+		{
+			tracker->lost.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	}
+	else if (tracker->type == TRACKER_FLOW)
+	{
+		frame.copyTo(tracker->prev);
+	}
+	faces = tracker->rects;
+	tracker->tracked.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+#endif // FACE_TRACKER_H
@@ -0,0 +1,145 @@
+/**************************************************************************************************
+* @file        face_verify.h
+* @version     0.1.1
+* @type:       Eye verification of candidate faces before they trigger a recording
+* @brief       A single false positive of the face detector used to start a recording. With
+*              verification on (-e K) a face only counts when:
+*                 - the eye cascade finds at least VERIFY_MIN_EYES eye inside the upper part of
+*                   the face rectangle, searched at VERIFY_FACE_WIDTH pixels wide
+*                 - a verified face was seen on K consecutive detect frames
+*              Counters give the share of candidate runs that were confirmed (trigger precision
+*              against the unverified detector) and the time verification adds.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef FACE_VERIFY_H
+#define FACE_VERIFY_H
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "opencv2/opencv.hpp"
+#include "capture_sched.h"
+
+using namespace cv;
+
+#define VERIFY_FACE_WIDTH	100		// Face patches are scaled to this width for the eye search
+#define VERIFY_EYE_BAND		0.6		// Eyes are searched in this top fraction of the face
+#define VERIFY_MIN_EYES		1		// One eye is enough: glasses and head turns hide the other
+
+typedef struct
+{
+	int confirm_frames;						// K consecutive verified frames to trigger, 0 = off
+	int streak;								// Consecutive frames with a verified face
+	bool candidate;							// Previous frame had a candidate face
+	struct timespec run_start;				// Capture time of the first frame of the candidate run
+	CascadeClassifier eyes_cascade;			// This camera's own copy of the eye cascade
+	Mat patch;								// Scratch: face patch at verification size
+	std::vector<Rect> eyes;
+	std::atomic<uint64_t> candidate_frames;	// Frames with at least one detector face
+	std::atomic<uint64_t> verified_frames;	// Frames with at least one eye-verified face
+	std::atomic<uint64_t> candidate_runs;	// Runs of candidate frames (recordings without verification)
+	std::atomic<uint64_t> triggers;			// Runs confirmed on confirm_frames frames
+	std::atomic<uint64_t> verify_us;		// Eye cascade time
+	std::atomic<uint64_t> verify_max_us;
+	std::atomic<uint64_t> confirm_us;		// Time from the first candidate frame to the trigger
+	std::atomic<uint64_t> confirm_max_us;
+} FaceVerifier;
+
+
+void verifier_init(FaceVerifier *v, int confirm_frames)
+{
+	v->confirm_frames = confirm_frames < 0 ? 0 : confirm_frames;
+	v->streak = 0;
+	v->candidate = false;
+	v->candidate_frames.store(0);
+	v->verified_frames.store(0);
+	v->candidate_runs.store(0);
+	v->triggers.store(0);
+	v->verify_us.store(0);
+	v->verify_max_us.store(0);
+	v->confirm_us.store(0);
+	v->confirm_max_us.store(0);
+}
+
+static void atomic_max(std::atomic<uint64_t> &max, uint64_t val)
+{
+	if (val > max.load(std::memory_order_relaxed))
+		max.store(val, std::memory_order_relaxed);
+}
+
+// Load the eye cascade of the verifier, every camera has its own so none waits on another
+// Returns 0 on success, -1 if the cascade could not be loaded
+int verifier_load(FaceVerifier *v, const String &path)
+{
+	return v->eyes_cascade.load(path) ? 0 : -1;
+}
+
+// Keep only the faces with eyes in them. gray and faces are full frame
+// Returns the number of faces kept
+int verify_faces(FaceVerifier *v, const Mat &gray, std::vector<Rect> &faces)
+{
+	Rect bounds(0, 0, gray.cols, gray.rows);
+	size_t kept = 0;
+	double t = (double)getTickCount();
+
+	for (size_t i = 0; i < faces.size(); i++)
+	{
+		Rect band = Rect(faces[i].x, faces[i].y, faces[i].width,
+						 cvRound(faces[i].height * VERIFY_EYE_BAND)) & bounds;
+		if (band.empty())
+			continue;
+		int height = cvRound((double)band.height * VERIFY_FACE_WIDTH / band.width);
+		resize(gray(band), v->patch, Size(VERIFY_FACE_WIDTH, height), 0, 0, INTER_AREA);
+
+		v->eyes_cascade.detectMultiScale(v->patch, v->eyes, 1.1, 2, CASCADE_SCALE_IMAGE);
+		if ((int)v->eyes.size() >= VERIFY_MIN_EYES)
+			faces[kept++] = faces[i];
+	}
+	faces.resize(kept);
+
+	uint64_t us = (uint64_t)(((double)getTickCount() - t) * 1e6 / getTickFrequency());
+	v->verify_us.fetch_add(us, std::memory_order_relaxed);
+	atomic_max(v->verify_max_us, us);
+	return (int)kept;
+}
+
+// Feed the outcome of one detect frame captured at ts
+// Returns true while a verified face has been seen on confirm_frames consecutive frames
+bool verifier_confirm(FaceVerifier *v, int candidates, int verified, const struct timespec *ts)
+{
+	if (candidates == 0)
+	{
+		v->candidate = false;
+		v->streak = 0;
+		return false;
+	}
+	v->candidate_frames.fetch_add(1, std::memory_order_relaxed);
+	if (!v->candidate)
+	{
+		// Without verification this frame would have started a recording
+		v->candidate = true;
+		v->run_start = *ts;
+		v->candidate_runs.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (verified == 0)
+	{
+		v->streak = 0;
+		return false;
+	}
+	v->verified_frames.fetch_add(1, std::memory_order_relaxed);
+	if (++v->streak == v->confirm_frames)
+	{
+		uint64_t us = timespec_diff_ns(ts, &v->run_start) / 1000;
+		v->triggers.fetch_add(1, std::memory_order_relaxed);
+		v->confirm_us.fetch_add(us, std::memory_order_relaxed);
+		atomic_max(v->confirm_max_us, us);
+	}
+	return v->streak >= v->confirm_frames;
+}
+
+#endif // FACE_VERIFY_H
@@ -1,3 +1,6 @@
+#ifndef FACEDETECT_H
+#define FACEDETECT_H
+
 #include "opencv2/objdetect.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
@@ -6,18 +9,106 @@
 
 using namespace cv;
 
-void detectAndDraw( Mat& img, CascadeClassifier& cascade,
-                    CascadeClassifier& nestedCascade,
-                    int *flag);
+void prepareDetectFrame( const Mat& gray, Size detectSize, Mat& smallImg );
+Size detectMinSize( Size detectSize, Size frameSize );
+int runCascade( const Mat& smallImg, CascadeClassifier& cascade, Size minSize,
+                std::vector<Rect>& faces );
+int runCascadeInRegions( const Mat& smallImg, CascadeClassifier& cascade, Size minSize,
+                         const std::vector<Rect>& regions, std::vector<Rect>& faces );
+void mapRects( std::vector<Rect>& rects, Size from, Size to );
+int detectFaces( const Mat& gray, CascadeClassifier& cascade, Size detectSize,
+                 std::vector<Rect>& faces, Mat& smallImg, double *detect_ms );
+void drawFaces( Mat& img, const std::vector<Rect>& faces );
+
 
+// Shrink a greyscale frame to the detection resolution and equalize it
+// Cascade cost scales with pixel count. smallImg is a scratch buffer reused between calls
+void prepareDetectFrame( const Mat& gray, Size detectSize, Mat& smallImg )
+{
+    if ( gray.size() == detectSize )
+        equalizeHist( gray, smallImg );
+    else
+    {
+        resize( gray, smallImg, detectSize, 0, 0, INTER_AREA );
+        equalizeHist( smallImg, smallImg );
+    }
+}
+
+// Smallest face to look for at the detection resolution: 30x30 full frame pixels
+Size detectMinSize( Size detectSize, Size frameSize )
+{
+    return Size( cvRound(30.0 * detectSize.width / frameSize.width),
+                 cvRound(30.0 * detectSize.height / frameSize.height) );
+}
+
+// Run the face cascade on a prepared detection frame, faces are in detection coordinates
+int runCascade( const Mat& smallImg, CascadeClassifier& cascade, Size minSize,
+                std::vector<Rect>& faces )
+{
+    cascade.detectMultiScale( smallImg, faces,
+        1.1, 2, 0
+        //|CASCADE_FIND_BIGGEST_OBJECT
+        //|CASCADE_DO_ROUGH_SEARCH
+        |CASCADE_SCALE_IMAGE,
+        minSize );
+    return (int)faces.size();
+}
 
-void detectAndDraw( Mat& img, CascadeClassifier& cascade,
-                    CascadeClassifier& nestedCascade,
-                    int *flag)
+// Run the face cascade only inside regions of a prepared detection frame (detection coordinates)
+// Regions must not overlap, otherwise a face could be reported twice
+int runCascadeInRegions( const Mat& smallImg, CascadeClassifier& cascade, Size minSize,
+                         const std::vector<Rect>& regions, std::vector<Rect>& faces )
+{
+    Rect bounds( 0, 0, smallImg.cols, smallImg.rows );
+    std::vector<Rect> found;
+
+    faces.clear();
+    for ( size_t i = 0; i < regions.size(); i++ )
+    {
+        Rect roi = regions[i] & bounds;
+        // Too small to hold the smallest face
+        if ( roi.width < minSize.width || roi.height < minSize.height )
+            continue;
+        runCascade( smallImg(roi), cascade, minSize, found );
+        for ( size_t k = 0; k < found.size(); k++ )
+            faces.push_back( Rect(found[k].x + roi.x, found[k].y + roi.y, found[k].width, found[k].height) );
+    }
+    return (int)faces.size();
+}
+
+// Scale rectangles from an image of size from to an image of size to
+void mapRects( std::vector<Rect>& rects, Size from, Size to )
+{
+    double sx = (double)to.width / from.width;
+    double sy = (double)to.height / from.height;
+    for ( size_t i = 0; i < rects.size(); i++ )
+    {
+        Rect &r = rects[i];
+        r = Rect(cvRound(r.x*sx), cvRound(r.y*sy), cvRound(r.width*sx), cvRound(r.height*sy));
+    }
+}
+
+// Run the face cascade on a greyscale frame and return the number of faces found
+// The frame is shrunk to detectSize first, the faces are returned in full frame coordinates
+// Detection only: drawing happens later on whichever frame is current (see drawFaces)
+int detectFaces( const Mat& gray, CascadeClassifier& cascade, Size detectSize,
+                 std::vector<Rect>& faces, Mat& smallImg, double *detect_ms )
+{
+    double t = (double)getTickCount();
+    prepareDetectFrame( gray, detectSize, smallImg );
+    runCascade( smallImg, cascade, detectMinSize(detectSize, gray.size()), faces );
+    t = (double)getTickCount() - t;
+    *detect_ms = t*1000/getTickFrequency();
+    TRACE_LOG( "detection time = %g ms at %dx%d", *detect_ms, detectSize.width, detectSize.height );
+
+    // Map the rectangles back to full resolution
+    mapRects( faces, smallImg.size(), gray.size() );
+    return (int)faces.size();
+}
+
+// Mark detected faces on img: a circle for face shaped rectangles, otherwise the rectangle
+void drawFaces( Mat& img, const std::vector<Rect>& faces )
 {
-    double t = 0;
-    double scale = 1;
-    std::vector<Rect> faces;
     const static Scalar colors[] =
     {
         Scalar(255,0,0),
@@ -29,28 +120,10 @@ void detectAndDraw( Mat& img, CascadeClassifier& cascade,
         Scalar(0,0,255),
         Scalar(255,0,255)
     };
-    Mat gray, smallImg;
 
-    cvtColor( img, gray, COLOR_BGR2GRAY );
-    double fx = 1 / scale;
-    resize( gray, smallImg, Size(), fx, fx, INTER_LINEAR_EXACT );
-    equalizeHist( smallImg, smallImg );
-
-    t = (double)getTickCount();
-    cascade.detectMultiScale( smallImg, faces,
-        1.1, 2, 0
-        //|CASCADE_FIND_BIGGEST_OBJECT
-        //|CASCADE_DO_ROUGH_SEARCH
-        |CASCADE_SCALE_IMAGE,
-        Size(30, 30) );
-
-    t = (double)getTickCount() - t;
-//    printf( "detection time = %g ms\n", t*1000/getTickFrequency());
     for ( size_t i = 0; i < faces.size(); i++ )
     {
         Rect r = faces[i];
-        Mat smallImgROI;
-        std::vector<Rect> nestedObjects;
         Point center;
         Scalar color = colors[i%8];
         int radius;
@@ -58,18 +131,16 @@ void detectAndDraw( Mat& img, CascadeClassifier& cascade,
         double aspect_ratio = (double)r.width/r.height;
         if( 0.75 < aspect_ratio && aspect_ratio < 1.3 )
         {
-            center.x = cvRound((r.x + r.width*0.5)*scale);
-            center.y = cvRound((r.y + r.height*0.5)*scale);
-            radius = cvRound((r.width + r.height)*0.25*scale);
+            center.x = cvRound(r.x + r.width*0.5);
+            center.y = cvRound(r.y + r.height*0.5);
+            radius = cvRound((r.width + r.height)*0.25);
             circle( img, center, radius, color, 3, 8, 0 );
         }
         else
-            rectangle( img, Point(cvRound(r.x*scale), cvRound(r.y*scale)),
-                       Point(cvRound((r.x + r.width-1)*scale), cvRound((r.y + r.height-1)*scale)),
+            rectangle( img, Point(r.x, r.y),
+                       Point(r.x + r.width-1, r.y + r.height-1),
                        color, 3, 8, 0);
-        if( nestedCascade.empty() )
-	    break;
-        *flag = 1;
-
     }
 }
+
+#endif // FACEDETECT_H
@@ -0,0 +1,164 @@
+/**************************************************************************************************
+* @file        frame_proto.h
+* @version     0.1.1
+* @type:       Video stream wire format
+* @brief       Every frame sent on a camera port is framed as
+*                 FrameHeader | FaceRecord x num_faces | payload (payload_len bytes)
+*              All fields are little endian. Clients find the next frame from the lengths in the
+*              header instead of assuming 640x480 greyscale, check the magic to detect a broken
+*              stream, and see frames they missed as gaps in seq.
+*              Shared with the bundled C++ client (controller_app/cpp/client.cpp). The Python
+*              clients mirror the layout with struct.unpack("<IHHQQHHBBHII").
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef FRAME_PROTO_H
+#define FRAME_PROTO_H
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define FRAME_MAGIC				0x4d524643	// "CFRM" on the wire
+#define FRAME_PROTO_VERSION		1
+#define FRAME_MAX_FACES			32			// Face records sent with one frame
+
+// Pixel formats
+enum { FRAME_PIX_GRAY8 = 1 };
+// Payload encodings
+// FRAME_ENC_DELTA: changed blocks against the previous image of the stream (block_delta.h)
+enum { FRAME_ENC_RAW = 0, FRAME_ENC_JPEG = 1, FRAME_ENC_DELTA = 2 };
+
+typedef struct
+{
+	uint32_t magic;			// FRAME_MAGIC
+	uint16_t version;		// FRAME_PROTO_VERSION
+	uint16_t header_len;	// sizeof(FrameHeader) + num_faces * sizeof(FaceRecord)
+	uint64_t seq;			// Frame sequence number, gaps are frames this client did not get
+	uint64_t timestamp_ns;	// CLOCK_MONOTONIC capture time of the server
+	uint16_t width;
+	uint16_t height;
+	uint8_t pixfmt;			// FRAME_PIX_*
+	uint8_t encoding;		// FRAME_ENC_*
+	uint16_t num_faces;		// Face records following the header
+	uint32_t payload_len;	// Bytes of image data after the face records
+	uint32_t reserved;		// Zero
+} __attribute__((packed)) FrameHeader;
+
+typedef struct
+{
+	uint16_t x, y, width, height;	// Face rectangle in frame pixels
+} __attribute__((packed)) FaceRecord;
+
+
+// Fill hdr (wire byte order) and faces for a frame, returns the total header length
+static inline int frame_header_pack(FrameHeader *hdr, FaceRecord *faces, uint64_t seq,
+									const struct timespec *ts, int width, int height, int pixfmt,
+									int encoding, const int (*rects)[4], int num_faces,
+									uint32_t payload_len)
+{
+	if (num_faces > FRAME_MAX_FACES)
+		num_faces = FRAME_MAX_FACES;
+	int header_len = sizeof(FrameHeader) + num_faces * sizeof(FaceRecord);
+
+	hdr->magic = htole32(FRAME_MAGIC);
+	hdr->version = htole16(FRAME_PROTO_VERSION);
+	hdr->header_len = htole16(header_len);
+	hdr->seq = htole64(seq);
+	hdr->timestamp_ns = htole64((uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec);
+	hdr->width = htole16(width);
+	hdr->height = htole16(height);
+	hdr->pixfmt = pixfmt;
+	hdr->encoding = encoding;
+	hdr->num_faces = htole16(num_faces);
+	hdr->payload_len = htole32(payload_len);
+	hdr->reserved = 0;
+	for (int i = 0; i < num_faces; i++)
+	{
+		faces[i].x = htole16(rects[i][0]);
+		faces[i].y = htole16(rects[i][1]);
+		faces[i].width = htole16(rects[i][2]);
+		faces[i].height = htole16(rects[i][3]);
+	}
+	return header_len;
+}
+
+// Convert a received header to host byte order
+// Returns 0 if it is a frame header this version understands, -1 otherwise
+static inline int frame_header_unpack(FrameHeader *hdr)
+{
+	hdr->magic = le32toh(hdr->magic);
+	hdr->version = le16toh(hdr->version);
+	hdr->header_len = le16toh(hdr->header_len);
+	hdr->seq = le64toh(hdr->seq);
+	hdr->timestamp_ns = le64toh(hdr->timestamp_ns);
+	hdr->width = le16toh(hdr->width);
+	hdr->height = le16toh(hdr->height);
+	hdr->num_faces = le16toh(hdr->num_faces);
+	hdr->payload_len = le32toh(hdr->payload_len);
+	if (hdr->magic != FRAME_MAGIC || hdr->version != FRAME_PROTO_VERSION)
+		return -1;
+	if (hdr->header_len != sizeof(FrameHeader) + hdr->num_faces * sizeof(FaceRecord))
+		return -1;
+	return 0;
+}
+
+// Send every byte of iov[0..iovcnt), retrying short writes
+// Returns 0 on success, -1 on error (errno set)
+static inline int send_all_iov(int sock, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt > 0)
+	{
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		// Skip the fully sent entries and trim the partly sent one
+		while (iovcnt > 0 && (size_t)sent >= iov->iov_len)
+		{
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+// Receive exactly len bytes
+// Returns 0 on success, -1 on error or when the peer closed the connection
+static inline int recv_all(int sock, void *buf, size_t len)
+{
+	char *p = (char*)buf;
+	while (len > 0)
+	{
+		ssize_t got = recv(sock, p, len, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		p += got;
+		len -= got;
+	}
+	return 0;
+}
+
+#endif // FRAME_PROTO_H
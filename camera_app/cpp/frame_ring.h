@@ -0,0 +1,278 @@
+/**************************************************************************************************
+* @file        frame_ring.h
+* @version     0.1.1
+* @type:       Lock-free frame ring shared between the capture thread and frame consumers
+* @brief       Fixed set of preallocated frame slots. The capture thread fills a free slot and
+*              publishes it; consumers pin the most recently published slot and read it in place.
+*                 - Each slot carries a monotonic sequence number and a capture timestamp
+*                 - A slot's refs counter is FRAME_SLOT_WRITING while the publisher owns it,
+*                   otherwise it is the number of consumers currently reading it
+*                 - The publisher never waits: it skips pinned slots and drops the frame if
+*                   every slot is in use
+*                 - Consumers that want every frame block in frame_ring_wait() on a futex keyed
+*                   on the low 32 bits of the sequence number; the publisher only enters the
+*                   kernel when a consumer is actually waiting
+*                 - Consumers that also wait on other file descriptors subscribe an eventfd,
+*                   which is signalled once per published frame
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "opencv2/opencv.hpp"
+#include "futex.h"
+
+using namespace cv;
+
+#define FRAME_RING_SLOTS	8		// Publisher slot + latest frame + slots pinned by consumers
+#define FRAME_SLOT_WRITING	-1		// refs value while the publisher is filling a slot
+#define FRAME_RING_MAX_SUBSCRIBERS	64	// eventfds notified by one ring
+#define FRAME_RING_ZEROCOPY_SLOTS	(FRAME_RING_SLOTS / 2)	// Slots unfinished zero-copy sends may pin
+
+typedef struct
+{
+	Mat img;						// Preallocated frame buffer
+	uint64_t seq;					// Sequence number of the frame held in img (0 = never written)
+	struct timespec ts;				// CLOCK_MONOTONIC capture timestamp
+	std::vector<Rect> faces;		// Faces drawn on the frame (annotated and JPEG rings)
+	std::vector<uchar> data;		// Encoded image (JPEG ring only, img is unused)
+	Size size;						// Dimensions of the encoded image (JPEG ring only)
+	std::atomic<int> refs;			// Readers holding the slot, FRAME_SLOT_WRITING while being filled
+	std::atomic<int> zc_refs;		// Unfinished zero-copy sends of the slot, of any viewer
+} FrameSlot;
+
+typedef struct
+{
+	FrameSlot slots[FRAME_RING_SLOTS];
+	std::atomic<int> latest;		// Index of the most recently published slot, -1 before the first frame
+	std::atomic<uint64_t> seq;		// Sequence number of the most recently published frame
+	std::atomic<uint64_t> dropped;	// Frames dropped because every slot was pinned
+	std::atomic<uint32_t> notify;	// Futex word: low 32 bits of seq
+	std::atomic<int> waiters;		// Consumers blocked in frame_ring_wait()
+	int next;						// Slot the publisher tries first (publisher only)
+	pthread_mutex_t sub_lock;		// Protects subscribers, held only briefly by the publisher
+	int subscribers[FRAME_RING_MAX_SUBSCRIBERS];	// eventfds to signal, -1 = free entry
+	std::atomic<int> num_subscribers;	// Lets the publisher skip the lock when nobody subscribed
+	std::atomic<int> zc_slots;		// Slots with zc_refs > 0, at most FRAME_RING_ZEROCOPY_SLOTS
+} FrameRing;
+
+
+// Preallocate every slot of the ring with a continuous rows x cols image of the given type
+void frame_ring_init(FrameRing *ring, int rows, int cols, int type)
+{
+	for (int i = 0; i < FRAME_RING_SLOTS; i++)
+	{
+		ring->slots[i].img = Mat::zeros(rows, cols, type);
+		ring->slots[i].seq = 0;
+		ring->slots[i].ts.tv_sec = 0;
+		ring->slots[i].ts.tv_nsec = 0;
+		ring->slots[i].refs.store(0);
+		ring->slots[i].zc_refs.store(0);
+	}
+	ring->latest.store(-1);
+	ring->seq.store(0);
+	ring->dropped.store(0);
+	ring->notify.store(0);
+	ring->waiters.store(0);
+	ring->next = 0;
+	pthread_mutex_init(&ring->sub_lock, NULL);
+	for (int i = 0; i < FRAME_RING_MAX_SUBSCRIBERS; i++)
+		ring->subscribers[i] = -1;
+	ring->num_subscribers.store(0);
+	ring->zc_slots.store(0);
+}
+
+// Signal efd (an eventfd) every time a frame is published
+// Returns 0 on success, -1 if the subscriber table is full
+int frame_ring_subscribe(FrameRing *ring, int efd)
+{
+	int ret = -1;
+	pthread_mutex_lock(&ring->sub_lock);
+	for (int i = 0; i < FRAME_RING_MAX_SUBSCRIBERS; i++)
+	{
+		if (ring->subscribers[i] == -1)
+		{
+			ring->subscribers[i] = efd;
+			ring->num_subscribers.fetch_add(1);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ring->sub_lock);
+	return ret;
+}
+
+// Stop signalling efd. Once this returns the publisher no longer touches efd and it may be closed
+void frame_ring_unsubscribe(FrameRing *ring, int efd)
+{
+	pthread_mutex_lock(&ring->sub_lock);
+	for (int i = 0; i < FRAME_RING_MAX_SUBSCRIBERS; i++)
+	{
+		if (ring->subscribers[i] == efd)
+		{
+			ring->subscribers[i] = -1;
+			ring->num_subscribers.fetch_sub(1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ring->sub_lock);
+}
+
+// Claim a free slot for writing (publisher only)
+// Returns NULL and counts a dropped frame when every slot is pinned by a reader
+FrameSlot *frame_ring_begin_write(FrameRing *ring)
+{
+	int latest = ring->latest.load(std::memory_order_relaxed);
+	for (int i = 0; i < FRAME_RING_SLOTS; i++)
+	{
+		int idx = (ring->next + i) % FRAME_RING_SLOTS;
+		// Never overwrite the latest frame, new readers may still be about to pin it
+		if (idx == latest)
+			continue;
+		int expected = 0;
+		if (ring->slots[idx].refs.compare_exchange_strong(expected, FRAME_SLOT_WRITING,
+				std::memory_order_acquire, std::memory_order_relaxed))
+		{
+			ring->next = (idx + 1) % FRAME_RING_SLOTS;
+			return &ring->slots[idx];
+		}
+	}
+	ring->dropped.fetch_add(1, std::memory_order_relaxed);
+	return NULL;
+}
+
+// Give a claimed slot back without publishing it (publisher only)
+void frame_ring_abort_write(FrameSlot *slot)
+{
+	slot->refs.store(0, std::memory_order_release);
+}
+
+// Publish a filled slot as the latest frame (publisher only)
+// pins references are handed over with the slot, each must be dropped with frame_ring_release()
+// Returns the sequence number assigned to the frame
+uint64_t frame_ring_publish(FrameRing *ring, FrameSlot *slot, const struct timespec *ts, int pins = 0)
+{
+	uint64_t seq = ring->seq.load(std::memory_order_relaxed) + 1;
+	slot->seq = seq;
+	slot->ts = *ts;
+	slot->refs.store(pins, std::memory_order_release);
+	ring->latest.store((int)(slot - ring->slots), std::memory_order_release);
+	ring->seq.store(seq, std::memory_order_release);
+	// Wake consumers blocked in frame_ring_wait(), seq_cst pairs with the waiters increment there
+	ring->notify.store((uint32_t)seq, std::memory_order_seq_cst);
+	if (ring->waiters.load(std::memory_order_seq_cst) > 0)
+		futex_wake_all(&ring->notify);
+	// Signal the subscribed eventfds, the counter only says "something new", readers take the latest
+	if (ring->num_subscribers.load(std::memory_order_relaxed) > 0)
+	{
+		uint64_t one = 1;
+		pthread_mutex_lock(&ring->sub_lock);
+		for (int i = 0; i < FRAME_RING_MAX_SUBSCRIBERS; i++)
+		{
+			if (ring->subscribers[i] == -1)
+				continue;
+			// Non-blocking: EAGAIN means the counter is saturated, the subscriber is woken anyway
+			ssize_t ret = write(ring->subscribers[i], &one, sizeof(one));
+			(void)ret;
+		}
+		pthread_mutex_unlock(&ring->sub_lock);
+	}
+	return seq;
+}
+
+// Block until a frame newer than last_seq is published or timeout_ms expires
+// Returns the latest published sequence number (equal to last_seq on timeout)
+uint64_t frame_ring_wait(FrameRing *ring, uint64_t last_seq, int timeout_ms)
+{
+	uint64_t seq = ring->seq.load(std::memory_order_acquire);
+	if (seq != last_seq)
+		return seq;
+
+	ring->waiters.fetch_add(1, std::memory_order_seq_cst);
+	uint32_t val = ring->notify.load(std::memory_order_seq_cst);
+	if (val == (uint32_t)last_seq)
+		futex_wait(&ring->notify, val, timeout_ms);
+	ring->waiters.fetch_sub(1, std::memory_order_relaxed);
+
+	return ring->seq.load(std::memory_order_acquire);
+}
+
+// Pin the most recently published frame for reading
+// Returns NULL if nothing has been published yet. Must be paired with frame_ring_release()
+FrameSlot *frame_ring_acquire(FrameRing *ring)
+{
+	while (true)
+	{
+		int idx = ring->latest.load(std::memory_order_acquire);
+		if (idx < 0)
+			return NULL;
+		FrameSlot *slot = &ring->slots[idx];
+		int refs = slot->refs.load(std::memory_order_relaxed);
+		// refs < 0: the slot was reclaimed by the publisher after we read latest, start over
+		while (refs >= 0)
+		{
+			if (slot->refs.compare_exchange_weak(refs, refs + 1,
+					std::memory_order_acquire, std::memory_order_relaxed))
+				return slot;
+		}
+	}
+}
+
+// Take one more pin on a slot the caller already holds
+void frame_ring_retain(FrameSlot *slot)
+{
+	slot->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Unpin a slot obtained from frame_ring_acquire() or frame_ring_retain()
+void frame_ring_release(FrameSlot *slot)
+{
+	slot->refs.fetch_sub(1, std::memory_order_release);
+}
+
+// Pin a slot for a zero-copy send, the kernel reads its pages until the send completes
+// Returns false if that would leave the ring with more than FRAME_RING_ZEROCOPY_SLOTS such slots,
+// all viewers together, so slow zero-copy viewers cannot starve the publisher
+bool frame_ring_zerocopy_pin(FrameRing *ring, FrameSlot *slot)
+{
+	// Another send already counts the slot against the ring
+	int refs = slot->zc_refs.load();
+	while (refs > 0)
+	{
+		if (slot->zc_refs.compare_exchange_weak(refs, refs + 1))
+		{
+			frame_ring_retain(slot);
+			return true;
+		}
+	}
+	int used = ring->zc_slots.load();
+	do
+	{
+		if (used >= FRAME_RING_ZEROCOPY_SLOTS)
+			return false;
+	} while (!ring->zc_slots.compare_exchange_weak(used, used + 1));
+	// Give the reservation back if a concurrent send counted the slot first
+	if (slot->zc_refs.fetch_add(1) > 0)
+		ring->zc_slots.fetch_sub(1);
+	frame_ring_retain(slot);
+	return true;
+}
+
+// Unpin a slot pinned by frame_ring_zerocopy_pin()
+void frame_ring_zerocopy_release(FrameRing *ring, FrameSlot *slot)
+{
+	if (slot->zc_refs.fetch_sub(1) == 1)
+		ring->zc_slots.fetch_sub(1);
+	frame_ring_release(slot);
+}
+
+#endif // FRAME_RING_H
@@ -0,0 +1,54 @@
+/**************************************************************************************************
+* @file        futex.h
+* @version     0.1.1
+* @type:       Futex helpers
+* @brief       Thin wrappers around the futex system call (glibc provides no wrapper). Used by the
+*              frame ring and the stage queues to block consumers until the producer bumps a
+*              32-bit notification word, and by the shared memory ring across processes.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <atomic>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Sleep while *addr == val, for at most timeout_ms
+static inline void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, int timeout_ms)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+// Wake every thread sleeping on addr
+static inline void futex_wake_all(std::atomic<uint32_t> *addr)
+{
+	syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Process shared variants, for futex words in shared memory mapped by several processes
+static inline void futex_wait_shared(const std::atomic<uint32_t> *addr, uint32_t val, int timeout_ms)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, (const uint32_t*)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static inline void futex_wake_all_shared(std::atomic<uint32_t> *addr)
+{
+	syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif // FUTEX_H
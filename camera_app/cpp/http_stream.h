@@ -0,0 +1,170 @@
+/**************************************************************************************************
+* @file        http_stream.h
+* @version     0.1.1
+* @type:       HTTP requests served by the viewer event loop
+* @brief       Browsers and curl reach the cameras on the HTTP port (-H) without the Flask hop:
+*                 GET /video_feed?cam=N           multipart/x-mixed-replace MJPEG stream
+*                 GET /snapshot.jpg?cam=N         one JPEG frame
+*                 GET|POST /control?cam=N&cmd=C   control code C (100 / 200 / 300)
+*              cam defaults to 0. The stream and snapshot also take the viewer's subscription:
+*              fps=F (default every frame), tier=T (1/2^T size), quality=Q (default -q) and
+*              adaptive=1. Frames come from the JPEG ring of the encode stage, so an HTTP
+*              viewer costs a write of the shared buffer and nothing else.
+*              Only the request line is parsed; every response closes the connection.
+*              A request not complete, or a stream or snapshot without a frame, after
+*              HTTP_TIMEOUT_SECONDS is answered with 503.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [RFC 9112 HTTP/1.1](https://www.rfc-editor.org/rfc/rfc9112)
+*					- [multipart/x-mixed-replace](https://html.spec.whatwg.org/multipage/iana.html#multipart/x-mixed-replace)
+*
+**************************************************************************************************/
+
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HTTP_MAX_REQUEST		2048		// Request line and headers, larger requests are rejected
+#define HTTP_BOUNDARY			"frame"		// Same boundary the Flask app used
+#define HTTP_TIMEOUT_SECONDS	5			// Until the request and the first frame of the answer
+
+// Request targets
+enum { HTTP_STREAM, HTTP_SNAPSHOT, HTTP_CONTROL };
+
+typedef struct
+{
+	int route;				// HTTP_STREAM, HTTP_SNAPSHOT or HTTP_CONTROL
+	int cam;				// Camera index, 0 when not given
+	int cmd;				// HTTP_CONTROL: control code
+	bool has_cmd;
+	int fps;				// Subscription of the viewer, 0 = camera default
+	int tier;
+	int quality;
+	bool adaptive;
+} HttpRequest;
+
+
+// Value of an integer query parameter, def when it is missing
+static int http_query_int(const char *query, const char *name, int def, bool *found)
+{
+	size_t len = strlen(name);
+	const char *p = query;
+
+	while (p != NULL && *p != '\0')
+	{
+		if (strncmp(p, name, len) == 0 && p[len] == '=')
+		{
+			if (found != NULL)
+				*found = true;
+			return atoi(p + len + 1);
+		}
+		p = strchr(p, '&');
+		if (p != NULL)
+			p++;
+	}
+	return def;
+}
+
+// Parse the request held in buf[0..len)
+// Returns 0 while the headers are incomplete, otherwise the HTTP status to answer with:
+// 200 with req filled in, or 400 / 404 / 405 / 431
+int http_parse_request(const char *buf, size_t len, HttpRequest *req)
+{
+	char method[8], target[256];
+
+	if (memmem(buf, len, "\r\n\r\n", 4) == NULL && memmem(buf, len, "\n\n", 2) == NULL)
+		return len >= HTTP_MAX_REQUEST ? 431 : 0;
+	if (sscanf(buf, "%7s %255s HTTP/1.%*c", method, target) != 2)
+		return 400;
+
+	char *query = strchr(target, '?');
+	if (query != NULL)
+		*query++ = '\0';
+	bool post = strcmp(method, "POST") == 0;
+	if (strcmp(method, "GET") != 0 && !post)
+		return 405;
+
+	req->has_cmd = false;
+	req->cam = http_query_int(query, "cam", 0, NULL);
+	req->cmd = http_query_int(query, "cmd", 0, &req->has_cmd);
+	req->fps = http_query_int(query, "fps", 0, NULL);
+	req->tier = http_query_int(query, "tier", 0, NULL);
+	req->quality = http_query_int(query, "quality", 0, NULL);
+	req->adaptive = http_query_int(query, "adaptive", 0, NULL) != 0;
+	if (strcmp(target, "/control") == 0)
+	{
+		req->route = HTTP_CONTROL;
+		return req->has_cmd ? 200 : 400;
+	}
+	if (post)
+		return 405;
+	if (strcmp(target, "/video_feed") == 0 || strcmp(target, "/") == 0)
+		req->route = HTTP_STREAM;
+	else if (strcmp(target, "/snapshot.jpg") == 0)
+		req->route = HTTP_SNAPSHOT;
+	else
+		return 404;
+	return 200;
+}
+
+// Complete response with a short text body, returns its length
+int http_text_response(char *buf, size_t size, int status, const char *text)
+{
+	const char *reason;
+	switch (status)
+	{
+		case 200: reason = "OK"; break;
+		case 400: reason = "Bad Request"; break;
+		case 404: reason = "Not Found"; break;
+		case 405: reason = "Method Not Allowed"; break;
+		case 431: reason = "Request Header Fields Too Large"; break;
+		case 503: reason = "Service Unavailable"; break;
+		default:  reason = "Service Unavailable"; break;
+	}
+	return snprintf(buf, size,
+					"HTTP/1.1 %d %s\r\n"
+					"Content-Type: text/plain\r\n"
+					"Content-Length: %zu\r\n"
+					"Connection: close\r\n"
+					"\r\n%s", status, reason, strlen(text), text);
+}
+
+// Headers in front of one JPEG frame: the part header of the MJPEG stream, preceded by the
+// response header on the first frame, or the whole response header of a snapshot
+// Returns the header length
+int http_frame_header(char *buf, size_t size, int route, bool first, uint64_t seq, size_t jpeg_len)
+{
+	int len = 0;
+	if (route == HTTP_SNAPSHOT)
+		return snprintf(buf, size,
+						"HTTP/1.1 200 OK\r\n"
+						"Content-Type: image/jpeg\r\n"
+						"Content-Length: %zu\r\n"
+						"X-Frame-Seq: %llu\r\n"
+						"Cache-Control: no-cache\r\n"
+						"Connection: close\r\n"
+						"\r\n", jpeg_len, (unsigned long long)seq);
+	if (first)
+		len = snprintf(buf, size,
+					   "HTTP/1.1 200 OK\r\n"
+					   "Content-Type: multipart/x-mixed-replace; boundary=" HTTP_BOUNDARY "\r\n"
+					   "Cache-Control: no-cache\r\n"
+					   "Connection: close\r\n"
+					   "\r\n");
+	len += snprintf(buf + len, size - len,
+					"--" HTTP_BOUNDARY "\r\n"
+					"Content-Type: image/jpeg\r\n"
+					"Content-Length: %zu\r\n"
+					"X-Frame-Seq: %llu\r\n"
+					"\r\n", jpeg_len, (unsigned long long)seq);
+	return len;
+}
+
+#endif // HTTP_STREAM_H
@@ -0,0 +1,300 @@
+/**************************************************************************************************
+* @file        mcast_reader.h
+* @version     0.1.1
+* @type:       Receiver of a camera's multicast output (mcast_stream.h)
+* @brief       Joins the group and puts frames back together from their fragments:
+*                 - fragments of up to MCAST_REASSEMBLY_SLOTS frames may arrive interleaved and in
+*                   any order
+*                 - a frame is returned once complete; older frames still missing fragments are
+*                   given up then, fragments arriving later for them are ignored
+*                 - delta frames are only returned when every frame of their chain was, otherwise
+*                   the reader waits for the next keyframe
+*              Frames come back framed like on the camera port (FrameHeader | FaceRecords |
+*              payload), the caller decodes and applies them in the order returned:
+*                 McastReader reader;
+*                 McastFrame frame;
+*                 mcast_reader_open(&reader, group, port, iface);
+*                 while (mcast_reader_next(&reader, 1000, &frame) > 0)
+*                     ... frame.data, frame.len ...
+*              Needs no OpenCV, only frame_proto.h and mcast_stream.h.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef MCAST_READER_H
+#define MCAST_READER_H
+
+#include <poll.h>
+#include <time.h>
+#include "mcast_stream.h"
+
+#define MCAST_REASSEMBLY_SLOTS	4			// Frames reassembled at once
+#define MCAST_RCVBUF			(4 * 1024 * 1024)	// Room for bursts of keyframe fragments
+
+// Frame being reassembled
+typedef struct
+{
+	bool used;
+	uint64_t frame_seq;
+	uint64_t key_seq;
+	uint16_t chain;
+	bool key;
+	uint32_t frame_len;
+	uint16_t frag_count;
+	uint16_t received;
+	std::vector<uint8_t> data;
+	std::vector<bool> have;		// Fragments received
+} McastPartial;
+
+typedef struct
+{
+	int fd;
+	McastPartial slots[MCAST_REASSEMBLY_SLOTS];
+	std::vector<uint8_t> frame;	// Frame returned last
+	uint64_t last_frame;		// frame_seq of the frame returned last, older fragments are late
+	bool synced;				// Every frame since key_seq was returned: deltas apply
+	uint64_t key_seq;
+	uint16_t chain;
+	bool have_packet;
+	uint32_t next_packet;		// packet_seq expected next
+	uint64_t datagrams;			// Statistics
+	uint64_t lost;				// Datagrams missing from packet_seq
+	uint64_t reordered;			// Datagrams arriving after a later one
+	uint64_t late;				// Fragments of frames already returned or given up
+	uint64_t frames;			// Frames returned
+	uint64_t incomplete;		// Frames given up with fragments missing
+	uint64_t unsynced;			// Delta frames dropped while waiting for a keyframe
+} McastReader;
+
+// Complete frame, valid until the next mcast_reader_next()
+typedef struct
+{
+	const uint8_t *data;
+	uint32_t len;
+	uint64_t frame_seq;
+	bool key;
+} McastFrame;
+
+
+// Join group on the interface with address iface (INADDR_ANY: the default one) and bind port
+// Returns 0 on success, -1 on failure
+int mcast_reader_open(McastReader *reader, struct in_addr group, int port, struct in_addr iface)
+{
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	int on = 1;
+	int rcvbuf = MCAST_RCVBUF;
+
+	reader->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (reader->fd < 0)
+		return -1;
+	// Several viewers on one host share the port
+	setsockopt(reader->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(reader->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = group;				// Only the group's datagrams, not everything sent to the port
+	addr.sin_port = htons(port);
+	mreq.imr_multiaddr = group;
+	mreq.imr_interface = iface;
+	if (bind(reader->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+		setsockopt(reader->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+	{
+		close(reader->fd);
+		return -1;
+	}
+
+	for (int i = 0; i < MCAST_REASSEMBLY_SLOTS; i++)
+		reader->slots[i].used = false;
+	reader->last_frame = 0;
+	reader->synced = false;
+	reader->key_seq = 0;
+	reader->chain = 0;
+	reader->have_packet = false;
+	reader->next_packet = 0;
+	reader->datagrams = 0;
+	reader->lost = 0;
+	reader->reordered = 0;
+	reader->late = 0;
+	reader->frames = 0;
+	reader->incomplete = 0;
+	reader->unsynced = 0;
+	return 0;
+}
+
+void mcast_reader_close(McastReader *reader)
+{
+	close(reader->fd);
+}
+
+// Count lost and reordered datagrams from packet_seq
+static void mcast_reader_count(McastReader *reader, uint32_t packet_seq)
+{
+	reader->datagrams++;
+	if (!reader->have_packet)
+	{
+		reader->have_packet = true;
+		reader->next_packet = packet_seq + 1;
+		return;
+	}
+	int32_t gap = (int32_t)(packet_seq - reader->next_packet);
+	if (gap >= 0)
+	{
+		reader->lost += gap;
+		reader->next_packet = packet_seq + 1;
+	}
+	else
+	{
+		// Counted lost when its gap was seen, it was only late
+		reader->reordered++;
+		if (reader->lost > 0)
+			reader->lost--;
+	}
+}
+
+// Slot of frame_seq, a free one, or the oldest one given up for it
+static McastPartial *mcast_reader_slot(McastReader *reader, const McastHeader *h)
+{
+	McastPartial *free_slot = NULL, *oldest = NULL;
+	for (int i = 0; i < MCAST_REASSEMBLY_SLOTS; i++)
+	{
+		McastPartial *p = &reader->slots[i];
+		if (!p->used)
+		{
+			free_slot = p;
+			continue;
+		}
+		if (p->frame_seq == h->frame_seq)
+			return p;
+		if (oldest == NULL || p->frame_seq < oldest->frame_seq)
+			oldest = p;
+	}
+	McastPartial *p = free_slot;
+	if (p == NULL)
+	{
+		p = oldest;
+		reader->incomplete++;
+	}
+	p->used = true;
+	p->frame_seq = h->frame_seq;
+	p->key_seq = h->key_seq;
+	p->chain = h->chain;
+	p->key = h->flags & MCAST_FLAG_KEY;
+	p->frame_len = h->frame_len;
+	p->frag_count = h->frag_count;
+	p->received = 0;
+	p->data.resize(h->frame_len);
+	p->have.assign(h->frag_count, false);
+	return p;
+}
+
+// A frame is complete: give up the older ones and decide whether it can be used
+// Returns true if the frame is returned to the caller
+static bool mcast_reader_complete(McastReader *reader, McastPartial *p)
+{
+	for (int i = 0; i < MCAST_REASSEMBLY_SLOTS; i++)
+	{
+		McastPartial *q = &reader->slots[i];
+		if (q->used && q != p && q->frame_seq < p->frame_seq)
+		{
+			q->used = false;
+			reader->incomplete++;
+		}
+	}
+	p->used = false;
+	reader->last_frame = p->frame_seq;
+
+	// A delta applies to the keyframe it names patched with every frame of the chain before it
+	if (p->key)
+	{
+		reader->synced = true;
+		reader->key_seq = p->frame_seq;
+		reader->chain = 0;
+	}
+	else if (reader->synced && p->key_seq == reader->key_seq && p->chain == reader->chain + 1)
+		reader->chain = p->chain;
+	else
+	{
+		reader->synced = false;
+		reader->unsynced++;
+		return false;
+	}
+	reader->frame.swap(p->data);
+	reader->frames++;
+	return true;
+}
+
+// Wait up to timeout_ms for the next usable frame
+// Returns 1 with frame filled in, 0 on timeout, -1 on a socket error
+int mcast_reader_next(McastReader *reader, int timeout_ms, McastFrame *frame)
+{
+	uint8_t buf[MCAST_DATAGRAM];
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (true)
+	{
+		ssize_t len = recv(reader->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int left = timeout_ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+			if (left <= 0)
+				return 0;
+			struct pollfd pfd = { reader->fd, POLLIN, 0 };
+			poll(&pfd, 1, left);
+			continue;
+		}
+
+		McastHeader h;
+		if ((size_t)len < sizeof(h))
+			continue;
+		memcpy(&h, buf, sizeof(h));
+		h.magic = le32toh(h.magic);
+		h.frag_index = le16toh(h.frag_index);
+		h.frag_count = le16toh(h.frag_count);
+		h.chain = le16toh(h.chain);
+		h.packet_seq = le32toh(h.packet_seq);
+		h.frame_seq = le64toh(h.frame_seq);
+		h.key_seq = le64toh(h.key_seq);
+		h.frame_len = le32toh(h.frame_len);
+		if (h.magic != MCAST_MAGIC || h.version != MCAST_VERSION)
+			continue;
+		mcast_reader_count(reader, h.packet_seq);
+
+		// Fragment i holds [i * MCAST_FRAG_PAYLOAD, ...) of the frame, anything else is not ours
+		uint32_t off = (uint32_t)h.frag_index * MCAST_FRAG_PAYLOAD;
+		if (h.frame_len == 0 || h.frame_len > MCAST_MAX_FRAME ||
+			h.frag_count != (h.frame_len + MCAST_FRAG_PAYLOAD - 1) / MCAST_FRAG_PAYLOAD ||
+			h.frag_index >= h.frag_count ||
+			(size_t)len - sizeof(h) != std::min(MCAST_FRAG_PAYLOAD, h.frame_len - off))
+			continue;
+		if (h.frame_seq <= reader->last_frame)
+		{
+			reader->late++;
+			continue;
+		}
+
+		McastPartial *p = mcast_reader_slot(reader, &h);
+		if (p->frame_len != h.frame_len || p->frag_count != h.frag_count || p->have[h.frag_index])
+			continue;
+		memcpy(&p->data[off], buf + sizeof(h), len - sizeof(h));
+		p->have[h.frag_index] = true;
+		if (++p->received < p->frag_count || !mcast_reader_complete(reader, p))
+			continue;
+
+		frame->data = reader->frame.data();
+		frame->len = reader->frame.size();
+		frame->frame_seq = reader->last_frame;
+		frame->key = reader->chain == 0;
+		return 1;
+	}
+}
+
+#endif // MCAST_READER_H
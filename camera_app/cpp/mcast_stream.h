@@ -0,0 +1,235 @@
+/**************************************************************************************************
+* @file        mcast_stream.h
+* @version     0.1.1
+* @type:       UDP multicast output of a camera, sender side and datagram format
+* @brief       With -U every frame is sent once to a multicast group, however many viewers joined
+*              it; camera N uses port + N. A frame is the same FrameHeader | FaceRecords | payload
+*              the camera port sends (frame_proto.h), cut into fragments that each fit one
+*              datagram of an Ethernet MTU:
+*                 McastHeader | bytes frag_index * MCAST_FRAG_PAYLOAD ... of the frame
+*              packet_seq counts datagrams so receivers see losses, frame_seq orders frames.
+*              JPEG frames decode on their own. Block-delta frames (block_delta.h) build on every
+*              frame since the last keyframe: each carries the keyframe's frame_seq and its place
+*              in the chain, so a receiver that lost one waits for the next keyframe, which comes
+*              at least every MCAST_KEYFRAME_INTERVAL frames. Receivers: mcast_reader.h.
+*              All fields are little endian. Needs no OpenCV, only frame_proto.h.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [ip(7) multicast options](https://man7.org/linux/man-pages/man7/ip.7.html)
+*					- [sendmmsg(2)](https://man7.org/linux/man-pages/man2/sendmmsg.2.html)
+*
+**************************************************************************************************/
+
+#ifndef MCAST_STREAM_H
+#define MCAST_STREAM_H
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <vector>
+#include "frame_proto.h"
+
+#define MCAST_MAGIC				0x5453434d	// "MCST" on the wire
+#define MCAST_VERSION			1
+#define MCAST_DEFAULT_PORT		5000		// Camera N sends to port + N
+#define MCAST_DATAGRAM			1472		// 1500 byte MTU less the IP and UDP headers
+#define MCAST_FRAG_PAYLOAD		((uint32_t)(MCAST_DATAGRAM - sizeof(McastHeader)))	// Frame bytes per datagram
+#define MCAST_MAX_FRAME			(4 * 1024 * 1024)	// Larger frames are not sent (nor accepted)
+#define MCAST_KEYFRAME_INTERVAL	30			// Delta mode: full frame at least every N frames (1 s at 30 fps)
+#define MCAST_TTL				1			// Stay on the local network
+#define MCAST_SNDBUF			(1024 * 1024)	// A whole raw keyframe fits in the socket buffer
+
+// Frame flags
+#define MCAST_FLAG_KEY			0x01		// Decodes on its own
+
+typedef struct
+{
+	uint32_t magic;			// MCAST_MAGIC
+	uint8_t version;		// MCAST_VERSION
+	uint8_t flags;			// MCAST_FLAG_*
+	uint16_t frag_index;	// Fragment of the frame, 0 to frag_count - 1
+	uint16_t frag_count;
+	uint16_t chain;			// Frames since the keyframe, 0 on keyframes
+	uint32_t packet_seq;	// Datagrams sent on this group, gaps are lost datagrams
+	uint64_t frame_seq;		// Frame sequence number of the camera
+	uint64_t key_seq;		// frame_seq of the keyframe the frame builds on
+	uint32_t frame_len;		// Bytes of the whole frame
+	uint32_t reserved;		// Zero
+} __attribute__((packed)) McastHeader;
+
+typedef struct
+{
+	int fd;
+	uint32_t packet_seq;
+	uint64_t key_seq;		// Keyframe of the current delta chain
+	uint16_t chain;			// Frames sent since it
+	std::vector<McastHeader> hdrs;	// Per fragment of the frame being sent
+	std::vector<struct iovec> iov;
+	std::vector<struct mmsghdr> msgs;
+} McastSender;
+
+
+// Split "group[:port][@interface address]" into its parts, port and iface are left alone when
+// the spec does not name them
+// Returns 0 on success, -1 if group is not a multicast address
+int mcast_parse_address(const char *spec, struct in_addr *group, int *port, struct in_addr *iface)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s", spec);
+	char *at = strchr(buf, '@');
+	if (at != NULL)
+	{
+		*at++ = '\0';
+		if (inet_pton(AF_INET, at, iface) != 1)
+			return -1;
+	}
+	char *colon = strchr(buf, ':');
+	if (colon != NULL)
+	{
+		*colon++ = '\0';
+		*port = atoi(colon);
+	}
+	if (inet_pton(AF_INET, buf, group) != 1 || !IN_MULTICAST(ntohl(group->s_addr)))
+		return -1;
+	return 0;
+}
+
+// Open a socket sending to group:port, through the interface with address iface
+// (INADDR_ANY: the route of the group, 127.0.0.1 for loopback testing)
+// Returns 0 on success, -1 on failure
+int mcast_sender_open(McastSender *s, struct in_addr group, int port, struct in_addr iface)
+{
+	struct sockaddr_in addr;
+	unsigned char ttl = MCAST_TTL;
+	unsigned char loop = 1;				// Viewers on this host get the frames too
+	int sndbuf = MCAST_SNDBUF;
+
+	s->packet_seq = 0;
+	s->key_seq = 0;
+	s->chain = 0;
+	s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (s->fd < 0)
+		return -1;
+	setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	if (iface.s_addr != htonl(INADDR_ANY) &&
+		setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0)
+	{
+		syslog(LOG_DEBUG, "IP_MULTICAST_IF %s failed", inet_ntoa(iface));
+		close(s->fd);
+		return -1;
+	}
+	// Connected: every datagram goes to the group without a destination of its own
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = group;
+	addr.sin_port = htons(port);
+	if (connect(s->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		syslog(LOG_DEBUG, "Cannot send to multicast group %s:%d", inet_ntoa(group), port);
+		close(s->fd);
+		return -1;
+	}
+	return 0;
+}
+
+void mcast_sender_close(McastSender *s)
+{
+	close(s->fd);
+}
+
+// Delta frames the receivers apply before the next one must be a keyframe
+static inline bool mcast_sender_key_due(const McastSender *s)
+{
+	return s->chain + 1 >= MCAST_KEYFRAME_INTERVAL;
+}
+
+// Send one frame, head (FrameHeader and FaceRecords) followed by payload, as fragments in
+// one sendmmsg batch. Fragments point into head and payload, nothing is copied
+// Returns the number of datagrams sent, -1 on error
+int mcast_sender_send(McastSender *s, uint64_t frame_seq, bool key, const void *head, uint32_t head_len,
+					  const void *payload, uint32_t payload_len)
+{
+	uint32_t frame_len = head_len + payload_len;
+	int count = (frame_len + MCAST_FRAG_PAYLOAD - 1) / MCAST_FRAG_PAYLOAD;
+	if (frame_len > MCAST_MAX_FRAME)
+		return -1;
+	if (key)
+	{
+		s->key_seq = frame_seq;
+		s->chain = 0;
+	}
+	else
+		s->chain++;
+
+	// Sized before any pointer into them is taken
+	s->hdrs.resize(count);
+	s->iov.resize(count * 3);
+	s->msgs.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t off = i * MCAST_FRAG_PAYLOAD;
+		uint32_t end = std::min(off + MCAST_FRAG_PAYLOAD, frame_len);
+		McastHeader *h = &s->hdrs[i];
+		h->magic = htole32(MCAST_MAGIC);
+		h->version = MCAST_VERSION;
+		h->flags = key ? MCAST_FLAG_KEY : 0;
+		h->frag_index = htole16(i);
+		h->frag_count = htole16(count);
+		h->chain = htole16(s->chain);
+		h->packet_seq = htole32(s->packet_seq++);
+		h->frame_seq = htole64(frame_seq);
+		h->key_seq = htole64(s->key_seq);
+		h->frame_len = htole32(frame_len);
+		h->reserved = 0;
+
+		// McastHeader | the part of head in [off, end) | the part of payload in it
+		struct iovec *iov = &s->iov[i * 3];
+		int n = 0;
+		iov[n].iov_base = h;
+		iov[n++].iov_len = sizeof(*h);
+		if (off < head_len)
+		{
+			iov[n].iov_base = (char*)head + off;
+			iov[n++].iov_len = std::min(end, head_len) - off;
+		}
+		if (end > head_len)
+		{
+			uint32_t start = std::max(off, head_len);
+			iov[n].iov_base = (char*)payload + (start - head_len);
+			iov[n++].iov_len = end - start;
+		}
+		memset(&s->msgs[i], 0, sizeof(s->msgs[i]));
+		s->msgs[i].msg_hdr.msg_iov = iov;
+		s->msgs[i].msg_hdr.msg_iovlen = n;
+	}
+
+	int sent = 0;
+	while (sent < count)
+	{
+		int ret = sendmmsg(s->fd, &s->msgs[sent], count - sent, 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		sent += ret;
+	}
+	return count;
+}
+
+#endif // MCAST_STREAM_H
@@ -0,0 +1,136 @@
+/**************************************************************************************************
+* @file        motion_detect.h
+* @version     0.1.1
+* @type:       Frame differencing motion detector used to gate face detection
+* @brief       Keeps a running average background of a small copy of each frame and reports the
+*              bounding boxes of the regions that differ from it. The face cascade is then run
+*              only inside those regions, or skipped when nothing moves.
+*                 - Background: accumulateWeighted running average at MOTION_WIDTH x MOTION_HEIGHT
+*                 - Foreground: |frame - background| > MOTION_THRESHOLD, dilated to join blobs
+*                 - Regions smaller than MOTION_MIN_AREA are ignored (sensor noise, flicker)
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef MOTION_DETECT_H
+#define MOTION_DETECT_H
+
+#include <atomic>
+#include <stdint.h>
+#include "opencv2/opencv.hpp"
+
+using namespace cv;
+
+#define MOTION_WIDTH		160		// Motion analysis resolution
+#define MOTION_HEIGHT		120
+#define MOTION_LEARN_RATE	0.05	// Background adaptation per frame
+#define MOTION_THRESHOLD	25		// Grey level change counted as motion
+#define MOTION_MIN_AREA		20		// Smallest region in motion resolution pixels
+#define MOTION_FACE_MARGIN	0.25	// Regions are grown by this fraction per side before detection
+
+typedef struct
+{
+	Mat small;							// Frame at motion resolution
+	Mat background;						// Running average, CV_32F
+	Mat background8;					// Background converted for differencing
+	Mat mask;							// Foreground mask
+	Mat kernel;							// Dilation kernel
+	std::atomic<uint64_t> frames;		// Frames analysed
+	std::atomic<uint64_t> motion_frames;	// Frames with at least one region
+	std::atomic<uint64_t> regions;		// Regions reported
+	std::atomic<uint64_t> area_permille;	// Sum over frames of the share of the frame in motion
+	std::atomic<uint64_t> skipped;		// Cascade runs skipped because nothing moved
+} MotionDetector;
+
+
+void motion_init(MotionDetector *motion)
+{
+	motion->background.release();
+	motion->kernel = getStructuringElement(MORPH_RECT, Size(5, 5));
+	motion->frames.store(0);
+	motion->motion_frames.store(0);
+	motion->regions.store(0);
+	motion->area_permille.store(0);
+	motion->skipped.store(0);
+}
+
+// Merge overlapping rectangles so each area is searched once
+static void merge_overlapping(std::vector<Rect> &rects)
+{
+	bool merged = true;
+	while (merged)
+	{
+		merged = false;
+		for (size_t i = 0; i < rects.size() && !merged; i++)
+		{
+			for (size_t j = i + 1; j < rects.size(); j++)
+			{
+				if ((rects[i] & rects[j]).area() > 0)
+				{
+					rects[i] |= rects[j];
+					rects.erase(rects.begin() + j);
+					merged = true;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Update the background with a greyscale frame and return the regions that changed, in frame
+// coordinates, grown by margin (fraction of the region size per side) and merged where they overlap
+// Returns the number of regions
+int motion_detect(MotionDetector *motion, const Mat &gray, double margin, std::vector<Rect> &regions)
+{
+	std::vector<std::vector<Point> > contours;
+	double sx = (double)gray.cols / MOTION_WIDTH;
+	double sy = (double)gray.rows / MOTION_HEIGHT;
+	Rect bounds(0, 0, gray.cols, gray.rows);
+
+	regions.clear();
+	resize(gray, motion->small, Size(MOTION_WIDTH, MOTION_HEIGHT), 0, 0, INTER_AREA);
+	motion->frames.fetch_add(1, std::memory_order_relaxed);
+	if (motion->background.empty())
+	{
+		// First frame only seeds the background
+		motion->small.convertTo(motion->background, CV_32F);
+		return 0;
+	}
+
+	motion->background.convertTo(motion->background8, CV_8U);
+	absdiff(motion->small, motion->background8, motion->mask);
+	threshold(motion->mask, motion->mask, MOTION_THRESHOLD, 255, THRESH_BINARY);
+	dilate(motion->mask, motion->mask, motion->kernel, Point(-1, -1), 2);
+	accumulateWeighted(motion->small, motion->background, MOTION_LEARN_RATE);
+
+	int moving = countNonZero(motion->mask);
+	if (moving == 0)
+		return 0;
+	motion->area_permille.fetch_add(moving * 1000 / (MOTION_WIDTH * MOTION_HEIGHT), std::memory_order_relaxed);
+
+	findContours(motion->mask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+	for (size_t i = 0; i < contours.size(); i++)
+	{
+		Rect r = boundingRect(contours[i]);
+		if (r.area() < MOTION_MIN_AREA)
+			continue;
+		// Back to frame coordinates, grown so a face partly outside the moving area is still whole
+		int mx = cvRound(r.width * margin * sx);
+		int my = cvRound(r.height * margin * sy);
+		Rect full(cvRound(r.x * sx) - mx, cvRound(r.y * sy) - my,
+				  cvRound(r.width * sx) + 2 * mx, cvRound(r.height * sy) + 2 * my);
+		regions.push_back(full & bounds);
+	}
+	merge_overlapping(regions);
+
+	if (!regions.empty())
+	{
+		motion->motion_frames.fetch_add(1, std::memory_order_relaxed);
+		motion->regions.fetch_add(regions.size(), std::memory_order_relaxed);
+	}
+	return (int)regions.size();
+}
+
+#endif // MOTION_DETECT_H
@@ -0,0 +1,119 @@
+/**************************************************************************************************
+* @file        pre_event.h
+* @version     0.1.1
+* @type:       Pre-event buffer of the recorder
+* @brief       Holds the last seconds of JPEG frames while nothing is recorded, so a recording
+*              started by a face begins before the face appeared:
+*                 - bounded by time (the span between the oldest and newest frame) and by the
+*                   bytes of the frames held, whichever is hit first
+*                 - a fixed circular array of frames whose buffers keep their capacity, after the
+*                   first seconds pushing a frame is one memcpy
+*              Compressed frames keep 10 seconds of 640x480 video within a few MB.
+*              Owned by the record thread, a trigger hands the whole ring to the record I/O
+*              thread, which writes it and gives it back empty.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef PRE_EVENT_H
+#define PRE_EVENT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "opencv2/opencv.hpp"
+
+using namespace cv;
+
+typedef struct
+{
+	uint64_t seq;
+	struct timespec ts;			// Capture time
+	Size size;
+	std::vector<uchar> data;	// JPEG
+} PreEventFrame;
+
+typedef struct
+{
+	std::vector<PreEventFrame> frames;	// Circular, the capacity never changes
+	int head;					// Oldest frame
+	int count;
+	size_t bytes;				// JPEG bytes held
+	uint64_t span_ns;			// History kept
+	size_t max_bytes;			// Memory cap
+	uint64_t evicted;			// Frames dropped early to stay under max_bytes
+} PreEventRing;
+
+
+static inline uint64_t pre_event_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Keep up to seconds of history in at most max_bytes, max_frames bounds the frame count
+void pre_event_init(PreEventRing *r, double seconds, size_t max_bytes, int max_frames)
+{
+	r->frames.resize(max_frames > 1 ? max_frames : 2);
+	r->head = 0;
+	r->count = 0;
+	r->bytes = 0;
+	r->span_ns = (uint64_t)(seconds * 1e9);
+	r->max_bytes = max_bytes;
+	r->evicted = 0;
+}
+
+static inline PreEventFrame *pre_event_at(PreEventRing *r, int i)
+{
+	return &r->frames[(r->head + i) % r->frames.size()];
+}
+
+static void pre_event_drop(PreEventRing *r)
+{
+	r->bytes -= r->frames[r->head].data.size();
+	r->head = (r->head + 1) % r->frames.size();
+	r->count--;
+}
+
+// Forget every frame (they were written to a recording)
+void pre_event_clear(PreEventRing *r)
+{
+	while (r->count > 0)
+		pre_event_drop(r);
+}
+
+// Seconds between the oldest and the newest frame held
+double pre_event_seconds(PreEventRing *r)
+{
+	if (r->count < 2)
+		return 0;
+	return (pre_event_ns(&pre_event_at(r, r->count - 1)->ts) - pre_event_ns(&pre_event_at(r, 0)->ts)) / 1e9;
+}
+
+// Append a frame, dropping the oldest ones that fall out of the time span or the memory cap
+void pre_event_push(PreEventRing *r, uint64_t seq, const struct timespec *ts, Size size,
+					const uchar *data, size_t len)
+{
+	if (r->count == (int)r->frames.size())
+		pre_event_drop(r);
+	PreEventFrame *f = pre_event_at(r, r->count);
+	f->seq = seq;
+	f->ts = *ts;
+	f->size = size;
+	f->data.assign(data, data + len);
+	r->count++;
+	r->bytes += len;
+
+	uint64_t newest = pre_event_ns(ts);
+	while (r->count > 1 && r->bytes > r->max_bytes)
+	{
+		pre_event_drop(r);
+		r->evicted++;
+	}
+	while (r->count > 1 && newest - pre_event_ns(&r->frames[r->head].ts) > r->span_ns)
+		pre_event_drop(r);
+}
+
+#endif // PRE_EVENT_H
@@ -0,0 +1,260 @@
+/**************************************************************************************************
+* @file        recorder.h
+* @version     0.1.1
+* @type:       Recording files of a camera, written by its record I/O thread
+* @brief       Writes the frames the capture stage produced on the timeline of their capture
+*              timestamps, so a recording plays back in real time whatever the camera delivered:
+*                 - every frame handed to the I/O thread is written, none is skipped
+*                 - where frames are missing (dropped upstream, or a camera running below the
+*                   rate the file was opened with) the previous frame is repeated until the
+*                   timeline catches up
+*                 - a gap longer than RECORD_MAX_GAP (video paused) starts a new run instead of
+*                   being filled
+*              Every event gets its own file, cut into segments of at most max_seconds and
+*              max_bytes, named after the wall clock time they start at:
+*                 <dir>/video_recording_cam<N>_<YYYYmmdd-HHMMSS>_<segment>.avi
+*              Frames are the JPEG frames of the encode stage, stored as they are in an MJPEG AVI
+*              (avi_writer.h): recording costs no encoding of its own. Data is flushed to the
+*              card with fdatasync every RECORD_SYNC_SECONDS or RECORD_SYNC_BYTES, not per frame,
+*              and dropped from the page cache once on disk.
+*              Before a segment is opened the oldest recordings of the camera are deleted until
+*              they fit in retention_bytes.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/stat.h>
+#include "opencv2/opencv.hpp"
+#include "avi_writer.h"
+#include "pre_event.h"
+
+using namespace cv;
+
+#define RECORD_QUEUE_DEPTH	3		// JPEG slots pinned for the record thread, of FRAME_RING_SLOTS
+#define RECORD_IO_FRAMES	32		// Frames buffered for the I/O thread, ~1 s at 30 FPS
+#define RECORD_MAX_GAP		1.0		// Seconds, longer gaps between frames are not filled
+#define RECORD_SYNC_SECONDS	1.0		// fdatasync at most this often...
+#define RECORD_SYNC_BYTES	(4 * 1024 * 1024)	// ...unless this much was written since the last one
+#define RECORD_PREFIX		"video_recording_cam"
+
+// Where recordings go and how much of the disk they may use
+typedef struct
+{
+	const char *dir;			// Recording directory (-o)
+	int camera;
+	double max_seconds;			// Segment duration (-S), 0 = a single file per event
+	size_t max_bytes;			// Segment size (-Z), 0 = unbounded
+	size_t retention_bytes;		// Disk budget of the camera's recordings (-R), 0 = unbounded
+} RecordPolicy;
+
+// Frame handed from the record thread to the I/O thread, end closes the event's file
+// A frame carrying history stands for the pre-event buffer, written ahead of the live frames
+typedef struct
+{
+	std::vector<uchar> data;	// JPEG, keeps its capacity between frames
+	Size size;
+	struct timespec ts;			// Capture time
+	bool end;
+	PreEventRing *history;		// Pre-event frames to write instead, NULL for a single frame
+} RecordFrame;
+
+typedef struct
+{
+	AviWriter avi;
+	char path[256];
+	double fps;					// Rate the file was opened with
+	unsigned segment;			// Segment of the current event, 0 starts a new event
+	bool synced;				// next_ns belongs to the current run
+	uint64_t next_ns;			// Capture time the next frame of the file stands for
+	std::vector<uchar> last;	// Frame written last, repeated to fill gaps
+	uint64_t frames;			// Frames written, repeats included
+	uint64_t repeats;			// Frames written to fill gaps
+	size_t sync_bytes;			// Bytes in the file (not the buffer) at the last fdatasync
+	struct timespec sync_time;
+	uint64_t syncs;				// Totals since the I/O thread started
+	uint64_t deleted;			// Recordings deleted for the retention budget
+} Recording;
+
+
+static inline uint64_t recording_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+void recording_init(Recording *r)
+{
+	r->avi.fd = -1;
+	r->segment = 0;
+	r->syncs = 0;
+	r->deleted = 0;
+}
+
+// Delete the oldest recordings of the camera until the others fit in the retention budget
+// Names sort by start time, the file being written is never among them
+// Returns the number of files deleted
+int recording_retain(const RecordPolicy *policy)
+{
+	char prefix[32];
+	std::vector<std::pair<std::string, size_t> > files;
+	size_t total = 0;
+	struct stat st;
+	int deleted = 0;
+
+	if (policy->retention_bytes == 0)
+		return 0;
+	DIR *dir = opendir(policy->dir);
+	if (dir == NULL)
+		return 0;
+	snprintf(prefix, sizeof(prefix), RECORD_PREFIX "%d_", policy->camera);
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (strncmp(d->d_name, prefix, strlen(prefix)) != 0)
+			continue;
+		std::string path = std::string(policy->dir) + "/" + d->d_name;
+		if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		files.push_back(std::make_pair(path, (size_t)st.st_size));
+		total += st.st_size;
+	}
+	closedir(dir);
+
+	std::sort(files.begin(), files.end());
+	for (size_t i = 0; i < files.size() && total > policy->retention_bytes; i++)
+	{
+		if (unlink(files[i].first.c_str()) < 0)
+			continue;
+		syslog(LOG_DEBUG, "Recording %s deleted for the retention budget", files[i].first.c_str());
+		total -= files[i].second;
+		deleted++;
+	}
+	return deleted;
+}
+
+// Open the next segment of the current event (segment 0 starts a new event), played back at fps
+// Returns 0 on success, -1 on failure
+int recording_open(Recording *r, const RecordPolicy *policy, double fps, Size size)
+{
+	char tm_str[32];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	r->deleted += recording_retain(policy);
+	strftime(tm_str, sizeof(tm_str), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+	// Two events starting within the same second get consecutive segment numbers
+	do
+		snprintf(r->path, sizeof(r->path), "%s/" RECORD_PREFIX "%d_%s_%03u.avi", policy->dir, policy->camera,
+				 tm_str, r->segment);
+	while (access(r->path, F_OK) == 0 && ++r->segment < 1000);
+	r->fps = fps;
+	r->synced = false;
+	r->frames = 0;
+	r->repeats = 0;
+	r->sync_bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &r->sync_time);
+	return avi_writer_open(&r->avi, r->path, size.width, size.height, fps);
+}
+
+// Flush what was written to the card and drop it from the page cache
+// The first page stays cached: avi_writer_close() patches the header in it
+static void recording_sync(Recording *r)
+{
+	if (fdatasync(r->avi.fd) == 0)
+	{
+		posix_fadvise(r->avi.fd, AVI_BUFFER_ALIGN, 0, POSIX_FADV_DONTNEED);
+		r->syncs++;
+	}
+	r->sync_bytes = r->avi.bytes - r->avi.used;
+	clock_gettime(CLOCK_MONOTONIC, &r->sync_time);
+}
+
+// Finish the file, it is on the card once this returns
+// Returns 0 on success, -1 if a write failed
+int recording_close(Recording *r)
+{
+	if (avi_writer_close(&r->avi) < 0)
+		return -1;
+	r->syncs++;
+	return 0;
+}
+
+static inline bool recording_is_open(Recording *r)
+{
+	return r->avi.fd >= 0;
+}
+
+// True once the segment reached its duration or size
+// AVI 1.0 files end well before AVI_MAX_BYTES whatever the policy
+bool recording_full(Recording *r, const RecordPolicy *policy)
+{
+	size_t max_bytes = AVI_MAX_BYTES - AVI_MAX_BYTES / 16;
+	if (policy->max_bytes > 0 && policy->max_bytes < max_bytes)
+		max_bytes = policy->max_bytes;
+	if (r->avi.bytes >= max_bytes)
+		return true;
+	return policy->max_seconds > 0 && r->frames >= policy->max_seconds * r->fps;
+}
+
+// Append a JPEG frame captured at ts, after repeating the previous one for any frame periods
+// the capture stage left empty
+// Returns the number of frames written, -1 if the file cannot take more
+int recording_write(Recording *r, const uchar *jpeg, size_t len, const struct timespec *ts)
+{
+	uint64_t period = (uint64_t)(1e9 / r->fps);
+	uint64_t t = recording_ns(ts);
+	int written = 0;
+	struct timespec now;
+
+	if (r->synced && t > r->next_ns + (uint64_t)(RECORD_MAX_GAP * 1e9))
+		r->synced = false;
+	if (r->synced)
+	{
+		// Half a period of jitter is not a missing frame
+		while (t >= r->next_ns + period / 2)
+		{
+			if (avi_writer_frame(&r->avi, r->last.data(), r->last.size()) < 0)
+				return -1;
+			r->next_ns += period;
+			r->frames++;
+			r->repeats++;
+			written++;
+		}
+		r->next_ns += period;
+	}
+	else
+	{
+		r->next_ns = t + period;
+		r->synced = true;
+	}
+	if (avi_writer_frame(&r->avi, jpeg, len) < 0)
+		return -1;
+	r->last.assign(jpeg, jpeg + len);
+	r->frames++;
+
+	// Batched: a flush per frame would wear the card and stall on every write
+	size_t in_file = r->avi.bytes - r->avi.used;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (in_file - r->sync_bytes >= RECORD_SYNC_BYTES ||
+		(in_file > r->sync_bytes && (now.tv_sec - r->sync_time.tv_sec) +
+			(now.tv_nsec - r->sync_time.tv_nsec) / 1e9 >= RECORD_SYNC_SECONDS))
+		recording_sync(r);
+	return written + 1;
+}
+
+#endif // RECORDER_H
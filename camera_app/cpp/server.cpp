@@ -6,7 +6,7 @@
 * @brief       OpenCV application that provides video stream to client requests.
 *		 		  - Main Thread: Generate video stream and write image data to a global structure
 * 				  - Innitializes a socket connection to support client requests for video stream
-* 				  - Each client request is handled by a separate thread
+* 				  - Client requests are handled by epoll event loop threads (stream_reactor.h)
 * @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
 * @license:    GNU GPLv3   (attached below)
 *
@@ -33,12 +33,16 @@
 #include <net/if.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <sys/time.h>
 #include <time.h>
 #include "server.h"
 #include "facedetect.h"
+#include "face_detector.h"
+#include "detector_bench.h"
 #include "camera_app_signals.h" 
+#include "stream_reactor.h"
 
 using namespace cv;
 
@@ -50,182 +54,482 @@ int main(int argc, char** argv)
 	// Initialize signal handlers
     init_sigHandlers();
 
-    //--------------------------------------------------------
-    // Setup network configuration settings: socket, bind, listen
-    //--------------------------------------------------------
-    int localSocket;
+    //-------------------------------------------------------
+    // Command line options
+    //   -d <source>   camera index, /dev/videoN path or video file (default 0)
+    //                 repeat -d for every camera, camera N streams on port base + N
+    //   -b <backend>  auto | v4l2 | opencv (default auto)
+    //   -p <port>     base port (default 4099)
+    //   -H <port>     HTTP port for MJPEG, snapshots and control (default 8080, 0 = off)
+    //   -r <WxH>      face detection resolution (default 320x240, 640x480 = full frame)
+    //   -n <frames>   run the face cascade every N frames and track faces in between (default 1)
+    //   -t <tracker>  template | flow (default template)
+    //   -g            gate face detection on motion: the cascade only searches moving regions
+    //   -j <workers>  face cascade worker threads (default: one per core, 1 = detect thread only)
+    //   -e <frames>   verify faces with the eye cascade, record only after N consecutive verified
+    //                 frames (default 0 = off)
+    //   -w <threads>  viewer event loop threads (default 1)
+    //   -z            send frames to viewers with MSG_ZEROCOPY (Linux 4.14+)
+    //   -s            do not publish frames in shared memory (/dev/shm/opencv_monitor_camN)
+    //   -U <group>[:port][@ifaddr]  also send frames to a multicast group, camera N on port + N
+    //                 (default port 5000), e.g. -U 239.255.0.1@127.0.0.1 for loopback testing
+    //   -u <format>   multicast frames: jpeg | delta (default jpeg)
+    //   -P <seconds>  start recordings this long before their trigger (default 0 = off), costs a
+    //                 JPEG encode of every frame even while nothing is watched or recorded
+    //   -L <MB>       memory cap of that pre-event buffer per camera (default 8)
+    //   -o <dir>      recording directory (default /tmp), one file per event
+    //   -S <seconds>  cut recordings into segments of at most this long (default 60, 0 = off)
+    //   -Z <MB>       and at most this large (default 64, 0 = off)
+    //   -R <MB>       disk budget of each camera's recordings, the oldest are deleted
+    //                 (default 512, 0 = unbounded)
+    //   -q <quality>  default JPEG quality of the encode stage, 1-100 (default 80),
+    //                 viewers may subscribe to another quality, frame rate and size
+    //   -m <model>    face detector: haar | lbp | dnn (default haar)
+    //   -M <dir>      directory holding the model files (default xml/ next to the binary sources)
+    //   -B <clip>     benchmark every detector on a video clip and exit
+    //-------------------------------------------------------
+    const char *sources[MAX_CAMERAS];
+    int num_cameras = 0;
+    int backend = CAPTURE_AUTO;										// V4L2 with VideoCapture fallback
     int port = 4099;	// Default port 4099
+    int http_port = 8080;
+    Size detect_size(320, 240);										// Cascade cost scales with pixel count
+    int detect_interval = 1;										// Cascade on every frame
+    int tracker_type = TRACKER_TEMPLATE;
+    bool motion_gate = false;
+    int detect_workers = sysconf(_SC_NPROCESSORS_ONLN);			// Spread the cascade over every core
+    int detector = DETECTOR_HAAR;
+    int jpeg_quality = 80;
+    int num_reactors = 1;											// One epoll loop serves every viewer
+    bool zerocopy = false;											// Local viewers are copied by the kernel anyway
+    bool shm_enable = true;											// Local readers map the frames directly
+    const char *mcast_spec = NULL;									// No multicast output
+    int mcast_format = FRAME_ENC_JPEG;
+    double pre_event_seconds = 0;									// Opt-in: encodes every frame while idle
+    double pre_event_mb = 8;
+    const char *record_dir = "/tmp";
+    double segment_seconds = 60;									// A long event is several short files
+    double segment_mb = 64;
+    double retention_mb = 512;										// Keep the card from filling up
+    int confirm_frames = 0;										// Any detector face triggers a recording
+    const char *model_dir = NULL;
+    const char *bench_clip = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:b:p:H:r:n:t:gj:e:w:zsU:u:P:L:o:S:Z:R:q:m:M:B:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd' :
+                if (num_cameras == MAX_CAMERAS)
+                {
+                    fprintf(stderr, "At most %d cameras are supported\n", MAX_CAMERAS);
+                    exit(1);
+                }
+                sources[num_cameras++] = optarg;
+                break;
+            case 'b' :
+                if (strcmp(optarg, "v4l2") == 0)
+                    backend = CAPTURE_V4L2;
+                else if (strcmp(optarg, "opencv") == 0)
+                    backend = CAPTURE_OPENCV;
+                else
+                    backend = CAPTURE_AUTO;
+                break;
+            case 'p' :
+                port = atoi(optarg);
+                break;
+            case 'H' :
+                http_port = atoi(optarg);
+                break;
+            case 'r' :
+                if (sscanf(optarg, "%dx%d", &detect_size.width, &detect_size.height) != 2 ||
+                    detect_size.width <= 0 || detect_size.width > 640 ||
+                    detect_size.height <= 0 || detect_size.height > 480)
+                {
+                    fprintf(stderr, "Invalid detection resolution %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n' :
+                detect_interval = atoi(optarg);
+                break;
+            case 't' :
+                tracker_type = strcmp(optarg, "flow") == 0 ? TRACKER_FLOW : TRACKER_TEMPLATE;
+                break;
+            case 'g' :
+                motion_gate = true;
+                break;
+            case 'j' :
+                detect_workers = atoi(optarg);
+                break;
+            case 'e' :
+                confirm_frames = atoi(optarg);
+                break;
+            case 'w' :
+                num_reactors = atoi(optarg);
+                if (num_reactors < 1 || num_reactors > MAX_REACTORS)
+                {
+                    fprintf(stderr, "Between 1 and %d event loop threads are supported\n", MAX_REACTORS);
+                    exit(1);
+                }
+                break;
+            case 'z' :
+                zerocopy = true;
+                break;
+            case 's' :
+                shm_enable = false;
+                break;
+            case 'U' :
+                mcast_spec = optarg;
+                break;
+            case 'u' :
+                mcast_format = strcmp(optarg, "delta") == 0 ? FRAME_ENC_DELTA : FRAME_ENC_JPEG;
+                break;
+            case 'P' :
+                pre_event_seconds = atof(optarg);
+                break;
+            case 'L' :
+                pre_event_mb = atof(optarg);
+                break;
+            case 'o' :
+                record_dir = optarg;
+                break;
+            case 'S' :
+                segment_seconds = atof(optarg);
+                break;
+            case 'Z' :
+                segment_mb = atof(optarg);
+                break;
+            case 'R' :
+                retention_mb = atof(optarg);
+                break;
+            case 'q' :
+                jpeg_quality = atoi(optarg);
+                if (jpeg_quality < 1 || jpeg_quality > 100)
+                {
+                    fprintf(stderr, "JPEG quality must be between 1 and 100\n");
+                    exit(1);
+                }
+                break;
+            case 'm' :
+                detector = detector_type(optarg);
+                if (detector < 0)
+                {
+                    fprintf(stderr, "Unknown face detector %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'M' :
+                model_dir = optarg;
+                break;
+            case 'B' :
+                bench_clip = optarg;
+                break;
+            default :
+                fprintf(stderr, "Usage: %s [-d source]... [-b auto|v4l2|opencv] [-p port] [-H port] [-r WxH]"
+                                " [-n frames] [-t template|flow] [-g] [-j workers] [-e frames] [-w threads] [-z] [-s]"
+                                " [-U group[:port][@ifaddr]] [-u jpeg|delta] [-P seconds] [-L MB]"
+                                " [-o dir] [-S seconds] [-Z MB] [-R MB] [-q quality]"
+                                " [-m haar|lbp|dnn]"
+                                " [-M model_dir] [-B clip]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (num_cameras == 0)
+        sources[num_cameras++] = "0";								// Capture source: /dev/video0
+    struct in_addr mcast_group, mcast_iface;
+    int mcast_port = MCAST_DEFAULT_PORT;
+    mcast_iface.s_addr = htonl(INADDR_ANY);
+    if (mcast_spec != NULL && mcast_parse_address(mcast_spec, &mcast_group, &mcast_port, &mcast_iface) < 0)
+    {
+        fprintf(stderr, "Invalid multicast group %s\n", mcast_spec);
+        exit(1);
+    }
+    END_PROGRAM = 0;
 
-    struct  sockaddr_in localAddr,
-                        remoteAddr;
-
-	// MAIN processing threads
-    pthread_t camera_processor_tid;
-	pthread_t camera_recording_tid;
+    //-------------------------------------------------------
+    // Facial recognition setup, one set of models shared by every camera
+    //-------------------------------------------------------
+	const char *dev_arch = "x86_64";
+	String models_path;
+	dev_arch = getBuild();
+	if (model_dir != NULL)
+		models_path = String(model_dir) + "/";
+	else if (dev_arch == "x86_64")
+		models_path = "xml/";											// Development machine, use relative path
+	else
+		models_path = "/usr/bin/opencv/camera_app/cpp/xml/";			// Target machine, use full path
 
-    int addrLen = sizeof(struct sockaddr_in);
+    FaceModels models;
+    models.eyes_path = samples::findFileOrKeep(models_path + "haarcascade_eye_tree_eyeglasses.xml");
+	if (bench_clip != NULL)
+		return benchmark_detectors(bench_clip, models_path, detect_size, detect_workers,
+								   models.eyes_path) < 0 ? 1 : 0;
 
-    localSocket = socket(AF_INET , SOCK_STREAM , 0);
-    if (localSocket == -1){
-         syslog(LOG_DEBUG, "Failed to innitialize socket(AF_INET, SOCK_STREAM)");
+    models.detector = create_detector(detector, models_path, detect_workers);
+    if (models.detector == NULL)
+    {
+        fprintf(stderr, "Cannot load the %s face detector from %s\n", detector_name(detector), models_path.c_str());
+        exit(1);
     }
+    if (models.detector->pool() != NULL)
+    {
+        // The workers already use every core, stop OpenCV from splitting each band again
+        setNumThreads(1);
+        DEBUG_LOG("Face detection: %s, %d cascade workers", models.detector->name(), detect_workers);
+    }
+    else
+        DEBUG_LOG("Face detection: %s", models.detector->name());
 
-    int enable = 1;
-    if (setsockopt(localSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
-        syslog(LOG_DEBUG, "setsockopt(SO_REUSEADDR) failed");
+    //-------------------------------------------------------
+    // Innitialize one ImgCaptureStruct, pipeline and listening socket per camera
+    //-------------------------------------------------------
+    ImgCaptureStruct *cameras[MAX_CAMERAS];
+    int localSockets[MAX_CAMERAS];
+    int cam;
 
-    localAddr.sin_family = AF_INET;
-    localAddr.sin_addr.s_addr = INADDR_ANY;
-    localAddr.sin_port = htons(4099);
+    for (cam = 0; cam < num_cameras; cam++)
+    {
+        ImgCaptureStruct *imgStruct = new ImgCaptureStruct;
+        cameras[cam] = imgStruct;
+        imgStruct->id = cam;
+        imgStruct->dev = 0;												// Camera device
+        imgStruct->source = sources[cam];
+        imgStruct->frame_rate = 30.0;									// Default Frame Rate: ~30 FPS (Logitech C270 max frame rate = 30 FPS
+        imgStruct->face_detected = 0;									// Assume no face detected innitially 
+        imgStruct->face_detect_enable = false;							// Enable face detection as default
+        imgStruct->pauseVideo = false;									// Pause Default = false
+        imgStruct->record_time = 10;						     		// Default = 10 seconds for testing purposes
+        imgStruct->manual_record = false;
+        imgStruct->record_video = false;
+        imgStruct->record_policy.dir = record_dir;
+        imgStruct->record_policy.camera = cam;
+        imgStruct->record_policy.max_seconds = segment_seconds;
+        imgStruct->record_policy.max_bytes = (size_t)(segment_mb * 1024 * 1024);
+        imgStruct->record_policy.retention_bytes = (size_t)(retention_mb * 1024 * 1024);
+        imgStruct->models = &models;
+        // Own copies of the classifiers, detection on one camera never waits for another
+        imgStruct->detector = models.detector->clone();
+        if (imgStruct->detector == NULL)
+        {
+            fprintf(stderr, "Cannot load the %s face detector from %s\n", detector_name(detector), models_path.c_str());
+            exit(1);
+        }
+        imgStruct->detect_size = detect_size;
+        tracker_init(&imgStruct->tracker, tracker_type, detect_interval);
+        imgStruct->motion_gate = motion_gate;
+        motion_init(&imgStruct->motion);
+        verifier_init(&imgStruct->verifier, confirm_frames);
+        if (confirm_frames > 0 && verifier_load(&imgStruct->verifier, models.eyes_path) < 0)
+        {
+            fprintf(stderr, "Face verification needs the eye cascade in %s\n", models_path.c_str());
+            exit(1);
+        }
+        imgStruct->jpeg_quality = jpeg_quality;
+        imgStruct->shm_enable = shm_enable;
+        imgStruct->mcast_enable = mcast_spec != NULL;
+        imgStruct->mcast_group = mcast_group;
+        imgStruct->mcast_port = mcast_port + cam;
+        imgStruct->mcast_iface = mcast_iface;
+        imgStruct->mcast_format = mcast_format;
+        imgStruct->pre_event_seconds = pre_event_seconds;
+        imgStruct->pre_event_max_bytes = (size_t)(pre_event_mb * 1024 * 1024);
 
-    if( bind(localSocket,(struct sockaddr *)&localAddr , sizeof(localAddr)) < 0) {
-         syslog(LOG_DEBUG, "Can't bind() socket");
-         exit(1);
+        if (open_capture(imgStruct, backend) < 0)
+        {
+            syslog(LOG_DEBUG, "Failed to open capture source %s", imgStruct->source);
+            DEBUG_LOG("Failed to open capture source %s", imgStruct->source);
+            exit(1);
+        }
+        DEBUG_LOG("Camera %d: %s, Frame Rate: %.2f/s", cam, imgStruct->source, imgStruct->frame_rate);
+
+        // Initialize video structure frame rings and stage queues
+        setup_img(imgStruct);
+
+        // Setup network configuration settings: socket, bind, listen
+        localSockets[cam] = open_listen_socket(port + cam);
+        if (localSockets[cam] < 0)
+            exit(1);
+        // Listen, output status to both syslog and debug log
+        syslog(LOG_DEBUG, "Camera %d: Server Listening on Port: %d", cam, port + cam);
+        DEBUG_LOG("Camera %d: Server Listening on Port: %d", cam, port + cam);
     }
 
-    //-------------------------------------------------------
-    // Innitialize ImgCaptureStruct members 
-    //-------------------------------------------------------
-    ImgCaptureStruct imgStruct;
-    imgStruct.dev = 0;												// Camera device
-	imgStruct.frame_rate = 30.0;									// Default Frame Rate: ~30 FPS (Logitech C270 max frame rate = 30 FPS
-    imgStruct.time_sleep = (1 / imgStruct.frame_rate) * 1000000;	// Time to sleep in microseconds between frame captures
-    imgStruct.face_detected = 0;									// Assume no face detected innitially 
-    imgStruct.face_detect_enable = false;							// Enable face detection as default
-    imgStruct.pauseVideo = false;									// Pause Default = false
-	imgStruct.record_time = 10;						     			// Default = 10 seconds for testing purposes
-	imgStruct.manual_record = false;
-	imgStruct.dir_name_size = 256;
-	imgStruct.write_dir = (char*)malloc(imgStruct.dir_name_size);
-
-    imgStruct.cap = new VideoCapture(imgStruct.dev);
-    END_PROGRAM = 0;
+    // Create the capture, detect, annotate and record threads of every camera
+    for (cam = 0; cam < num_cameras; cam++)
+        start_pipeline(cameras[cam]);
 
-	DEBUG_LOG("Frame Rate: %.2f/s", imgStruct.frame_rate);
-	DEBUG_LOG("Time Sleep: %.3f us", imgStruct.time_sleep);
+    // Browsers and curl are served on one HTTP port shared by every camera (http_stream.h)
+    int httpSocket = -1;
+    if (http_port > 0)
+    {
+        httpSocket = open_listen_socket(http_port);
+        if (httpSocket < 0)
+            exit(1);
+        syslog(LOG_DEBUG, "HTTP Listening on Port: %d", http_port);
+        DEBUG_LOG("HTTP Listening on Port: %d", http_port);
+    }
 
-    //-------------------------------------------------------
-    // Facial recognition setup
-    //-------------------------------------------------------
-	const char *dev_arch = "x86_64";
-	dev_arch = getBuild();
-	if (dev_arch == "x86_64")
-	{
-		// Development machine, use relative path
-	    imgStruct.nestedCascade.load(samples::findFileOrKeep("xml/haarcascade_eye_tree_eyeglasses.xml"));
-	    imgStruct.cascade.load(samples::findFile("xml/haarcascade_frontalface_alt.xml"));
-	}
-	else
-	{
-	    // Target machine, use full path
-	    imgStruct.nestedCascade.load(samples::findFileOrKeep("/usr/bin/opencv/camera_app/cpp/xml/haarcascade_eye_tree_eyeglasses.xml"));
-	    imgStruct.cascade.load(samples::findFile("/usr/bin/opencv/camera_app/cpp/xml/haarcascade_frontalface_alt.xml"));
-	}
+    // Viewers of every camera are served by the reactor threads: accept, control input and
+    // non-blocking frame writes in one epoll loop each
+    StreamReactor *reactors = new StreamReactor[num_reactors];
+    int r;
+    for (r = 0; r < num_reactors; r++)
+    {
+        if (reactor_init(&reactors[r], r, cameras, localSockets, num_cameras, httpSocket, zerocopy) < 0)
+            exit(1);
+        pthread_create(&reactors[r].tid, NULL, reactor_thread, &reactors[r]);
+    }
+
+    // Pipeline statistics are reported every STATS_INTERVAL seconds
+    struct timespec last_stats, now;
+    clock_gettime(CLOCK_MONOTONIC, &last_stats);
 
-    // Listen, output status to both syslog and debug log
-    listen(localSocket , 3);
-    syslog(LOG_DEBUG, "Server Listening on Port: %d", port);
-
-    // Initialize video structure Img and ImgGrey instances
-    setup_img(&imgStruct);
-    // Create thread to capture image frames
-    pthread_create(&camera_processor_tid, NULL, capture_video, &imgStruct);
-	pthread_create(&camera_recording_tid, NULL, record_video, &imgStruct);
-    //accept connection from an incoming client
-    SLIST_HEAD(slisthead, VideoStreamStruct) head;
-    SLIST_INIT(&head);
-    VideoStream *videoStreamPtr;
-    int remoteSocket;
-
-    // Utilize polling to check for incoming client connection
-    // Supports user input to gracefully terminate program execution without using SIGTERM
-    struct pollfd pfds[1];
-    pfds[0].fd = localSocket;
-    pfds[0].events = POLLIN;
-
-
-	// Infinite server loop
-	// Poll for client request
-	// If poll times out
-	//		- loop through linked list of open threads / existing client connections 
-	//		- join thread if thread is complete (i.e. client closed connection)
-	// Else
-	//		- Handle incoming client request with new thread
+	// Main loop: report statistics until the program is terminated
     while(END_PROGRAM == 0)
     {
 		TRACE_LOG("TOP OF MAIN WHILE LOOP");
-	    int num_events = poll(pfds, 1, 2500);	// Poll for 2500 ms
-	    if (num_events == 0)
-	    {
-	        TRACE_LOG("Poll timed out, join stagnant threads");
-		    VideoStream *videoStreamPtr_TMP;
-		    SLIST_FOREACH_SAFE(videoStreamPtr, &head, entries, videoStreamPtr_TMP)
-		    {
-			    TRACE_LOG("VideoStream THREAD ID [%ld] STATUS COMPLETE = %d", videoStreamPtr->thread_id, videoStreamPtr->thread_complete);
-		    	if (videoStreamPtr->thread_complete == true)
-				{
-			    	DEBUG_LOG("Joining thread: [%ld]", videoStreamPtr->thread_id);
-			    	pthread_join(videoStreamPtr->thread_id, NULL);
-			    	SLIST_REMOVE(&head, videoStreamPtr, VideoStreamStruct, entries);
-			    	free(videoStreamPtr);
-		    	}
-		    }
-	    }
-	    else
-	    {
-			TRACE_LOG("CLIENT CONNECTION DETECTED");
-	        int pollin_happened = pfds[0].revents & POLLIN;
-	        if (pollin_happened)
-			{
-	            DEBUG_LOG("File descriptor %d is ready to read\n", pfds[0].fd);
-		    	remoteSocket = accept(localSocket, (struct sockaddr *)&remoteAddr, (socklen_t*)&addrLen);
-	            if (remoteSocket < 0)
-		    	{
-			    	DEBUG_LOG("ERROR ACCEPTING SOCKET CONNECTION");
-		    	}
-		    	else
-		    	{
-			    	// Conenction accepted. Create new display thread to handle connection
-				    DEBUG_LOG("Socket Connection accepted");
-				    videoStreamPtr = new VideoStream;
-				    videoStreamPtr->remoteSocket = remoteSocket;
-				    DEBUG_LOG("newVideoStream->remoteSocket: %d", videoStreamPtr->remoteSocket);
-				    videoStreamPtr->imgStruct = &imgStruct;
-				    SLIST_INSERT_HEAD(&head, videoStreamPtr, entries);
-				    pthread_create(&videoStreamPtr->thread_id, NULL, display, videoStreamPtr);
-		    	}
-
-			}
-			else
-			{
-		    	syslog(LOG_DEBUG, "Unexpected event occurred: %d\n", pfds[0].revents);
-			}
-	    }
+		sleep(1);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - last_stats.tv_sec >= STATS_INTERVAL)
+		{
+			for (cam = 0; cam < num_cameras; cam++)
+				report_stats(cameras[cam]);
+			report_reactors(reactors, num_reactors);
+			last_stats = now;
+		}
 		TRACE_LOG("END OF MAIN WHILE LOOP\n");
     }
 
     // Cleanup
     DEBUG_LOG("Joining MAIN processing threads...");
-    DEBUG_LOG("Joining Camera Processor thread: [%ld]", camera_processor_tid);
-    pthread_join(camera_processor_tid, NULL);
-    DEBUG_LOG("Joining Camera Recording thread: [%ld]", camera_recording_tid);
-	pthread_join(camera_recording_tid, NULL);
-    DEBUG_LOG("Joining client display threads...");
-    while(!SLIST_EMPTY(&head))
+    for (cam = 0; cam < num_cameras; cam++)
+    {
+        stop_pipeline(cameras[cam]);
+        delete cameras[cam]->detector;
+    }
+    delete models.detector;
+    DEBUG_LOG("Joining viewer event loop threads...");
+    for (r = 0; r < num_reactors; r++)
+    {
+        pthread_join(reactors[r].tid, NULL);
+        reactor_destroy(&reactors[r]);
+    }
+    delete[] reactors;
+    for (cam = 0; cam < num_cameras; cam++)
     {
-	videoStreamPtr = SLIST_FIRST(&head);
-	DEBUG_LOG("    - Joining thread: [%ld]", videoStreamPtr->thread_id);
-	pthread_join(videoStreamPtr->thread_id, NULL);
-	free(videoStreamPtr);
-	SLIST_REMOVE_HEAD(&head, entries);
+        if (cameras[cam]->use_v4l2)
+            v4l2_close(&cameras[cam]->v4l2);
+        close(localSockets[cam]);
     }
-    close(localSocket);
+    if (httpSocket >= 0)
+        close(httpSocket);
     syslog(LOG_DEBUG, "Closing OPENCV server");
     DEBUG_LOG("Ending MAIN: MAIN Thread ID [%ld]", pthread_self());
     return 0;
 }
 
 
+// Create a TCP socket listening on port
+// Returns the socket, or -1 on failure
+int open_listen_socket(int port)
+{
+    struct sockaddr_in localAddr;
+    int localSocket = socket(AF_INET , SOCK_STREAM , 0);
+    if (localSocket == -1){
+         syslog(LOG_DEBUG, "Failed to innitialize socket(AF_INET, SOCK_STREAM)");
+         return -1;
+    }
+
+    int enable = 1;
+    if (setsockopt(localSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+        syslog(LOG_DEBUG, "setsockopt(SO_REUSEADDR) failed");
+
+    localAddr.sin_family = AF_INET;
+    localAddr.sin_addr.s_addr = INADDR_ANY;
+    localAddr.sin_port = htons(port);
+
+    if( bind(localSocket,(struct sockaddr *)&localAddr , sizeof(localAddr)) < 0) {
+         syslog(LOG_DEBUG, "Can't bind() socket to port %d", port);
+         close(localSocket);
+         return -1;
+    }
+    // Accepted by the reactor threads, which must never block in accept()
+    fcntl(localSocket, F_SETFL, fcntl(localSocket, F_GETFL) | O_NONBLOCK);
+    listen(localSocket , SOMAXCONN);
+    return localSocket;
+}
+
+// Restrict a thread to one CPU core
+void pin_thread(pthread_t tid, int core)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	if (pthread_setaffinity_np(tid, sizeof(set), &set) != 0)
+		syslog(LOG_DEBUG, "Failed to pin thread to core %d", core);
+}
+
+// Create the processing threads of one camera
+// Core 0 is left to the main thread and the viewer event loop threads. Each camera's capture,
+// annotate and record threads share one of the remaining cores, cameras are spread round
+// robin over them. Detect and encode threads are not pinned so the scheduler can put the
+// cascade and the JPEG encoder on whichever core is idle.
+void start_pipeline(ImgCaptureStruct *imgStruct)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_create(&imgStruct->capture_tid, NULL, capture_video, imgStruct);
+    pthread_create(&imgStruct->detect_tid, NULL, detect_video, imgStruct);
+    pthread_create(&imgStruct->annotate_tid, NULL, annotate_video, imgStruct);
+	pthread_create(&imgStruct->record_tid, NULL, record_video, imgStruct);
+	pthread_create(&imgStruct->record_io_tid, NULL, record_io_video, imgStruct);
+	pthread_create(&imgStruct->encode_tid, NULL, encode_video, imgStruct);
+	if (imgStruct->shm_enable)
+		pthread_create(&imgStruct->shm_tid, NULL, share_video, imgStruct);
+	if (imgStruct->mcast_enable)
+		pthread_create(&imgStruct->mcast_tid, NULL, mcast_video, imgStruct);
+
+	if (ncpu > 1)
+	{
+		int core = 1 + imgStruct->id % (ncpu - 1);
+		pin_thread(imgStruct->capture_tid, core);
+		pin_thread(imgStruct->annotate_tid, core);
+		pin_thread(imgStruct->record_tid, core);
+		DEBUG_LOG("Camera %d: capture/annotate/record pinned to core %d of %ld", imgStruct->id, core, ncpu);
+	}
+}
+
+// Join the processing threads of one camera
+void stop_pipeline(ImgCaptureStruct *imgStruct)
+{
+    DEBUG_LOG("Camera %d: Joining Camera Processor thread: [%ld]", imgStruct->id, imgStruct->capture_tid);
+    pthread_join(imgStruct->capture_tid, NULL);
+    DEBUG_LOG("Camera %d: Joining Face Detection thread: [%ld]", imgStruct->id, imgStruct->detect_tid);
+    pthread_join(imgStruct->detect_tid, NULL);
+    DEBUG_LOG("Camera %d: Joining Annotate thread: [%ld]", imgStruct->id, imgStruct->annotate_tid);
+    pthread_join(imgStruct->annotate_tid, NULL);
+    DEBUG_LOG("Camera %d: Joining Camera Recording thread: [%ld]", imgStruct->id, imgStruct->record_tid);
+	pthread_join(imgStruct->record_tid, NULL);
+    DEBUG_LOG("Camera %d: Joining Record I/O thread: [%ld]", imgStruct->id, imgStruct->record_io_tid);
+	pthread_join(imgStruct->record_io_tid, NULL);
+    DEBUG_LOG("Camera %d: Joining Encode thread: [%ld]", imgStruct->id, imgStruct->encode_tid);
+	pthread_join(imgStruct->encode_tid, NULL);
+	if (imgStruct->shm_enable)
+	{
+		DEBUG_LOG("Camera %d: Joining Shared memory thread: [%ld]", imgStruct->id, imgStruct->shm_tid);
+		pthread_join(imgStruct->shm_tid, NULL);
+		shm_ring_destroy(&imgStruct->shm);
+	}
+	if (imgStruct->mcast_enable)
+	{
+		DEBUG_LOG("Camera %d: Joining Multicast thread: [%ld]", imgStruct->id, imgStruct->mcast_tid);
+		pthread_join(imgStruct->mcast_tid, NULL);
+		mcast_sender_close(&imgStruct->mcast);
+	}
+}
+
+
 // Innitialize Img members of the ImgCaptureStruct
 void setup_img(ImgCaptureStruct *imgStruct)
 {
@@ -234,17 +538,225 @@ void setup_img(ImgCaptureStruct *imgStruct)
     // Calculate image size
     imgStruct->imgSize = imgStruct->img.total() * imgStruct->img.elemSize();
 
-    //make img continuos
-    if ( !imgStruct->img.isContinuous() ) 
+    // Preallocate the greyscale frame slots: raw frames from the capture stage and annotated
+    // frames shared with the viewer and record threads
+    frame_ring_init(&imgStruct->raw, 480, 640, CV_8UC1);
+    frame_ring_init(&imgStruct->ring, 480, 640, CV_8UC1);
+    // Encoded frames live in each slot's data buffer, no image is preallocated
+    // Variant 0 is the full size default quality stream, the others are claimed by viewers
+    for (int v = 0; v < JPEG_VARIANTS; v++)
     {
-          imgStruct->img = imgStruct->img.clone();
-          imgStruct->imgGray = imgStruct->img.clone();
+        frame_ring_init(&imgStruct->jpeg[v].ring, 0, 0, CV_8UC1);
+        imgStruct->jpeg[v].tier = 0;
+        imgStruct->jpeg[v].quality = imgStruct->jpeg_quality;
+        imgStruct->jpeg[v].viewers.store(0);
     }
+    pthread_mutex_init(&imgStruct->jpeg_lock, NULL);
+    imgStruct->encode_frames.store(0);
+    imgStruct->encode_total_us.store(0);
+    imgStruct->encode_bytes.store(0);
+
+    // Local readers get the annotated frames through shared memory instead of loopback TCP
+    imgStruct->shm_frames.store(0);
+    imgStruct->shm_total_us.store(0);
+    if (imgStruct->shm_enable)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), SHM_RING_NAME, imgStruct->id);
+        if (shm_ring_create(&imgStruct->shm, name, imgStruct->imgSize) < 0)
+            imgStruct->shm_enable = false;
+        else
+            DEBUG_LOG("Camera %d: frames shared in /dev/shm%s", imgStruct->id, name);
+    }
+
+    // Viewers joining the multicast group cost the server nothing
+    imgStruct->mcast_frames.store(0);
+    imgStruct->mcast_keyframes.store(0);
+    imgStruct->mcast_datagrams.store(0);
+    imgStruct->mcast_bytes.store(0);
+    imgStruct->mcast_errors.store(0);
+    if (imgStruct->mcast_enable)
+    {
+        if (mcast_sender_open(&imgStruct->mcast, imgStruct->mcast_group, imgStruct->mcast_port,
+                              imgStruct->mcast_iface) < 0)
+            imgStruct->mcast_enable = false;
+        else
+            DEBUG_LOG("Camera %d: %s frames sent to multicast group %s:%d", imgStruct->id,
+                      imgStruct->mcast_format == FRAME_ENC_DELTA ? "delta" : "JPEG",
+                      inet_ntoa(imgStruct->mcast_group), imgStruct->mcast_port);
+    }
+
+    // Stage queues: annotation, encoding and recording must see every frame, a full queue drops
+    // the incoming frame, never one already queued. Detection only needs the newest one, a new
+    // frame replaces the one still waiting
+    spsc_init(&imgStruct->annotate_q, "annotate", 2, QUEUE_DROP_NEWEST);
+    spsc_init(&imgStruct->detect_q, "detect", 1, QUEUE_DROP_OLDEST);
+    spsc_init(&imgStruct->encode_q, "encode", 2, QUEUE_DROP_NEWEST);
+    spsc_init(&imgStruct->record_q, "record", RECORD_QUEUE_DEPTH, QUEUE_DROP_NEWEST);
+    // Frames between the record thread and the disk, every one starts out free
+    spsc_init(&imgStruct->io_q, "disk", RECORD_IO_FRAMES, QUEUE_DROP_NEWEST);
+    spsc_init(&imgStruct->io_free, "disk free", RECORD_IO_FRAMES, QUEUE_DROP_NEWEST);
+    for (int i = 0; i < RECORD_IO_FRAMES; i++)
+        spsc_push(&imgStruct->io_free, &imgStruct->io_frames[i]);
+    // The record thread fills the first pre-event ring, the second waits for a trigger
+    spsc_init(&imgStruct->pre_event_free, "pre-event free", 1, QUEUE_DROP_NEWEST);
+    for (int i = 0; i < 2 && imgStruct->pre_event_seconds > 0; i++)
+        pre_event_init(&imgStruct->pre_event_rings[i], imgStruct->pre_event_seconds, imgStruct->pre_event_max_bytes,
+                       (int)(imgStruct->pre_event_seconds * imgStruct->frame_rate * 2) + 2);
+    spsc_push(&imgStruct->pre_event_free, &imgStruct->pre_event_rings[1]);
+    pthread_mutex_init(&imgStruct->faces_lock, NULL);
+    imgStruct->faces_seq = 0;
+    imgStruct->detect_frames.store(0);
+    imgStruct->detect_total_us.store(0);
+    imgStruct->detect_max_us.store(0);
+    imgStruct->record_deadline_ns.store(0);
+    imgStruct->pre_event_frames.store(0);
+    imgStruct->pre_event_bytes.store(0);
+    imgStruct->pre_event_flushed.store(0);
+    imgStruct->pre_event_evicted.store(0);
+    imgStruct->record_frames.store(0);
+    imgStruct->record_repeats.store(0);
+    imgStruct->record_total_us.store(0);
+    imgStruct->record_files.store(0);
+    imgStruct->record_syncs.store(0);
+    imgStruct->record_deleted.store(0);
+    imgStruct->stats_frames = 0;
+    imgStruct->stats_overruns = 0;
+    imgStruct->stats_last.tv_sec = 0;
+    imgStruct->stats_last.tv_nsec = 0;
 
     DEBUG_LOG("Image Setup Complete");
     DEBUG_LOG("Image Size: %d", imgStruct->imgSize);
 }
 
+// Log capture rate, deadline overruns and dropped frames since the previous report
+void report_stats(ImgCaptureStruct *imgStruct)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t frames = imgStruct->sched.frames.load();
+	uint64_t overruns = imgStruct->sched.overruns.load();
+	long max_late = imgStruct->sched.max_late_ns.exchange(0);
+	if (imgStruct->stats_last.tv_sec != 0)
+	{
+		double secs = timespec_diff_ns(&now, &imgStruct->stats_last) / 1e9;
+		DEBUG_LOG("Camera %d", imgStruct->id);
+		DEBUG_LOG("Capture: %.1f FPS (target %.1f), overruns %llu, max late %.1f ms, ring drops %llu",
+				(frames - imgStruct->stats_frames) / secs, imgStruct->frame_rate,
+				(unsigned long long)(overruns - imgStruct->stats_overruns), max_late / 1e6,
+				(unsigned long long)(imgStruct->raw.dropped.load() + imgStruct->ring.dropped.load()));
+		SpscQueue *queues[] = { &imgStruct->annotate_q, &imgStruct->detect_q, &imgStruct->encode_q,
+								&imgStruct->record_q, &imgStruct->io_q };
+		for (unsigned i = 0; i < sizeof(queues) / sizeof(queues[0]); i++)
+			DEBUG_LOG("Stage %-8s: queue depth %u/%u, frames %llu, dropped %llu", queues[i]->name,
+					spsc_depth(queues[i]), queues[i]->capacity,
+					(unsigned long long)queues[i]->pushed.load(),
+					(unsigned long long)queues[i]->dropped.load());
+		uint64_t detected = imgStruct->detect_frames.exchange(0);
+		uint64_t detect_us = imgStruct->detect_total_us.exchange(0);
+		uint64_t detect_max_us = imgStruct->detect_max_us.exchange(0);
+		if (detected > 0)
+			DEBUG_LOG("Detect at %dx%d: %llu frames, %.2f ms/frame avg, %.2f ms max",
+					imgStruct->detect_size.width, imgStruct->detect_size.height,
+					(unsigned long long)detected, detect_us / 1000.0 / detected, detect_max_us / 1000.0);
+		DEBUG_LOG("Tracker: cascade frames %llu, tracked frames %llu, tracking lost %llu",
+				(unsigned long long)imgStruct->tracker.detections.load(),
+				(unsigned long long)imgStruct->tracker.tracked.load(),
+				(unsigned long long)imgStruct->tracker.lost.load());
+		if (imgStruct->motion_gate)
+		{
+			uint64_t mframes = imgStruct->motion.frames.exchange(0);
+			uint64_t moving = imgStruct->motion.motion_frames.exchange(0);
+			uint64_t regions = imgStruct->motion.regions.exchange(0);
+			uint64_t area = imgStruct->motion.area_permille.exchange(0);
+			DEBUG_LOG("Motion: %llu/%llu frames moving, %.1f regions/frame, %.1f%% of frame moving, "
+					"cascade skipped %llu",
+					(unsigned long long)moving, (unsigned long long)mframes,
+					moving ? (double)regions / moving : 0.0, mframes ? area / 10.0 / mframes : 0.0,
+					(unsigned long long)imgStruct->motion.skipped.load());
+		}
+		uint64_t encoded = imgStruct->encode_frames.exchange(0);
+		uint64_t encode_us = imgStruct->encode_total_us.exchange(0);
+		uint64_t encode_bytes = imgStruct->encode_bytes.exchange(0);
+		if (encoded > 0)
+			DEBUG_LOG("Encode: %llu JPEG frames, %.2f ms/frame, %.1f KB/frame",
+					(unsigned long long)encoded, encode_us / 1000.0 / encoded, encode_bytes / 1024.0 / encoded);
+		for (int v = 0; v < JPEG_VARIANTS; v++)
+		{
+			JpegVariant *variant = &imgStruct->jpeg[v];
+			int viewers = variant->viewers.load();
+			pthread_mutex_lock(&imgStruct->jpeg_lock);
+			int tier = variant->tier;
+			int quality = variant->quality;
+			pthread_mutex_unlock(&imgStruct->jpeg_lock);
+			if (viewers > 0)
+				DEBUG_LOG("  JPEG variant %d: 1/%d size, quality %d, %d viewers",
+						v, 1 << tier, quality, viewers);
+		}
+		uint64_t shared = imgStruct->shm_frames.exchange(0);
+		uint64_t shm_us = imgStruct->shm_total_us.exchange(0);
+		if (shared > 0)
+			DEBUG_LOG("Shared memory: %llu frames, %.1f us/frame to publish",
+					(unsigned long long)shared, (double)shm_us / shared);
+		uint64_t recorded = imgStruct->record_frames.exchange(0);
+		uint64_t record_us = imgStruct->record_total_us.exchange(0);
+		if (recorded > 0)
+			DEBUG_LOG("Record: %llu JPEG frames written, %llu of them repeated for missing frames, %.2f ms/frame",
+					(unsigned long long)recorded, (unsigned long long)imgStruct->record_repeats.exchange(0),
+					record_us / 1000.0 / recorded);
+		if (imgStruct->record_files.load() > 0)
+			DEBUG_LOG("Record files: %llu written to %s, %llu fdatasync, %llu deleted for the %.0f MB budget",
+					(unsigned long long)imgStruct->record_files.load(), imgStruct->record_policy.dir,
+					(unsigned long long)imgStruct->record_syncs.load(),
+					(unsigned long long)imgStruct->record_deleted.load(),
+					imgStruct->record_policy.retention_bytes / (1024.0 * 1024.0));
+		if (imgStruct->pre_event_seconds > 0)
+			DEBUG_LOG("Pre-event: holding %llu frames in %.1f MB, %llu written ahead of recordings, "
+					"%llu dropped for the memory cap",
+					(unsigned long long)imgStruct->pre_event_frames.load(),
+					imgStruct->pre_event_bytes.load() / (1024.0 * 1024.0),
+					(unsigned long long)imgStruct->pre_event_flushed.exchange(0),
+					(unsigned long long)imgStruct->pre_event_evicted.exchange(0));
+		uint64_t mframes = imgStruct->mcast_frames.exchange(0);
+		uint64_t mbytes = imgStruct->mcast_bytes.exchange(0);
+		if (mframes > 0)
+			DEBUG_LOG("Multicast: %llu frames (%llu keyframes), %llu datagrams, %.1f kB/frame, %llu send errors",
+					(unsigned long long)mframes, (unsigned long long)imgStruct->mcast_keyframes.exchange(0),
+					(unsigned long long)imgStruct->mcast_datagrams.exchange(0), mbytes / 1e3 / mframes,
+					(unsigned long long)imgStruct->mcast_errors.exchange(0));
+		FaceVerifier *v = &imgStruct->verifier;
+		if (v->confirm_frames > 0)
+		{
+			uint64_t candidates = v->candidate_frames.exchange(0);
+			uint64_t verified = v->verified_frames.exchange(0);
+			uint64_t runs = v->candidate_runs.exchange(0);
+			uint64_t triggers = v->triggers.exchange(0);
+			uint64_t verify_us = v->verify_us.exchange(0);
+			uint64_t confirm_us = v->confirm_us.exchange(0);
+			DEBUG_LOG("Verify: %llu/%llu candidate frames had eyes, %.2f ms/frame avg, %.2f ms max",
+					(unsigned long long)verified, (unsigned long long)candidates,
+					candidates ? verify_us / 1000.0 / candidates : 0.0, v->verify_max_us.exchange(0) / 1000.0);
+			DEBUG_LOG("Triggers: %llu of %llu candidate runs confirmed (precision vs unverified %.1f%%), "
+					"confirmation delay %.1f ms avg, %.1f ms max",
+					(unsigned long long)triggers, (unsigned long long)runs,
+					runs ? 100.0 * triggers / runs : 0.0,
+					triggers ? confirm_us / 1000.0 / triggers : 0.0, v->confirm_max_us.exchange(0) / 1000.0);
+		}
+		DetectPool *pool = imgStruct->models->detector->pool();
+		if (pool != NULL && imgStruct->id == 0)
+			DEBUG_LOG("Detect pool: %d workers, %llu cascade runs, %.1f bands/run",
+					pool->nworkers, (unsigned long long)pool->batches.load(),
+					pool->batches.load() ? (double)pool->bands.load() / pool->batches.load() : 0.0);
+		if (imgStruct->use_v4l2)
+			DEBUG_LOG("V4L2: stale driver frames skipped %llu",
+					(unsigned long long)imgStruct->v4l2.stale_dropped);
+	}
+	imgStruct->stats_frames = frames;
+	imgStruct->stats_overruns = overruns;
+	imgStruct->stats_last = now;
+}
+
 // Sets the local time into the provide char*
 // Return 0 on success and -1 on failure
 int get_local_time(char* tm_str, int buf_size)
@@ -253,25 +765,251 @@ int get_local_time(char* tm_str, int buf_size)
     if (rawtime == -1)
 	{
         syslog(LOG_DEBUG, "time() function failed");
-		snprintf(tm_str, buf_size, "%02d:%02d:%02d\n",0,0,0);
+		snprintf(tm_str, buf_size, "%02d:%02d:%02d",0,0,0);
 		return -1;
     }
     struct tm *ptm = localtime(&rawtime);
     if (ptm == NULL)
 	{
         syslog(LOG_DEBUG, "localtime() function failed");
-		snprintf(tm_str, buf_size, "%02d:%02d:%02d\n",0,0,0);
+		snprintf(tm_str, buf_size, "%02d:%02d:%02d",0,0,0);
 		return -1;
     }
-	snprintf(tm_str, buf_size, "%02d:%02d:%02d\n", ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
+	snprintf(tm_str, buf_size, "%02d:%02d:%02d", ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
 	return 0;
 }
 
-// Thread function to write frames from /dev/video# to the ImgCaptureStruct img members
+// Open the capture source named by imgStruct->source
+//   backend CAPTURE_V4L2:   native V4L2 mmap capture only
+//   backend CAPTURE_OPENCV: VideoCapture only (camera index, device path or video file)
+//   backend CAPTURE_AUTO:   V4L2 for camera devices, falling back to VideoCapture
+// Returns 0 on success, -1 if no backend could open the source
+int open_capture(ImgCaptureStruct *imgStruct, int backend)
+{
+	char path[256];
+	bool is_camera = true;
+	bool is_index = strspn(imgStruct->source, "0123456789") == strlen(imgStruct->source);
+
+	// A bare number selects /dev/video<number>, anything else is used as a path
+	if (is_index)
+	{
+		imgStruct->dev = atoi(imgStruct->source);
+		snprintf(path, sizeof(path), "/dev/video%d", imgStruct->dev);
+	}
+	else
+	{
+		snprintf(path, sizeof(path), "%s", imgStruct->source);
+		is_camera = strncmp(path, "/dev/", 5) == 0;
+	}
+
+	imgStruct->use_v4l2 = false;
+	imgStruct->cap = NULL;
+	if (backend != CAPTURE_OPENCV && is_camera)
+	{
+		if (v4l2_open(&imgStruct->v4l2, path, 640, 480, imgStruct->frame_rate) == 0)
+		{
+			imgStruct->use_v4l2 = true;
+			DEBUG_LOG("Capture backend: V4L2 mmap (%s)", path);
+			return 0;
+		}
+		if (backend == CAPTURE_V4L2)
+			return -1;
+		DEBUG_LOG("V4L2 capture unavailable on %s, falling back to VideoCapture", path);
+	}
+
+	if (is_index)
+	{
+		imgStruct->cap = new VideoCapture(imgStruct->dev);
+		imgStruct->cap->set(CAP_PROP_FRAME_WIDTH, 640);
+		imgStruct->cap->set(CAP_PROP_FRAME_HEIGHT, 480);
+	}
+	else
+		imgStruct->cap = new VideoCapture(String(path));
+	DEBUG_LOG("Capture backend: VideoCapture (%s)", path);
+	return imgStruct->cap->isOpened() ? 0 : -1;
+}
+
+// Grab the next frame from the active backend as greyscale into dst
+// ts receives the capture timestamp (driver timestamp for V4L2)
+// Returns 0 on success, -1 if no frame was available
+int capture_grab(ImgCaptureStruct *imgStruct, Mat &dst, struct timespec *ts)
+{
+	if (imgStruct->use_v4l2)
+		return v4l2_grab(&imgStruct->v4l2, dst, ts, 1000);
+
+	// Make sure camera is still connected
+	if ( imgStruct->cap == NULL || !imgStruct->cap->isOpened() )
+	{
+		DEBUG_LOG("%s", "Camera device not available");
+		return -1;
+	}
+	*(imgStruct->cap) >> imgStruct->img;
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	if (imgStruct->img.empty())
+	{
+		// End of a video file source, rewind so a clip can stand in for a camera
+		imgStruct->cap->set(CAP_PROP_POS_FRAMES, 0);
+		return -1;
+	}
+	// File sources may not match the 640x480 frame slots
+	if (imgStruct->img.size() != dst.size())
+		resize(imgStruct->img, imgStruct->img, dst.size());
+	if (imgStruct->img.channels() == 1)
+		imgStruct->img.copyTo(dst);
+	else
+		cvtColor(imgStruct->img, dst, CV_BGR2GRAY);
+	return 0;
+}
+
+// Drop the queue's pin on a frame slot (discard callback of the detect queue)
+void release_queued_slot(void *slot)
+{
+	frame_ring_release((FrameSlot*) slot);
+}
+
+// Capture stage thread: write frames from /dev/video# into the raw frame ring
 // Logitech C270 webcam operates at max frame rate of 30 FPS
+// Every raw frame goes to the annotate stage, and to the detect stage while face detection is on
 void *capture_video(void *ptr)
 {
     // Obtain video structure attributes
+    ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
+	FrameSlot *slot;					// Ring slot the current frame is written to
+	struct timespec ts;					// Capture timestamp of the current frame
+
+	capture_sched_init(&imgStruct->sched, imgStruct->frame_rate);
+	// Loop until program terminated
+    while(END_PROGRAM == 0)
+    {
+		// Max frame rate of the Logitech C270 is 30 FPS
+		// No need to capture any faster that, wait for the next frame deadline
+		// Capture always runs at the native rate, viewers wanting fewer frames are decimated
+		capture_sched_wait(&imgStruct->sched);
+		// Capture frame
+		if (imgStruct->pauseVideo == 0)
+		{
+			// Claim a free frame slot, drop the frame if every slot is still being read
+			slot = frame_ring_begin_write(&imgStruct->raw);
+			if (slot == NULL)
+			{
+				TRACE_LOG("All frame slots busy, frame dropped");
+				continue;
+			}
+			// Capture the greyscale frame straight into the slot
+			if (capture_grab(imgStruct, slot->img, &ts) < 0)
+			{
+				frame_ring_abort_write(slot);
+				continue;
+			}
+			// Publish with one pin per downstream queue, a refused push gives its pin back
+			frame_ring_publish(&imgStruct->raw, slot, &ts, 2);
+			if (!spsc_push(&imgStruct->annotate_q, slot))
+				frame_ring_release(slot);
+			if (!imgStruct->face_detect_enable || !spsc_push(&imgStruct->detect_q, slot, release_queued_slot))
+				frame_ring_release(slot);
+		}
+	} // End while loop
+    DEBUG_LOG("Terminating Video Capture Thread");
+    return NULL;
+}
+
+// Detect stage thread: run the face cascade as fast as it can on the newest raw frame
+// Results are posted to imgStruct->faces and drawn by the annotate stage on whatever
+// frame is current when they arrive
+void *detect_video(void *ptr)
+{
+    ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
+	std::vector<Rect> faces;
+	Mat smallImg;						// Detection resolution scratch frame
+	std::vector<Rect> regions;			// Moving regions, detection coordinates
+	double detect_ms;
+	uint64_t last_seq = 0;				// Raw frame processed last
+
+    while(END_PROGRAM == 0)
+    {
+		FrameSlot *slot = (FrameSlot*) spsc_pop_wait(&imgStruct->detect_q, 100);
+		if (slot == NULL)
+			continue;
+
+		// Analyze current frame for a persons face
+		// The cascade runs every detect_interval frames, the tracker follows the faces in between
+		// After a long gap (detection was off, or frames were skipped) the tracked faces are stale
+		if (slot->seq - last_seq > FACE_HOLD_FRAMES)
+			imgStruct->tracker.since_detect = imgStruct->tracker.detect_interval;
+		last_seq = slot->seq;
+		double t = (double)getTickCount();
+		// The motion background follows every frame, even those that only go through the tracker
+		if (imgStruct->motion_gate)
+		{
+			motion_detect(&imgStruct->motion, slot->img, MOTION_FACE_MARGIN, regions);
+			mapRects(regions, slot->img.size(), imgStruct->detect_size);
+		}
+		prepareDetectFrame(slot->img, imgStruct->detect_size, smallImg);
+		if (tracker_needs_detect(&imgStruct->tracker) || !tracker_update(&imgStruct->tracker, smallImg, faces))
+		{
+			Size minSize = detectMinSize(smallImg.size(), slot->img.size());
+			if (!imgStruct->motion_gate || !regions.empty())
+			{
+				// Whole frame, or only where something moved
+				imgStruct->detector->detect(smallImg, imgStruct->motion_gate ? &regions : NULL,
+											minSize, faces);
+			}
+			else
+			{
+				// Static scene, nobody walked in
+				faces.clear();
+				imgStruct->motion.skipped.fetch_add(1, std::memory_order_relaxed);
+			}
+			tracker_reset(&imgStruct->tracker, smallImg, faces);
+		}
+		mapRects(faces, smallImg.size(), slot->img.size());
+		int found = (int)faces.size();
+		bool trigger = found > 0;
+		if (imgStruct->verifier.confirm_frames > 0)
+		{
+			// Only faces with eyes count, and only once seen on confirm_frames frames in a row
+			int candidates = found;
+			if (candidates > 0)
+				found = verify_faces(&imgStruct->verifier, slot->img, faces);
+			trigger = verifier_confirm(&imgStruct->verifier, candidates, found, &slot->ts);
+		}
+		detect_ms = ((double)getTickCount() - t) * 1000 / getTickFrequency();
+		TRACE_LOG("detection time = %g ms", detect_ms);
+
+		uint64_t us = (uint64_t)(detect_ms * 1000);
+		imgStruct->detect_frames.fetch_add(1, std::memory_order_relaxed);
+		imgStruct->detect_total_us.fetch_add(us, std::memory_order_relaxed);
+		if (us > imgStruct->detect_max_us.load(std::memory_order_relaxed))
+			imgStruct->detect_max_us.store(us, std::memory_order_relaxed);
+		uint64_t seq = slot->seq;
+		frame_ring_release(slot);
+
+		pthread_mutex_lock(&imgStruct->faces_lock);
+		imgStruct->faces = faces;
+		imgStruct->faces_seq = seq;
+		pthread_mutex_unlock(&imgStruct->faces_lock);
+		imgStruct->face_detected = trigger;
+
+		// If face detected in frame
+		if (imgStruct->face_detected && imgStruct->face_detect_enable)
+		{
+			// (Re)start the count down, then set record_video: a reader that sees the flag sees
+			// the deadline that goes with it
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			imgStruct->record_deadline_ns.store((int64_t)(now.tv_sec + imgStruct->record_time) * 1000000000LL + now.tv_nsec,
+												std::memory_order_release);
+			imgStruct->record_video.store(true, std::memory_order_release);
+		}
+	}
+    DEBUG_LOG("Terminating Face Detection Thread");
+    return NULL;
+}
+
+// Annotate stage thread: copy each raw frame into the output ring, draw the latest detection
+// results, settings and time stamps on it and publish it to the viewers and the record thread
+void *annotate_video(void *ptr)
+{
     ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
 	float m = 0.75;						// Scale factor for text on images
 	int rows;							// Used to place text at specific row on images
@@ -280,215 +1018,630 @@ void *capture_video(void *ptr)
 	int buf_size = 9;					// tm_str buff size
 	char* tm_str;						// Time stamp in local time (must be freed at end of function)
 	tm_str = (char*)malloc(buf_size);	// Allocate memory for tm_str
-	// Loop until program terminated
-
-	struct timeval t1, t2;
+	struct timespec now;
 	double record_time_left;
+	std::vector<Rect> faces;
+	uint64_t faces_seq;
+
     while(END_PROGRAM == 0)
     {
-		// Max frame rate of the Logitech C270 is 30 FPS
-		// No need to capture any faster that, sleep based on the current specified frame rate
-		// Time sleep calculated when frame rate is set by the user
-		usleep(imgStruct->time_sleep);
-		// Capture frame
-		if (imgStruct->pauseVideo == 0)
+		FrameSlot *raw = (FrameSlot*) spsc_pop_wait(&imgStruct->annotate_q, 100);
+		if (raw == NULL)
+			continue;
+
+		FrameSlot *slot = frame_ring_begin_write(&imgStruct->ring);
+		if (slot == NULL)
 		{
-			// Make sure camera is still connected
-			if ( !imgStruct->cap->isOpened() )
-				DEBUG_LOG("%s", "Camera device not available");
-			else
+			TRACE_LOG("All output frame slots busy, frame dropped");
+			frame_ring_release(raw);
+			continue;
+		}
+		raw->img.copyTo(slot->img);
+		struct timespec ts = raw->ts;
+		uint64_t raw_seq = raw->seq;
+		frame_ring_release(raw);
+		slot->faces.clear();
+
+		// If face dectection is enabled
+		if (imgStruct->face_detect_enable)
+		{
+			// Draw the latest results unless they have gone stale, detection may already be on a
+			// newer frame than the one annotated
+			pthread_mutex_lock(&imgStruct->faces_lock);
+			faces = imgStruct->faces;
+			faces_seq = imgStruct->faces_seq;
+			pthread_mutex_unlock(&imgStruct->faces_lock);
+			if (faces_seq >= raw_seq || raw_seq - faces_seq <= FACE_HOLD_FRAMES)
 			{
-				// Start video capture 
-				*(imgStruct->cap) >> imgStruct->img;
-				// If face dectection is enabled
-				if (imgStruct->face_detect_enable)
-				{
-					// Analyze current frame for a persons face
-					detectAndDraw(imgStruct->img, imgStruct->cascade, imgStruct->nestedCascade, &imgStruct->face_detected);
-					// Update string to show status of face detection settings
-					strcpy(facedetect_str, "FACE DETECTECTION: ENABLED");
-					// If face detected in frame
-					if(imgStruct->face_detected)
-					{
-						// Set "RECORD_VIDEO" flag and start the count down timer
-						RECORD_VIDEO = true;
-						timer_init(imgStruct->record_time);
-						gettimeofday(&t1, NULL);
-					}
-				}
-				else
-				{
-					// Update string to show status of face detection settings
-					strcpy(facedetect_str, "FACE DETECTECTION: DISABLED");
-				}
-				// Convert image to greyscale
-				cvtColor(imgStruct->img, imgStruct->imgGray, CV_BGR2GRAY);
-				rows = imgStruct->imgGray.rows;
-
-				// Add program settings and time stamps to image
-
-				// Get and print time stamp
-				get_local_time(tm_str, buf_size);
-				cv::putText(imgStruct->imgGray, tm_str, cv::Point(10, rows - (rows / 10)),
-		            				cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
-				// Print facedetect enable status
-				cv::putText(imgStruct->imgGray, facedetect_str, cv::Point(10, rows - (rows / 40)),
+				drawFaces(slot->img, faces);
+				slot->faces = faces;
+			}
+			// Update string to show status of face detection settings
+			strcpy(facedetect_str, "FACE DETECTECTION: ENABLED");
+		}
+		else
+		{
+			// Update string to show status of face detection settings
+			strcpy(facedetect_str, "FACE DETECTECTION: DISABLED");
+		}
+		rows = slot->img.rows;
+
+		// Add program settings and time stamps to image
+
+		// Get and print time stamp
+		get_local_time(tm_str, buf_size);
+		cv::putText(slot->img, tm_str, cv::Point(10, rows - (rows / 10)),
 							cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
+		// Print facedetect enable status
+		cv::putText(slot->img, facedetect_str, cv::Point(10, rows - (rows / 40)),
+					cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
+
+		// Face triggered recording stops once its count down expires
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		bool recording = imgStruct->record_video.load(std::memory_order_acquire);
+		int64_t deadline = imgStruct->record_deadline_ns.load(std::memory_order_acquire);
+		record_time_left = (deadline - ((int64_t)now.tv_sec * 1000000000LL + now.tv_nsec)) / 1e9;
+		// Only the deadline read here is retired: a trigger that stored a new one meanwhile
+		// fails the exchange, or is seen again once the flag is cleared and sets it back
+		if (recording && !imgStruct->manual_record && record_time_left <= 0 &&
+			imgStruct->record_deadline_ns.compare_exchange_strong(deadline, 0))
+		{
+			imgStruct->record_video.store(false);
+			if (imgStruct->record_deadline_ns.load() != 0)
+				imgStruct->record_video.store(true);
+		}
 
-				if (RECORD_VIDEO & (imgStruct->manual_record == false))
-				{
-					// Capturing video due to face detection 
-					gettimeofday(&t2, NULL);
-					record_time_left = imgStruct->record_time - (t2.tv_sec - t1.tv_sec);
-					snprintf(timer_Str, sizeof(timer_Str), "MODE [FD]: TIMER: %.0fs", record_time_left);
-					cv::putText(imgStruct->imgGray, "RECORDING", cv::Point(10, (rows / 12)),
-		            				cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
-					cv::putText(imgStruct->imgGray, timer_Str, cv::Point(10, (rows / 7)),
+		if (imgStruct->record_video & (imgStruct->manual_record == false))
+		{
+			// Capturing video due to face detection 
+			snprintf(timer_Str, sizeof(timer_Str), "MODE [FD]: TIMER: %.0fs", record_time_left);
+			cv::putText(slot->img, "RECORDING", cv::Point(10, (rows / 12)),
 							cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
-				}
-				else if (RECORD_VIDEO)
-				{
-					// Capturing video manually 
-					snprintf(timer_Str, sizeof(timer_Str), "MODE [MANUAL]");
-					cv::putText(imgStruct->imgGray, "RECORDING", cv::Point(10, (rows / 12)),
-		            				cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
-					cv::putText(imgStruct->imgGray, timer_Str, cv::Point(10, (rows / 7)),
+			cv::putText(slot->img, timer_Str, cv::Point(10, (rows / 7)),
+					cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
+		}
+		else if (imgStruct->record_video)
+		{
+			// Capturing video manually 
+			snprintf(timer_Str, sizeof(timer_Str), "MODE [MANUAL]");
+			cv::putText(slot->img, "RECORDING", cv::Point(10, (rows / 12)),
 							cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
-				}
-			}
+			cv::putText(slot->img, timer_Str, cv::Point(10, (rows / 7)),
+					cv::FONT_HERSHEY_SIMPLEX, m, CV_RGB(255, 0, 0), 2);
 		}
-		imgStruct->face_detected = 0;
+		// Frame complete, make it visible to the viewers. It keeps the raw frame's capture timestamp
+		// The encode stage gets every frame through its queue while viewers or the recorder want
+		// JPEG: the queue holds a pin, a refused push gives it back
+		bool encode = jpeg_watched(imgStruct) || record_watched(imgStruct);
+		frame_ring_publish(&imgStruct->ring, slot, &ts, encode ? 1 : 0);
+		if (encode && !spsc_push(&imgStruct->encode_q, slot))
+			frame_ring_release(slot);
 	} // End while loop
 	free(tm_str);
-    DEBUG_LOG("Terminating Video Capture Thread");
+    DEBUG_LOG("Terminating Annotate Thread");
+    return NULL;
 }
 
 
+// Next free frame of the record I/O thread, waits while the disk is behind
+// Returns NULL once the program ends
+static RecordFrame *record_io_frame(ImgCaptureStruct *imgStruct)
+{
+	RecordFrame *f = NULL;
+	while (f == NULL && END_PROGRAM == 0)
+		f = (RecordFrame*) spsc_pop_wait(&imgStruct->io_free, 100);
+	return f;
+}
+
+// Hand a frame, or the end of the event, to the record I/O thread
+// The queue holds every frame of the pool, it never refuses one
+static void record_io_submit(ImgCaptureStruct *imgStruct, RecordFrame *f)
+{
+	spsc_push(&imgStruct->io_q, f);
+}
+
 // Thread to manage video recording
+// The JPEG frames of variant 0 arrive through record_q in capture order with their capture
+// timestamps, a slow disk fills the queue and drops frames there but never holds up capture.
+// The encode stage queues them while recording, and with a pre-event buffer (-P) all the time:
+// while nothing is recorded they are kept for pre_event_seconds. A trigger hands the whole
+// buffer to the I/O thread at once and goes on with the live frames from the same queue, so
+// the recording has no gap at the join unless the disk falls RECORD_IO_FRAMES frames behind
+// Files are written by the record I/O thread, an event ends once recording stopped and its
+// last frame was handed over
 void *record_video(void *ptr)
 {
     // Obtain video structure attributes
     ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
 
-	int buf_size = 9;					// tm_str buff size
-	char* tm_str;						// Time stamp in local time (must be freed at end of function)
-	tm_str = (char*)malloc(buf_size);
-	VideoWriter vWriter;
-	Size S = Size((int) 640,(int) 480);
-	// Create a new video file to write to
-    get_local_time(tm_str, buf_size);
-	snprintf(imgStruct->write_dir, imgStruct->dir_name_size, "/tmp/video_recording_%s.avi", tm_str);
-	vWriter.open(imgStruct->write_dir, CV_FOURCC('M','J','P','G'), imgStruct->frame_rate, S, 0);
-	long frames = 0;
+	bool pre_event = imgStruct->pre_event_seconds > 0;
+	bool event = false;					// Frames of an event went to the I/O thread
+	PreEventRing *history = &imgStruct->pre_event_rings[0];
+	RecordFrame *f;
 	while (END_PROGRAM == 0)
 	{
-		usleep(imgStruct->time_sleep);
-		if (RECORD_VIDEO)
+		// Time out to check END_PROGRAM
+		FrameSlot *slot = (FrameSlot*) spsc_pop_wait(&imgStruct->record_q, 100);
+		if (event && !imgStruct->record_video && (slot == NULL || pre_event) &&
+			(f = record_io_frame(imgStruct)) != NULL)
+		{
+			f->end = true;
+			f->history = NULL;
+			record_io_submit(imgStruct, f);
+			event = false;
+		}
+		if (slot == NULL)
+			continue;
+		if (pre_event && !imgStruct->record_video)
 		{
-			// Capture frame
-			vWriter << imgStruct->imgGray;
+			pre_event_push(history, slot->seq, &slot->ts, slot->size, slot->data.data(), slot->data.size());
+			frame_ring_release(slot);
+			imgStruct->pre_event_frames.store(history->count, std::memory_order_relaxed);
+			imgStruct->pre_event_bytes.store(history->bytes, std::memory_order_relaxed);
+			imgStruct->pre_event_evicted.fetch_add(history->evicted, std::memory_order_relaxed);
+			history->evicted = 0;
+			continue;
 		}
+
+		event = true;
+		if (pre_event && history->count > 0)
+		{
+			// Triggered: the buffered seconds go first, swapped for the empty ring in one handoff.
+			// The spare is only missing while the previous event's history is still being written
+			PreEventRing *spare = NULL;
+			while (spare == NULL && END_PROGRAM == 0)
+				spare = (PreEventRing*) spsc_pop_wait(&imgStruct->pre_event_free, 100);
+			if (spare != NULL && (f = record_io_frame(imgStruct)) != NULL)
+			{
+				DEBUG_LOG("Camera %d: recording starts %.1f s before its trigger", imgStruct->id,
+						  pre_event_seconds(history));
+				imgStruct->pre_event_flushed.fetch_add(history->count, std::memory_order_relaxed);
+				f->end = false;
+				f->history = history;
+				record_io_submit(imgStruct, f);
+				history = spare;
+				imgStruct->pre_event_frames.store(0, std::memory_order_relaxed);
+				imgStruct->pre_event_bytes.store(0, std::memory_order_relaxed);
+			}
+		}
+		f = record_io_frame(imgStruct);
+		if (f != NULL)
+		{
+			// The slot goes back to the encode stage, the JPEG is copied (buffers keep their capacity)
+			f->data.assign(slot->data.begin(), slot->data.end());
+			f->size = slot->size;
+			f->ts = slot->ts;
+			f->end = false;
+			f->history = NULL;
+			record_io_submit(imgStruct, f);
+		}
+		frame_ring_release(slot);
 	}
-	vWriter.release();
 	DEBUG_LOG("Video recording complete");
+	return NULL;
 }
 
+// Write one frame to the current segment of the event, opening the next segment when needed
+static void record_io_write(ImgCaptureStruct *imgStruct, Recording *rec, const std::vector<uchar> &data,
+							Size size, const struct timespec *ts)
+{
+	RecordPolicy *policy = &imgStruct->record_policy;
+
+	// Next segment once this one is full, or the camera rate changed: a file plays back at
+	// the rate it was opened with
+	if (recording_is_open(rec) && (recording_full(rec, policy) || rec->fps != imgStruct->frame_rate))
+	{
+		if (recording_close(rec) < 0)
+			syslog(LOG_DEBUG, "Writing %s failed", rec->path);
+		rec->segment++;
+	}
+	if (!recording_is_open(rec))
+	{
+		if (recording_open(rec, policy, imgStruct->frame_rate, size) < 0)
+		{
+			syslog(LOG_DEBUG, "Cannot open %s for recording", rec->path);
+			return;
+		}
+		DEBUG_LOG("Camera %d: recording to %s at %.1f FPS", imgStruct->id, rec->path, rec->fps);
+		imgStruct->record_files.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	double t = (double)getTickCount();
+	uint64_t repeats = rec->repeats;
+	int written = recording_write(rec, data.data(), data.size(), ts);
+	if (written < 0)
+	{
+		// Disk full or failing: finish what the file holds, the next frame tries a new one
+		syslog(LOG_DEBUG, "Writing %s failed", rec->path);
+		recording_close(rec);
+		rec->segment++;
+		return;
+	}
+
+	imgStruct->record_frames.fetch_add(written, std::memory_order_relaxed);
+	imgStruct->record_repeats.fetch_add(rec->repeats - repeats, std::memory_order_relaxed);
+	imgStruct->record_total_us.fetch_add((uint64_t)(((double)getTickCount() - t) * 1e6 / getTickFrequency()),
+										 std::memory_order_relaxed);
+	imgStruct->record_syncs.store(rec->syncs, std::memory_order_relaxed);
+	imgStruct->record_deleted.store(rec->deleted, std::memory_order_relaxed);
+}
 
-// Thread function to send img
-void *display(void *ptr)
+// Record I/O thread: write the frames of the record thread, one file per event cut into
+// segments by the camera's RecordPolicy. Disk stalls only hold up this thread
+void *record_io_video(void *ptr)
 {
-    int bytes = 0;
-    char buf[10] = {'\0'};
-    int userInput = 0;
-    VideoStream *vStream = (VideoStream*) ptr;
-    vStream->thread_complete = false;
-    int socket = vStream->remoteSocket;
-    DEBUG_LOG("Innitialized display thread ID: %ld", vStream->thread_id);
-
-    struct pollfd pfds[1];
-    pfds[0].fd = socket;
-    pfds[0].events = POLLIN;
+    ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
+	Recording rec;
 
-    while(END_PROGRAM == 0)
-    {
-	// Poll for 1000 ms
-	int num_events = poll(pfds, 1, 30);
-	if (num_events == 0)
+	recording_init(&rec);
+	while (END_PROGRAM == 0)
 	{
-		// Poll timed out, do noting
+		RecordFrame *f = (RecordFrame*) spsc_pop_wait(&imgStruct->io_q, 100);
+		if (f == NULL)
+			continue;
+		if (f->end)
+		{
+			if (recording_is_open(&rec))
+			{
+				if (recording_close(&rec) < 0)
+					syslog(LOG_DEBUG, "Writing %s failed", rec.path);
+				DEBUG_LOG("Camera %d: recording %s closed", imgStruct->id, rec.path);
+			}
+			rec.segment = 0;
+		}
+		else if (f->history != NULL)
+		{
+			// Pre-event buffer: written from the ring, which goes back empty for the next event
+			for (int i = 0; i < f->history->count; i++)
+			{
+				PreEventFrame *p = pre_event_at(f->history, i);
+				record_io_write(imgStruct, &rec, p->data, p->size, &p->ts);
+			}
+			pre_event_clear(f->history);
+			spsc_push(&imgStruct->pre_event_free, f->history);
+			f->history = NULL;
+		}
+		else
+			record_io_write(imgStruct, &rec, f->data, f->size, &f->ts);
+		spsc_push(&imgStruct->io_free, f);
 	}
-	else
+	if (recording_is_open(&rec))
+		recording_close(&rec);
+	DEBUG_LOG("Record I/O thread complete");
+	return NULL;
+}
+
+
+// Subscribe a viewer to JPEG frames of the given tier and quality: an encoded variant that
+// already has them, else a variant nobody watches, else the default variant 0
+// Returns the variant index
+int jpeg_variant_acquire(ImgCaptureStruct *imgStruct, int tier, int quality)
+{
+	int found = -1;
+
+	pthread_mutex_lock(&imgStruct->jpeg_lock);
+	for (int v = 0; v < JPEG_VARIANTS && found < 0; v++)
+		if (imgStruct->jpeg[v].tier == tier && imgStruct->jpeg[v].quality == quality)
+			found = v;
+	// Variant 0 keeps its parameters, the others are reconfigured while unwatched
+	for (int v = 1; v < JPEG_VARIANTS && found < 0; v++)
+		if (imgStruct->jpeg[v].viewers.load() == 0)
+		{
+			imgStruct->jpeg[v].tier = tier;
+			imgStruct->jpeg[v].quality = quality;
+			found = v;
+		}
+	if (found < 0)
+		found = 0;
+	imgStruct->jpeg[found].viewers.fetch_add(1);
+	pthread_mutex_unlock(&imgStruct->jpeg_lock);
+	return found;
+}
+
+void jpeg_variant_release(ImgCaptureStruct *imgStruct, int variant)
+{
+	imgStruct->jpeg[variant].viewers.fetch_sub(1);
+}
+
+// True if any viewer wants JPEG frames
+bool jpeg_watched(ImgCaptureStruct *imgStruct)
+{
+	for (int v = 0; v < JPEG_VARIANTS; v++)
+		if (imgStruct->jpeg[v].viewers.load(std::memory_order_relaxed) > 0)
+			return true;
+	return false;
+}
+
+// True if the recorder wants the JPEG frames of variant 0: always with a pre-event buffer,
+// else while recording
+bool record_watched(ImgCaptureStruct *imgStruct)
+{
+	return imgStruct->pre_event_seconds > 0 || imgStruct->record_video;
+}
+
+// Encode stage thread: JPEG encode every annotated frame once per watched variant into the
+// variant's ring, which every viewer subscribed to it shares. The annotate stage only queues
+// frames while a variant is watched or the recorder wants frames
+// The recorder stores the frames of variant 0 as they are, they are queued to the record
+// thread: with viewers of the default stream too, each frame is encoded once for both
+void *encode_video(void *ptr)
+{
+    ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
+	std::vector<int> params(2);
+	Mat scaled[STREAM_TIERS];
+
+	params[0] = IMWRITE_JPEG_QUALITY;
+	while (END_PROGRAM == 0)
 	{
-	    // Received data from client, handle input
-	    int pollin_happened = pfds[0].revents & POLLIN;
-	    if (pollin_happened)
-	    {
-			bytes = recv(socket, buf, 10, 0);
-			if (bytes > 0)	// Handle bytes received from client
+		// Frames in capture order, time out to check END_PROGRAM
+		FrameSlot *src = (FrameSlot*) spsc_pop_wait(&imgStruct->encode_q, 100);
+		if (src == NULL)
+			continue;
+		// Each tier is scaled down at most once per frame, however many variants use it
+		bool have_tier[STREAM_TIERS] = { true };
+		bool record = record_watched(imgStruct);
+		// Variant parameters are rewritten by the reactors as viewers come and go
+		int tiers[JPEG_VARIANTS], qualities[JPEG_VARIANTS];
+		pthread_mutex_lock(&imgStruct->jpeg_lock);
+		for (int v = 0; v < JPEG_VARIANTS; v++)
+		{
+			tiers[v] = imgStruct->jpeg[v].tier;
+			qualities[v] = imgStruct->jpeg[v].quality;
+		}
+		pthread_mutex_unlock(&imgStruct->jpeg_lock);
+		for (int v = 0; v < JPEG_VARIANTS; v++)
+		{
+			JpegVariant *variant = &imgStruct->jpeg[v];
+			if (variant->viewers.load(std::memory_order_relaxed) == 0 && !(record && v == 0))
+				continue;
+			FrameSlot *slot = frame_ring_begin_write(&variant->ring);
+			if (slot == NULL)
 			{
-				char* token = strtok(buf, "\n");
-				strcpy(buf, token);
-				userInput = atoi(buf);
-				DEBUG_LOG("Data Received: %d", userInput);
-				switch(userInput)
-				{
-					// Expected Default condition, do nothing
-					case 0 :
-						break;
-					// Toggle face detection
-					case 100 :
-						vStream->imgStruct->face_detect_enable = !vStream->imgStruct->face_detect_enable;
-						vStream->imgStruct->manual_record = false;
-						break;
-					// Pause video
-					case 200 :
-						vStream->imgStruct->pauseVideo = !vStream->imgStruct->pauseVideo;
-						break;
-					// Record video
-					case 300 :
-						RECORD_VIDEO = !RECORD_VIDEO;
-						vStream->imgStruct->manual_record = !vStream->imgStruct->manual_record;
-						vStream->imgStruct->face_detect_enable = false;
-						break;
-					// Frame Rate adjustment
-					default :
-						// Get user input frame rate
-						vStream->imgStruct->frame_rate = userInput;
-						// Convert frame rate micro-useconds
-						vStream->imgStruct->time_sleep = (1 / vStream->imgStruct->frame_rate) * 1000000;
-						DEBUG_LOG("Adjusted Frame Rate: %.2f/s", vStream->imgStruct->frame_rate);
-						DEBUG_LOG("Adjusted Time Sleep: %.2f us", vStream->imgStruct->time_sleep);
-						break;
-				}
-				// Clear buf and reset userInput value to default;
-				int i;
-				for (i=0; i < 10; i++)
-				{
-					buf[i] = '\0';
-				}
-				userInput = 0;
-			}	// End of Handle bytes received block
- 	    }
-		else // num_events > 0 but polling_happened = 0, something went wrong with poll event
-	    {
-			syslog(LOG_DEBUG, "Unexpected event occurred: %d\n", pfds[0].revents);
-	    }
+				TRACE_LOG("All JPEG slots of variant %d busy, frame dropped", v);
+				continue;
+			}
+			double t = (double)getTickCount();
+			int tier = tiers[v];
+			if (!have_tier[tier])
+			{
+				resize(src->img, scaled[tier], Size(), 1.0 / (1 << tier), 1.0 / (1 << tier), INTER_AREA);
+				have_tier[tier] = true;
+			}
+			const Mat &img = tier == 0 ? src->img : scaled[tier];
+			params[1] = qualities[v];
+			// The slot's buffer keeps its capacity, after the first frames imencode does not allocate
+			imencode(".jpg", img, slot->data, params);
+			slot->size = img.size();
+			// Face rectangles in the coordinates of the encoded size
+			slot->faces = src->faces;
+			for (size_t i = 0; i < slot->faces.size(); i++)
+				slot->faces[i] = Rect(slot->faces[i].x >> tier, slot->faces[i].y >> tier,
+									  slot->faces[i].width >> tier, slot->faces[i].height >> tier);
+			size_t bytes = slot->data.size();
+			if (record && v == 0)
+			{
+				frame_ring_publish(&variant->ring, slot, &src->ts, 1);
+				if (!spsc_push(&imgStruct->record_q, slot))
+					frame_ring_release(slot);
+			}
+			else
+				frame_ring_publish(&variant->ring, slot, &src->ts);
+
+			imgStruct->encode_frames.fetch_add(1, std::memory_order_relaxed);
+			imgStruct->encode_total_us.fetch_add((uint64_t)(((double)getTickCount() - t) * 1e6 / getTickFrequency()),
+												 std::memory_order_relaxed);
+			imgStruct->encode_bytes.fetch_add(bytes, std::memory_order_relaxed);
+		}
+		frame_ring_release(src);
 	}
+    DEBUG_LOG("Terminating Encode Thread");
+    return NULL;
+}
 
-    // Done handling client input, send current frame
-	if ((bytes = send(socket, vStream->imgStruct->imgGray.data, vStream->imgStruct->imgSize, 0)) < 0)
+// Apply a control command sent by a viewer
+//   0    nothing
+//   100  toggle face detection
+//   200  pause / resume video
+//   300  start / stop manual recording
+// Frame rate, size, quality and format are per viewer and handled by the event loop
+// Returns -1 for any other value
+int handle_command(ImgCaptureStruct *imgStruct, int userInput)
+{
+	switch(userInput)
 	{
-	       syslog(LOG_DEBUG, "Error sending data --> retVal = %d", bytes);
-	       break;
+		// Expected Default condition, do nothing
+		case 0 :
+			break;
+		// Toggle face detection
+		case 100 :
+			imgStruct->face_detect_enable = !imgStruct->face_detect_enable;
+			imgStruct->manual_record = false;
+			break;
+		// Pause video
+		case 200 :
+			imgStruct->pauseVideo = !imgStruct->pauseVideo;
+			break;
+		// Record video
+		case 300 :
+			imgStruct->record_video.store(!imgStruct->record_video.load());
+			imgStruct->manual_record = !imgStruct->manual_record;
+			imgStruct->face_detect_enable = false;
+			break;
+		// Not a camera command
+		default :
+			return -1;
 	}
-	else
+	return 0;
+}
+
+// Shared memory thread: copies every annotated frame into the camera's shared memory ring
+void *share_video(void *ptr)
+{
+    ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
+	uint64_t last_seq = imgStruct->ring.seq.load();
+	int rects[FRAME_MAX_FACES][4];
+
+	while (END_PROGRAM == 0)
 	{
-		// std::cout << "Bytes Sent: " << bytes << std::endl;
+		// Wake up when the annotate stage publishes a frame, time out to check END_PROGRAM
+		uint64_t seq = frame_ring_wait(&imgStruct->ring, last_seq, 100);
+		if (seq == last_seq)
+			continue;
+		FrameSlot *src = frame_ring_acquire(&imgStruct->ring);
+		if (src == NULL)
+			continue;
+		last_seq = src->seq;
+
+		double t = (double)getTickCount();
+		int num_faces = src->faces.size() < FRAME_MAX_FACES ? src->faces.size() : FRAME_MAX_FACES;
+		for (int i = 0; i < num_faces; i++)
+		{
+			rects[i][0] = src->faces[i].x;
+			rects[i][1] = src->faces[i].y;
+			rects[i][2] = src->faces[i].width;
+			rects[i][3] = src->faces[i].height;
+		}
+		// One copy per frame, however many local readers there are
+		shm_ring_publish(&imgStruct->shm, src->seq, &src->ts, src->img.cols, src->img.rows,
+						 FRAME_PIX_GRAY8, FRAME_ENC_RAW, rects, num_faces,
+						 src->img.data, src->img.total() * src->img.elemSize());
+		frame_ring_release(src);
+
+		imgStruct->shm_frames.fetch_add(1, std::memory_order_relaxed);
+		imgStruct->shm_total_us.fetch_add((uint64_t)(((double)getTickCount() - t) * 1e6 / getTickFrequency()),
+										  std::memory_order_relaxed);
 	}
+    DEBUG_LOG("Terminating Shared memory Thread");
+    return NULL;
+}
 
-    }
-    vStream->thread_complete = true;
-    DEBUG_LOG("Terminating Display for Thread ID: %ld", vStream->thread_id);
+// Multicast thread: sends every annotated frame once to the camera's multicast group, however
+// many viewers joined it. JPEG frames of the default variant, or block deltas against the
+// group's one reference image with a raw keyframe at least every MCAST_KEYFRAME_INTERVAL frames
+void *mcast_video(void *ptr)
+{
+    ImgCaptureStruct *imgStruct = (ImgCaptureStruct*) ptr;
+	McastSender *sender = &imgStruct->mcast;
+	bool delta = imgStruct->mcast_format == FRAME_ENC_DELTA;
+	FrameRing *ring = &imgStruct->ring;
+	int variant = 0;
+	Mat reference;						// Image every synchronized receiver holds
+	std::vector<uint16_t> delta_blocks;
+	std::vector<uchar> delta_buf;
+	uint8_t head[sizeof(FrameHeader) + FRAME_MAX_FACES * sizeof(FaceRecord)];
+	FrameHeader *hdr = (FrameHeader*)head;
+	FaceRecord *faces = (FaceRecord*)(head + sizeof(FrameHeader));
+	int rects[FRAME_MAX_FACES][4];
+
+	// The group counts as one JPEG viewer, so the encode stage keeps encoding for it
+	if (!delta)
+	{
+		variant = jpeg_variant_acquire(imgStruct, 0, imgStruct->jpeg_quality);
+		ring = &imgStruct->jpeg[variant].ring;
+	}
+	uint64_t last_seq = ring->seq.load();
+	while (END_PROGRAM == 0)
+	{
+		// Wake up when a frame is published, time out to check END_PROGRAM
+		uint64_t seq = frame_ring_wait(ring, last_seq, 100);
+		if (seq == last_seq)
+			continue;
+		FrameSlot *src = frame_ring_acquire(ring);
+		if (src == NULL)
+			continue;
+		last_seq = src->seq;
+
+		int num_faces = src->faces.size() < FRAME_MAX_FACES ? src->faces.size() : FRAME_MAX_FACES;
+		for (int i = 0; i < num_faces; i++)
+		{
+			rects[i][0] = src->faces[i].x;
+			rects[i][1] = src->faces[i].y;
+			rects[i][2] = src->faces[i].width;
+			rects[i][3] = src->faces[i].height;
+		}
+		bool key = true;
+		int encoding = FRAME_ENC_JPEG;
+		Size size = src->size;
+		const void *payload = src->data.data();
+		uint32_t payload_len = src->data.size();
+		if (delta)
+		{
+			const Mat &img = src->img;
+			int blocks = ((img.cols + DELTA_BLOCK - 1) / DELTA_BLOCK) * ((img.rows + DELTA_BLOCK - 1) / DELTA_BLOCK);
+			key = mcast_sender_key_due(sender) || reference.size() != img.size();
+			if (!key)
+				key = delta_changed(img, reference, (int)(blocks * DELTA_KEYFRAME_SHARE), delta_blocks) < 0;
+			if (!key)
+				delta_encode(img, reference, delta_blocks, delta_buf);
+			if (key)
+				img.copyTo(reference);
+			encoding = key ? FRAME_ENC_RAW : FRAME_ENC_DELTA;
+			size = img.size();
+			payload = key ? (const void*)img.data : (const void*)delta_buf.data();
+			payload_len = key ? img.total() : delta_buf.size();
+		}
+		int head_len = frame_header_pack(hdr, faces, src->seq, &src->ts, size.width, size.height,
+										 FRAME_PIX_GRAY8, encoding, rects, num_faces, payload_len);
+		int datagrams = mcast_sender_send(sender, src->seq, key, head, head_len, payload, payload_len);
+		frame_ring_release(src);
+
+		if (datagrams < 0)
+		{
+			imgStruct->mcast_errors.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		imgStruct->mcast_frames.fetch_add(1, std::memory_order_relaxed);
+		imgStruct->mcast_keyframes.fetch_add(key, std::memory_order_relaxed);
+		imgStruct->mcast_datagrams.fetch_add(datagrams, std::memory_order_relaxed);
+		imgStruct->mcast_bytes.fetch_add(head_len + payload_len, std::memory_order_relaxed);
+	}
+	if (!delta)
+		jpeg_variant_release(imgStruct, variant);
+    DEBUG_LOG("Terminating Multicast Thread");
+    return NULL;
 }
 
+// Log viewer counts and send statistics of the reactor threads since the previous report
+void report_reactors(StreamReactor *reactors, int num_reactors)
+{
+	for (int r = 0; r < num_reactors; r++)
+	{
+		StreamReactor *reactor = &reactors[r];
+		uint64_t sent = reactor->bytes_sent.exchange(0);
+		uint64_t copied = reactor->bytes_copied.exchange(0);
+		DEBUG_LOG("Reactor %d: %d viewers (%llu connected, %llu closed), frames sent %llu, "
+				"skipped %llu, backlogged %llu, %.1f MB sent (%.2f copies/byte, %llu zero-copy sends, "
+				"%llu copied by the kernel), CPU sys %.1f ms user %.1f ms, %llu HTTP requests (%llu timed out)",
+				r, reactor->num_clients.load(),
+				(unsigned long long)reactor->accepted.exchange(0),
+				(unsigned long long)reactor->closed.exchange(0),
+				(unsigned long long)reactor->frames_sent.exchange(0),
+				(unsigned long long)reactor->frames_skipped.exchange(0),
+				(unsigned long long)reactor->backlogged.exchange(0),
+				sent / 1e6, sent ? (double)copied / sent : 0.0,
+				(unsigned long long)reactor->zc_sends.exchange(0),
+				(unsigned long long)reactor->zc_fallbacks.exchange(0),
+				reactor->sys_us.exchange(0) / 1e3, reactor->user_us.exchange(0) / 1e3,
+				(unsigned long long)reactor->http_requests.exchange(0),
+				(unsigned long long)reactor->http_timeouts.exchange(0));
+
+		uint64_t delta_frames = reactor->delta_frames.exchange(0);
+		uint64_t blocks_total = reactor->delta_blocks_total.exchange(0);
+		if (delta_frames > 0)
+			DEBUG_LOG("Reactor %d: delta mode %llu frames (%llu keyframes), %.1f%% of blocks sent, "
+					"%.1f kB/frame, encode %.0f us/frame",
+					r, (unsigned long long)delta_frames,
+					(unsigned long long)reactor->delta_keyframes.exchange(0),
+					blocks_total ? 100.0 * reactor->delta_blocks.exchange(0) / blocks_total : 0.0,
+					reactor->delta_bytes.exchange(0) / 1e3 / delta_frames,
+					(double)reactor->delta_us.exchange(0) / delta_frames);
 
+		uint64_t decimated = reactor->frames_decimated.exchange(0);
+		uint64_t adapt_down = reactor->adapt_down.exchange(0);
+		uint64_t adapt_up = reactor->adapt_up.exchange(0);
+		if (decimated > 0 || adapt_down > 0 || adapt_up > 0)
+			DEBUG_LOG("Reactor %d: %llu frames decimated for lower frame rates, adaptive steps %llu down %llu up",
+					r, (unsigned long long)decimated, (unsigned long long)adapt_down,
+					(unsigned long long)adapt_up);
+	}
+}
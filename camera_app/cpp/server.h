@@ -12,8 +12,21 @@
 *
 **************************************************************************************************/
 
+#include <deque>
 #include "opencv2/opencv.hpp"
 #include "queue.h"
+#include "frame_ring.h"
+#include "frame_proto.h"
+#include "capture_sched.h"
+#include "v4l2_capture.h"
+#include "spsc_queue.h"
+#include "face_tracker.h"
+#include "motion_detect.h"
+#include "face_verify.h"
+#include "shm_ring.h"
+#include "mcast_stream.h"
+#include "pre_event.h"
+#include "recorder.h"
 
 using namespace cv;
 
@@ -24,44 +37,269 @@ using namespace cv;
 #define TRACE_LOG(...)
 //#define TRACE_LOG(msg,...) printf("[ TRACE ] " msg "\n", ##__VA_ARGS__)
 
+#define STATS_INTERVAL	10		// Seconds between pipeline statistics reports
+#define FACE_HOLD_FRAMES	15		// Keep drawing detection results for this many frames
+#define MAX_CAMERAS			4		// Cameras served by one process (-d may be repeated)
+#define MAX_REACTORS		8		// Viewer event loop threads (-w)
+#define CMD_FORMAT_RAW		400		// Viewer control code: send raw greyscale frames
+#define CMD_FORMAT_JPEG		401		// Viewer control code: send JPEG frames
+#define CMD_FORMAT_DELTA	402		// Viewer control code: send changed blocks of raw frames
+#define STREAM_NOTSENT_LOWAT	(64 * 1024)	// Unsent bytes a viewer socket may queue in the kernel
+#define STREAM_ZEROCOPY_MIN		(16 * 1024)	// Smaller payloads are cheaper to copy than to pin (-z)
+#define CLIENT_MAX_LINE		256			// Longest command line a viewer may send
+#define STREAM_TIERS		3		// Viewer resolution tiers: full, 1/2, 1/4 of the capture size
+#define JPEG_VARIANTS		4		// Tier / quality combinations encoded at once per camera
+#define ADAPT_MAX_LEVEL		3		// Adaptive viewers: steps down from the subscribed rate and quality
+#define ADAPT_CLEAN_FRAMES	30		// Frames written without backing up before stepping back up
+#define ADAPT_QUALITY_STEP	15		// JPEG quality dropped per adaptive step
+#define ADAPT_MIN_QUALITY	30
+
+// Capture backends selectable with -b
+enum { CAPTURE_AUTO, CAPTURE_V4L2, CAPTURE_OPENCV };
+
+
+class FaceDetector;
+
+// Face models, loaded once; every camera runs its own copy (a classifier is not thread safe)
+typedef struct
+{
+	FaceDetector *detector;		// Face detector backend selected with -m, cameras use clones
+	String eyes_path;			// Eye cascade used to verify faces
+} FaceModels;
+
+// One tier / quality combination of the encode stage, shared by every viewer subscribed to it
+typedef struct
+{
+	int tier;					// Frames are scaled down by 1 << tier
+	int quality;				// JPEG quality
+	std::atomic<int> viewers;	// Subscribed viewers, the variant is not encoded while 0
+	FrameRing ring;				// Encoded frames
+} JpegVariant;
 
 typedef struct
 {
+	int id;                     // Camera number, streams on base port + id
 	int dev;                    // Camera device
+	const char *source;         // Capture source: camera index, device path or video file
 	int imgSize;                // Total size of image in bytes
-	float frame_rate;           // Frame rate to capture images
-	float time_sleep;           // Time to sleep in micro Seconds between each frame capture
+	float frame_rate;           // Native frame rate of the camera, viewers subscribe to lower rates
 	int face_detected;          // Face detected flag
 	bool face_detect_enable;    // boolean value to toggle face detection
 	bool pauseVideo;            // boolean to pause video feed
 	int record_time;			// Amount of time to record video after a face is detected
 	bool manual_record;
-	char *write_dir;
-	int dir_name_size;
-	Mat img;
-	Mat imgGray;
-	VideoCapture *cap;
-	CascadeClassifier cascade;
-	CascadeClassifier nestedCascade;
+	std::atomic<bool> record_video;	// Frames are being written to the recording
+	std::atomic<int64_t> record_deadline_ns;	// Face triggered recording stops at this CLOCK_MONOTONIC time, 0 once stopped
+	RecordPolicy record_policy;	// Recording directory, segment limits and retention budget
+	double pre_event_seconds;	// Recordings start this long before their trigger, 0 = off (-P)
+	size_t pre_event_max_bytes;	// Memory cap of the pre-event buffer (-L)
+	std::atomic<uint64_t> pre_event_frames;	// Frames held, and written ahead of recordings since the last report
+	std::atomic<uint64_t> pre_event_bytes;
+	std::atomic<uint64_t> pre_event_flushed;
+	std::atomic<uint64_t> pre_event_evicted;
+	std::atomic<uint64_t> record_frames;	// Recorder statistics since the last report
+	std::atomic<uint64_t> record_repeats;
+	std::atomic<uint64_t> record_total_us;
+	std::atomic<uint64_t> record_files;		// Recorder totals
+	std::atomic<uint64_t> record_syncs;
+	std::atomic<uint64_t> record_deleted;
+	Mat img;					// Capture scratch buffer (BGR frame from the camera)
+	FrameRing raw;				// Captured greyscale frames, read by the detect and annotate stages
+	FrameRing ring;				// Annotated frames, read by the viewer event loops and the record thread
+	JpegVariant jpeg[JPEG_VARIANTS];	// Annotated frames encoded once per variant, shared by its JPEG viewers
+	pthread_mutex_t jpeg_lock;	// Serializes viewers claiming a free variant, protects tier and quality
+	int jpeg_quality;			// JPEG quality of variant 0 and of viewers not asking for one (-q)
+	std::atomic<uint64_t> encode_frames;	// Encoder statistics since the last report
+	std::atomic<uint64_t> encode_total_us;
+	std::atomic<uint64_t> encode_bytes;
+	bool shm_enable;			// Publish annotated frames in shared memory for local readers
+	ShmRing shm;
+	std::atomic<uint64_t> shm_frames;	// Shared memory statistics since the last report
+	std::atomic<uint64_t> shm_total_us;
+	bool mcast_enable;			// Send annotated frames to a multicast group (-U)
+	struct in_addr mcast_group;
+	int mcast_port;				// Base port of -U + camera number
+	struct in_addr mcast_iface;	// Interface address, INADDR_ANY for the route of the group
+	int mcast_format;			// FRAME_ENC_JPEG or FRAME_ENC_DELTA (-u)
+	McastSender mcast;
+	std::atomic<uint64_t> mcast_frames;	// Multicast statistics since the last report
+	std::atomic<uint64_t> mcast_keyframes;
+	std::atomic<uint64_t> mcast_datagrams;
+	std::atomic<uint64_t> mcast_bytes;
+	std::atomic<uint64_t> mcast_errors;
+	SpscQueue annotate_q;		// capture -> annotate stage (pinned raw slots)
+	SpscQueue detect_q;			// capture -> detect stage (pinned raw slots)
+	SpscQueue encode_q;			// annotate -> encode stage (pinned annotated slots)
+	SpscQueue record_q;			// encode stage -> record thread (pinned JPEG slots of variant 0)
+	SpscQueue io_q;				// record thread -> record I/O thread (frames to write)
+	SpscQueue io_free;			// record I/O thread -> record thread (frames written)
+	RecordFrame io_frames[RECORD_IO_FRAMES];
+	PreEventRing pre_event_rings[2];	// Pre-event buffer (-P): one fills, the other is being written
+	SpscQueue pre_event_free;	// record I/O thread -> record thread (pre-event ring written)
+	pthread_mutex_t faces_lock;	// Protects faces and faces_seq
+	std::vector<Rect> faces;	// Latest detection results, full frame coordinates
+	uint64_t faces_seq;			// Raw frame sequence number the faces were found on
+	Size detect_size;			// Resolution the face cascade runs at
+	FaceTracker tracker;		// Follows faces between cascade runs (detect thread only)
+	bool motion_gate;			// Only run the cascade where motion was detected
+	MotionDetector motion;		// Background model for motion gating (detect thread only)
+	FaceVerifier verifier;		// Eye check and K-frame confirmation of faces (detect thread only)
+	std::atomic<uint64_t> detect_frames;	// Detection statistics since the last report
+	std::atomic<uint64_t> detect_total_us;
+	std::atomic<uint64_t> detect_max_us;
+	FaceModels *models;			// Shared face models
+	FaceDetector *detector;		// This camera's clone of models->detector (detect thread only)
+	pthread_t capture_tid;		// Pipeline threads
+	pthread_t detect_tid;
+	pthread_t annotate_tid;
+	pthread_t record_tid;
+	pthread_t record_io_tid;
+	pthread_t encode_tid;
+	pthread_t shm_tid;
+	pthread_t mcast_tid;
+	uint64_t stats_frames;		// Counters at the previous stats report
+	uint64_t stats_overruns;
+	struct timespec stats_last;
+	CaptureSched sched;			// Capture deadlines derived from frame_rate
+	VideoCapture *cap;			// OpenCV capture backend (NULL when using V4L2)
+	V4l2Capture v4l2;			// Native V4L2 capture backend
+	bool use_v4l2;				// Frames come from v4l2 instead of cap
 } ImgCaptureStruct;
 
 
-struct VideoStreamStruct
+// epoll user data tags of a StreamReactor
+enum { REACTOR_LISTEN, REACTOR_HTTP, REACTOR_FRAMES, REACTOR_CLIENT, REACTOR_CLOSED };
+// Protocol spoken on a viewer connection
+enum { CLIENT_FRAMED, CLIENT_HTTP };
+
+// Listening socket or frame eventfd of one camera in a reactor's epoll set
+typedef struct
+{
+	int kind;					// REACTOR_LISTEN, REACTOR_HTTP or REACTOR_FRAMES
+	int fd;
+	ImgCaptureStruct *imgStruct;	// NULL for the HTTP port, it serves every camera
+	int format;					// REACTOR_FRAMES: FRAME_ENC_RAW (annotated ring) or FRAME_ENC_JPEG
+	int variant;				// FRAME_ENC_JPEG: JPEG variant of the ring
+} ReactorSource;
+
+// Ring slot pinned until the kernel reports MSG_ZEROCOPY send id done
+typedef struct
 {
-int remoteSocket;
-    pthread_t thread_id;
-	bool thread_complete;
-	ImgCaptureStruct *imgStruct;
-	SLIST_ENTRY(VideoStreamStruct) entries;
+	uint32_t id;
+	FrameRing *ring;			// Ring of the slot, the viewer may switch formats meanwhile
+	FrameSlot *slot;
+	uint32_t len;				// Bytes of the send, counted as copied if the kernel copied them after all
+} ZeroCopyPin;
+
+// One viewer connection
+struct StreamClient
+{
+	int kind;					// REACTOR_CLIENT, REACTOR_CLOSED once closed
+	int fd;
+	int protocol;				// CLIENT_FRAMED (camera port) or CLIENT_HTTP
+	ImgCaptureStruct *imgStruct;	// Camera the viewer watches, NULL until an HTTP request names it
+	int format;					// FRAME_ENC_RAW or FRAME_ENC_JPEG, chosen with control codes 400 / 401
+	int variant;				// FRAME_ENC_JPEG: JPEG variant the viewer is subscribed to
+	int fps;					// Subscribed frame rate, 0 for every frame
+	int tier;					// Subscribed resolution tier, 0 for full size
+	int quality;				// Subscribed JPEG quality, 0 for the camera's default (-q)
+	bool adaptive;				// Step rate, quality and size down while the socket backs up
+	int adapt_level;			// Adaptive steps currently applied, 0 to ADAPT_MAX_LEVEL
+	int clean_frames;			// Frames written without backing up since the last step
+	bool backed_up;				// A frame due for the viewer arrived while it was still sending
+	uint64_t next_due_ns;		// Capture time the next frame is due at, with fps set
+	Mat scaled;					// Raw frame scaled down to the viewer's tier
+	bool sending;				// A frame is partly written
+	bool want_out;				// EPOLLOUT is armed
+	uint64_t last_sent;			// Sequence number of the frame sent last
+	FrameSlot *slot;			// Ring slot the outstanding frame is written from, NULL once backlogged
+	FrameHeader hdr;			// Outstanding frame: header, faces and pixels still to write
+	FaceRecord faces[FRAME_MAX_FACES];
+	struct iovec iov[3];
+	int iov_first;
+	int iovcnt;
+	int payload_iov;			// iov index of the frame payload, -1 for text responses
+	bool zerocopy;				// SO_ZEROCOPY enabled: payloads are sent with MSG_ZEROCOPY
+	uint32_t zc_next;			// Id the kernel gives the next MSG_ZEROCOPY send
+	std::deque<ZeroCopyPin> zc_pending;	// Slots still referenced by unfinished zero-copy sends
+	bool delta;					// Block-delta mode (CMD_FORMAT_DELTA), format is FRAME_ENC_RAW
+	int since_key;				// Delta frames sent since the last keyframe
+	Mat reference;				// Image the viewer holds: last keyframe patched with every delta
+	std::vector<uint16_t> delta_blocks;	// Blocks that changed in the outstanding delta frame
+	std::vector<uchar> delta_buf;	// Payload of the outstanding delta frame
+	std::vector<uchar> backlog;	// Unsent rest of the outstanding frame once the socket filled up
+	bool one_shot;				// Close once the outstanding response is written (snapshot, control)
+	int http_route;				// CLIENT_HTTP: HTTP_STREAM or HTTP_SNAPSHOT once the request is parsed
+	bool http_started;			// CLIENT_HTTP: response header of the stream sent
+	std::string request;		// CLIENT_HTTP: request received so far, CLIENT_FRAMED: unfinished command line
+	uint64_t http_deadline_ns;	// CLIENT_HTTP: answered with 503 unless responding by then, 0 once it is
+	char http_hdr[512];			// CLIENT_HTTP: headers in front of the outstanding frame
+	SLIST_ENTRY(StreamClient) entries;
 };
 
-typedef VideoStreamStruct VideoStream;
+typedef struct
+{
+	int id;
+	int epfd;
+	pthread_t tid;
+	int num_cameras;
+	bool zerocopy;				// Send payloads with MSG_ZEROCOPY (-z)
+	ImgCaptureStruct *cameras[MAX_CAMERAS];
+	ReactorSource listen[MAX_CAMERAS];	// Listening socket of every camera
+	ReactorSource http;			// HTTP port, fd -1 when disabled
+	ReactorSource frames[MAX_CAMERAS];	// New raw frame eventfd of every camera
+	ReactorSource jpeg_frames[MAX_CAMERAS][JPEG_VARIANTS];	// New JPEG frame eventfd of every variant
+	SLIST_HEAD(StreamClientList, StreamClient) clients;
+	StreamClientList closing;	// Closed during the current epoll batch, freed after it
+	std::atomic<int> num_clients;
+	std::atomic<uint64_t> accepted;		// Statistics
+	std::atomic<uint64_t> closed;
+	std::atomic<uint64_t> frames_sent;
+	std::atomic<uint64_t> frames_skipped;	// New frames published while a viewer was still writing
+	std::atomic<uint64_t> backlogged;		// Frames whose rest went to a backlog buffer
+	std::atomic<uint64_t> bytes_sent;
+	std::atomic<uint64_t> bytes_copied;		// Bytes copied on the way out: by sendmsg into the kernel, into backlogs
+	std::atomic<uint64_t> zc_sends;			// MSG_ZEROCOPY sends
+	std::atomic<uint64_t> zc_fallbacks;		// Of those, sends the kernel copied anyway (e.g. loopback)
+	std::atomic<uint64_t> sys_us;			// Kernel and user CPU time of the reactor thread
+	std::atomic<uint64_t> user_us;
+	std::atomic<uint64_t> http_requests;
+	std::atomic<uint64_t> http_timeouts;	// HTTP clients answered 503 for taking too long
+	std::atomic<uint64_t> frames_decimated;	// Frames not due yet for viewers with a lower frame rate
+	std::atomic<uint64_t> adapt_down;		// Adaptive steps down and back up
+	std::atomic<uint64_t> adapt_up;
+	std::atomic<uint64_t> delta_frames;		// Frames sent in delta mode, keyframes included
+	std::atomic<uint64_t> delta_keyframes;
+	std::atomic<uint64_t> delta_blocks;		// Blocks sent, keyframes count every block
+	std::atomic<uint64_t> delta_blocks_total;
+	std::atomic<uint64_t> delta_bytes;		// Payload bytes of delta mode frames
+	std::atomic<uint64_t> delta_us;			// Time spent encoding them
+} StreamReactor;
 
-void *display(void *);
+void *reactor_thread(void *);
+int handle_command(ImgCaptureStruct *, int);
+bool jpeg_watched(ImgCaptureStruct *);
+bool record_watched(ImgCaptureStruct *);
+int jpeg_variant_acquire(ImgCaptureStruct *, int, int);
+void jpeg_variant_release(ImgCaptureStruct *, int);
+void report_reactors(StreamReactor *, int);
 void *capture_video(void *);
+void *detect_video(void *);
+void *annotate_video(void *);
 void *record_video(void *);
+void *record_io_video(void *);
+void *encode_video(void *);
+void *share_video(void *);
+void *mcast_video(void *);
 void setup_img(ImgCaptureStruct *);
 int get_local_time(char*, int);
+void report_stats(ImgCaptureStruct *);
+int open_capture(ImgCaptureStruct *, int);
+int capture_grab(ImgCaptureStruct *, Mat &, struct timespec *);
+int open_listen_socket(int);
+void pin_thread(pthread_t, int);
+void start_pipeline(ImgCaptureStruct *);
+void stop_pipeline(ImgCaptureStruct *);
 
 
 //
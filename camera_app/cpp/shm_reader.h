@@ -0,0 +1,150 @@
+/**************************************************************************************************
+* @file        shm_reader.h
+* @version     0.1.1
+* @type:       Reader of the shared memory frame ring (shm_ring.h)
+* @brief       For local consumers in their own process. Frames are used in place, no copy:
+*                 ShmReader reader;
+*                 ShmFrame frame;
+*                 uint64_t last = 0;
+*                 shm_reader_open(&reader, 0);
+*                 while (shm_reader_next(&reader, last, 1000, &frame) > 0)
+*                 {
+*                     ... use frame.payload (frame.payload_len bytes) ...
+*                     if (!shm_frame_valid(&frame))
+*                         ... the server reused the slot meanwhile: discard the result ...
+*                     last = frame.seq;
+*                 }
+*              Needs no OpenCV, only frame_proto.h, futex.h and shm_ring.h.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef SHM_READER_H
+#define SHM_READER_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shm_ring.h"
+
+typedef struct
+{
+	int fd;
+	size_t size;
+	uint8_t *base;
+	const ShmRingHeader *hdr;
+} ShmReader;
+
+// One frame in the ring, valid while shm_frame_valid() says so
+typedef struct
+{
+	const ShmSlotHeader *slot;
+	uint32_t lock;					// Seqlock value the frame was read under
+	uint64_t seq;
+	uint64_t timestamp_ns;
+	int width;
+	int height;
+	int pixfmt;
+	int encoding;
+	int num_faces;
+	FaceRecord faces[FRAME_MAX_FACES];
+	const uint8_t *payload;			// Points into the shared mapping
+	uint32_t payload_len;
+} ShmFrame;
+
+
+// Map the ring of camera cam read-only
+// Returns 0 on success, -1 if the server is not running or the ring has another version
+int shm_reader_open(ShmReader *reader, int cam)
+{
+	char name[64];
+	struct stat st;
+
+	snprintf(name, sizeof(name), SHM_RING_NAME, cam);
+	reader->fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (reader->fd < 0)
+		return -1;
+	if (fstat(reader->fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmRingHeader))
+	{
+		close(reader->fd);
+		return -1;
+	}
+	reader->size = st.st_size;
+	reader->base = (uint8_t*)mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+	if (reader->base == MAP_FAILED)
+	{
+		close(reader->fd);
+		return -1;
+	}
+	reader->hdr = (const ShmRingHeader*)reader->base;
+	if (reader->hdr->magic != SHM_RING_MAGIC || reader->hdr->version != SHM_RING_VERSION)
+	{
+		munmap(reader->base, reader->size);
+		close(reader->fd);
+		return -1;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return 0;
+}
+
+void shm_reader_close(ShmReader *reader)
+{
+	munmap(reader->base, reader->size);
+	close(reader->fd);
+}
+
+// True if the slot was not rewritten since shm_reader_next() returned the frame, i.e. everything
+// read from it so far is the frame. Check after using the payload
+static inline bool shm_frame_valid(const ShmFrame *frame)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return frame->slot->lock.load(std::memory_order_relaxed) == frame->lock;
+}
+
+// Wait up to timeout_ms for a frame newer than last_seq and describe it in frame
+// Returns 1 with frame filled in, 0 on timeout
+int shm_reader_next(ShmReader *reader, uint64_t last_seq, int timeout_ms, ShmFrame *frame)
+{
+	const ShmRingHeader *hdr = reader->hdr;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (true)
+	{
+		uint64_t seq = hdr->seq.load(std::memory_order_acquire);
+		if (seq == last_seq)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int left = timeout_ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+			if (left <= 0)
+				return 0;
+			futex_wait_shared(&hdr->notify, (uint32_t)last_seq, left);
+			continue;
+		}
+
+		const ShmSlotHeader *slot = shm_ring_slot(reader->base, hdr, hdr->latest.load(std::memory_order_acquire));
+		uint32_t lock = slot->lock.load(std::memory_order_acquire);
+		if (lock & 1)
+			continue;					// Being rewritten, the next latest is about to appear
+		frame->slot = slot;
+		frame->lock = lock;
+		frame->seq = slot->seq;
+		frame->timestamp_ns = slot->timestamp_ns;
+		frame->width = slot->width;
+		frame->height = slot->height;
+		frame->pixfmt = slot->pixfmt;
+		frame->encoding = slot->encoding;
+		frame->num_faces = slot->num_faces < FRAME_MAX_FACES ? slot->num_faces : FRAME_MAX_FACES;
+		memcpy(frame->faces, slot->faces, frame->num_faces * sizeof(FaceRecord));
+		frame->payload_len = slot->payload_len < hdr->payload_capacity ? slot->payload_len : hdr->payload_capacity;
+		frame->payload = (const uint8_t*)slot + hdr->payload_offset;
+		if (shm_frame_valid(frame) && frame->seq != last_seq)
+			return 1;
+	}
+}
+
+#endif // SHM_READER_H
@@ -0,0 +1,204 @@
+/**************************************************************************************************
+* @file        shm_ring.h
+* @version     0.1.1
+* @type:       POSIX shared memory frame ring for consumers on the same host
+* @brief       The server publishes every annotated frame of camera N into the shared memory
+*              object SHM_RING_NAME (/dev/shm/opencv_monitor_camN). Local readers map it read-only
+*              and use the pixels in place (shm_reader.h, camera_app/python/shm_reader.py):
+*                 - SHM_RING_SLOTS slots; the writer never overwrites the latest frame
+*                 - every slot is guarded by a seqlock: odd while the writer fills it, so a reader
+*                   that sees the same even value before and after using a frame knows it was intact
+*                 - readers sleep on a process shared futex keyed on the low 32 bits of seq,
+*                   the writer wakes them once per frame
+*              Layout (host byte order, offsets fixed for the Python reader):
+*                 ShmRingHeader at 0 | slot i at slot_offset + i * slot_stride:
+*                 ShmSlotHeader | payload at payload_offset from the slot, page aligned
+*              The object is removed when the server exits; readers reopen it when it restarts.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [shm_overview(7)](https://man7.org/linux/man-pages/man7/shm_overview.7.html)
+*					- [Seqlock](https://en.wikipedia.org/wiki/Seqlock)
+*
+**************************************************************************************************/
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "frame_proto.h"
+#include "futex.h"
+
+#define SHM_RING_MAGIC		0x474e5253	// "SRNG"
+#define SHM_RING_VERSION	1
+#define SHM_RING_SLOTS		4			// Readers have SHM_RING_SLOTS - 1 frame periods to use a frame
+#define SHM_RING_NAME		"/opencv_monitor_cam%d"
+#define SHM_RING_PAGE		4096
+
+typedef struct
+{
+	uint32_t magic;						// SHM_RING_MAGIC, written last once the ring is ready
+	uint16_t version;					// SHM_RING_VERSION
+	uint16_t num_slots;
+	uint32_t slot_offset;				// First slot from the start of the object
+	uint32_t slot_stride;				// Bytes from one slot to the next
+	uint32_t payload_offset;			// Payload from the start of its slot
+	uint32_t payload_capacity;			// Largest payload a slot holds
+	std::atomic<uint32_t> notify;		// Futex word: low 32 bits of seq
+	std::atomic<uint32_t> latest;		// Slot of the most recently published frame
+	std::atomic<uint64_t> seq;			// Sequence number of that frame, 0 before the first
+	uint32_t writer_pid;
+	uint32_t reserved;
+} ShmRingHeader;
+
+typedef struct
+{
+	std::atomic<uint32_t> lock;			// Seqlock: odd while the writer fills the slot
+	uint32_t reserved;
+	uint64_t seq;						// Frame sequence number of the server, gaps are dropped frames
+	uint64_t timestamp_ns;				// CLOCK_MONOTONIC capture time
+	uint16_t width;
+	uint16_t height;
+	uint8_t pixfmt;						// FRAME_PIX_*
+	uint8_t encoding;					// FRAME_ENC_*
+	uint16_t num_faces;
+	uint32_t payload_len;
+	uint32_t reserved2;
+	FaceRecord faces[FRAME_MAX_FACES];
+} ShmSlotHeader;
+
+// The Python reader unpacks these with fixed offsets
+static_assert(sizeof(ShmRingHeader) == 48 && offsetof(ShmRingHeader, seq) == 32, "ShmRingHeader layout");
+static_assert(sizeof(ShmSlotHeader) == 40 + FRAME_MAX_FACES * sizeof(FaceRecord), "ShmSlotHeader layout");
+
+// Writer side, owned by the server
+typedef struct
+{
+	int fd;
+	size_t size;
+	uint8_t *base;
+	ShmRingHeader *hdr;
+	int next;							// Slot tried first by the next publish
+	char name[64];
+} ShmRing;
+
+
+static inline ShmSlotHeader *shm_ring_slot(uint8_t *base, const ShmRingHeader *hdr, int idx)
+{
+	return (ShmSlotHeader*)(base + hdr->slot_offset + (size_t)idx * hdr->slot_stride);
+}
+
+// Create (or replace) the shared memory object name with room for payloads of capacity bytes
+// Returns 0 on success, -1 on failure
+int shm_ring_create(ShmRing *ring, const char *name, size_t capacity)
+{
+	size_t stride = SHM_RING_PAGE + (capacity + SHM_RING_PAGE - 1) / SHM_RING_PAGE * SHM_RING_PAGE;
+
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	ring->size = SHM_RING_PAGE + SHM_RING_SLOTS * stride;
+	ring->next = 0;
+	// A stale object of a previous run may have another size, readers of it see it unlinked
+	shm_unlink(name);
+	ring->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+	if (ring->fd < 0)
+	{
+		syslog(LOG_DEBUG, "shm_open(%s) failed", name);
+		return -1;
+	}
+	if (ftruncate(ring->fd, ring->size) < 0)
+	{
+		syslog(LOG_DEBUG, "ftruncate(%s) failed", name);
+		close(ring->fd);
+		shm_unlink(name);
+		return -1;
+	}
+	ring->base = (uint8_t*)mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->base == MAP_FAILED)
+	{
+		syslog(LOG_DEBUG, "mmap(%s) failed", name);
+		close(ring->fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	// ftruncate zero fills: every seqlock starts even and seq at 0
+	ring->hdr = (ShmRingHeader*)ring->base;
+	ring->hdr->version = SHM_RING_VERSION;
+	ring->hdr->num_slots = SHM_RING_SLOTS;
+	ring->hdr->slot_offset = SHM_RING_PAGE;
+	ring->hdr->slot_stride = stride;
+	ring->hdr->payload_offset = SHM_RING_PAGE;
+	ring->hdr->payload_capacity = capacity;
+	ring->hdr->writer_pid = getpid();
+	std::atomic_thread_fence(std::memory_order_release);
+	ring->hdr->magic = SHM_RING_MAGIC;
+	return 0;
+}
+
+// Unmap and remove the object, readers still mapping it keep their (now frozen) copy
+void shm_ring_destroy(ShmRing *ring)
+{
+	munmap(ring->base, ring->size);
+	close(ring->fd);
+	shm_unlink(ring->name);
+}
+
+// Copy a frame into the next slot and wake the readers
+// Returns -1 if the payload does not fit
+int shm_ring_publish(ShmRing *ring, uint64_t seq, const struct timespec *ts, int width, int height,
+					 int pixfmt, int encoding, const int (*rects)[4], int num_faces,
+					 const void *payload, size_t payload_len)
+{
+	ShmRingHeader *hdr = ring->hdr;
+	if (payload_len > hdr->payload_capacity)
+		return -1;
+	int idx = ring->next;
+	if (idx == (int)hdr->latest.load(std::memory_order_relaxed))
+		idx = (idx + 1) % SHM_RING_SLOTS;
+	ring->next = (idx + 1) % SHM_RING_SLOTS;
+	if (num_faces > FRAME_MAX_FACES)
+		num_faces = FRAME_MAX_FACES;
+
+	ShmSlotHeader *slot = shm_ring_slot(ring->base, hdr, idx);
+	uint32_t lock = slot->lock.load(std::memory_order_relaxed);
+	slot->lock.store(lock + 1, std::memory_order_relaxed);
+	// Readers that see the new data also see the odd lock
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->seq = seq;
+	slot->timestamp_ns = (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+	slot->width = width;
+	slot->height = height;
+	slot->pixfmt = pixfmt;
+	slot->encoding = encoding;
+	slot->num_faces = num_faces;
+	slot->payload_len = payload_len;
+	for (int i = 0; i < num_faces; i++)
+	{
+		slot->faces[i].x = rects[i][0];
+		slot->faces[i].y = rects[i][1];
+		slot->faces[i].width = rects[i][2];
+		slot->faces[i].height = rects[i][3];
+	}
+	memcpy((uint8_t*)slot + hdr->payload_offset, payload, payload_len);
+	slot->lock.store(lock + 2, std::memory_order_release);
+
+	hdr->latest.store(idx, std::memory_order_release);
+	hdr->seq.store(seq, std::memory_order_release);
+	hdr->notify.store((uint32_t)seq, std::memory_order_release);
+	// Readers map the ring read-only and cannot announce themselves, wake unconditionally
+	futex_wake_all_shared(&hdr->notify);
+	return 0;
+}
+
+#endif // SHM_RING_H
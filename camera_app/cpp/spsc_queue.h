@@ -0,0 +1,138 @@
+/**************************************************************************************************
+* @file        spsc_queue.h
+* @version     0.1.1
+* @type:       Bounded single-producer / single-consumer queue between pipeline stages
+* @brief       Lock-free ring of item pointers connecting two pipeline stage threads.
+*                 - The producer never blocks
+*                 - QUEUE_DROP_NEWEST: the consumer takes items in order, when the queue is full
+*                   the new item is refused and counted as dropped, the producer releases it
+*                 - QUEUE_DROP_OLDEST: a latest-only mailbox of one item, a push replaces the
+*                   item still waiting and hands it to a discard callback, counted as dropped,
+*                   so the consumer always gets the newest item
+*                 - Consumers sleep on a futex bumped by every push
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+**************************************************************************************************/
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <stdint.h>
+#include "futex.h"
+
+#define SPSC_QUEUE_MAX	32			// Upper bound on the capacity of a queue
+
+// Queue drop policies
+enum { QUEUE_DROP_NEWEST, QUEUE_DROP_OLDEST };
+
+typedef struct
+{
+	const char *name;				// Stage name used in statistics
+	void *items[SPSC_QUEUE_MAX];
+	unsigned capacity;
+	int policy;						// QUEUE_DROP_NEWEST or QUEUE_DROP_OLDEST
+	std::atomic<unsigned> head;		// Next item to pop (written by the consumer)
+	std::atomic<unsigned> tail;		// Next free entry (written by the producer)
+	std::atomic<void*> latest;		// QUEUE_DROP_OLDEST: the waiting item, NULL if none
+	std::atomic<uint32_t> notify;	// Futex word, incremented by every push
+	std::atomic<int> waiters;		// Consumer is blocked in spsc_pop_wait()
+	std::atomic<uint64_t> pushed;	// Items accepted
+	std::atomic<uint64_t> dropped;	// Items refused when full or skipped as stale
+} SpscQueue;
+
+
+void spsc_init(SpscQueue *q, const char *name, unsigned capacity, int policy)
+{
+	q->name = name;
+	q->capacity = capacity > SPSC_QUEUE_MAX ? SPSC_QUEUE_MAX : (capacity < 1 ? 1 : capacity);
+	q->policy = policy;
+	if (policy == QUEUE_DROP_OLDEST)
+		q->capacity = 1;
+	q->head.store(0);
+	q->tail.store(0);
+	q->latest.store(NULL);
+	q->notify.store(0);
+	q->waiters.store(0);
+	q->pushed.store(0);
+	q->dropped.store(0);
+}
+
+// Number of items currently queued
+unsigned spsc_depth(SpscQueue *q)
+{
+	if (q->policy == QUEUE_DROP_OLDEST)
+		return q->latest.load(std::memory_order_acquire) != NULL;
+	return q->tail.load(std::memory_order_acquire) - q->head.load(std::memory_order_acquire);
+}
+
+// Queue an item (producer only)
+// QUEUE_DROP_NEWEST: returns false, and counts a drop, when the queue is full. The caller still
+// owns the item
+// QUEUE_DROP_OLDEST: always succeeds, an item still waiting is passed to discard()
+bool spsc_push(SpscQueue *q, void *item, void (*discard)(void *) = NULL)
+{
+	if (q->policy == QUEUE_DROP_OLDEST)
+	{
+		// The consumer takes the mailbox with an exchange too, so exactly one side owns an item
+		void *stale = q->latest.exchange(item, std::memory_order_acq_rel);
+		if (stale != NULL)
+		{
+			if (discard != NULL)
+				discard(stale);
+			q->dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		unsigned tail = q->tail.load(std::memory_order_relaxed);
+		if (tail - q->head.load(std::memory_order_acquire) >= q->capacity)
+		{
+			q->dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		q->items[tail % SPSC_QUEUE_MAX] = item;
+		q->tail.store(tail + 1, std::memory_order_release);
+	}
+	q->pushed.fetch_add(1, std::memory_order_relaxed);
+
+	q->notify.fetch_add(1, std::memory_order_seq_cst);
+	if (q->waiters.load(std::memory_order_seq_cst) > 0)
+		futex_wake_all(&q->notify);
+	return true;
+}
+
+// Take the next item (consumer only), NULL if the queue is empty
+void *spsc_pop(SpscQueue *q)
+{
+	if (q->policy == QUEUE_DROP_OLDEST)
+		return q->latest.exchange(NULL, std::memory_order_acq_rel);
+
+	unsigned head = q->head.load(std::memory_order_relaxed);
+	unsigned tail = q->tail.load(std::memory_order_acquire);
+	if (head == tail)
+		return NULL;
+	void *item = q->items[head % SPSC_QUEUE_MAX];
+	q->head.store(head + 1, std::memory_order_release);
+	return item;
+}
+
+// Like spsc_pop() but sleeps up to timeout_ms for an item to arrive
+void *spsc_pop_wait(SpscQueue *q, int timeout_ms)
+{
+	void *item = spsc_pop(q);
+	if (item != NULL)
+		return item;
+
+	q->waiters.fetch_add(1, std::memory_order_seq_cst);
+	uint32_t val = q->notify.load(std::memory_order_seq_cst);
+	if (spsc_depth(q) == 0)
+		futex_wait(&q->notify, val, timeout_ms);
+	q->waiters.fetch_sub(1, std::memory_order_relaxed);
+
+	return spsc_pop(q);
+}
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,1011 @@
+/**************************************************************************************************
+* @file        stream_reactor.h
+* @version     0.1.1
+* @type:       epoll event loop serving every viewer of every camera
+* @brief       Replaces the thread per client. Each reactor thread owns an epoll set holding:
+*                 - the listening socket of every camera (EPOLLEXCLUSIVE, so one connection wakes
+*                   one reactor when several are running)
+*                 - eventfds of every camera, signalled by the annotated (raw) frame ring and by
+*                   the ring of every JPEG variant of the encode stage
+*                 - the HTTP port (-H), serving MJPEG, snapshots and control codes (http_stream.h)
+*                 - its clients' sockets: control input and non-blocking frame writes
+*              Each client has at most one frame outstanding. Frames published while it is still
+*              being written are skipped and the client gets the newest frame once it drains
+*              (latest frame wins). A viewer picks raw or JPEG frames with control codes 400 / 401
+*              (raw by default); JPEG viewers all share the one encoded buffer per frame. Code 402
+*              selects block-delta frames (block_delta.h), encoded per viewer against the image
+*              it last received.
+*              Frame rate, size and quality are subscriptions of each viewer, capture runs at the
+*              camera's native rate whatever the viewers ask for:
+*                 fps=N      frames not due yet are skipped (decimated), by capture timestamp
+*                 tier=N     1/2^N size: JPEG viewers share an encoded variant per tier and quality,
+*                            raw and delta viewers get their frames scaled down for them
+*                 quality=N  JPEG quality of the variant
+*                 adaptive=1 a frame still being written when the next one is due halves the
+*                            rate and lowers the quality (every second step the size too),
+*                            ADAPT_CLEAN_FRAMES frames done in time step back up
+*              Framed viewers send these as "name=value" lines, HTTP viewers as query parameters.
+*              The frame is written straight from the pinned ring slot; if the socket fills up,
+*              the unsent rest is copied to the client's backlog buffer and the pin
+*              is dropped, so a slow viewer holds at most one frame of memory and never a ring slot.
+*              TCP_NOTSENT_LOWAT keeps the kernel from queueing more than STREAM_NOTSENT_LOWAT
+*              unsent bytes, which bounds the latency a viewer can build up.
+*              With -z the payload is sent with MSG_ZEROCOPY: the kernel reads the slot pages
+*              directly and the slot stays pinned until the completion arrives on the socket's
+*              error queue. The unfinished zero-copy sends of all viewers together pin at most
+*              FRAME_RING_ZEROCOPY_SLOTS slots of a ring, past that payloads are copied until
+*              completions come back, so slow viewers cannot starve the ring.
+*              Copied bytes and the reactor's kernel CPU time are in the stats.
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [epoll(7)](https://man7.org/linux/man-pages/man7/epoll.7.html)
+*					- [TCP_NOTSENT_LOWAT](https://lwn.net/Articles/560082/)
+*					- [MSG_ZEROCOPY](https://www.kernel.org/doc/html/latest/networking/msg_zerocopy.html)
+*
+**************************************************************************************************/
+
+#ifndef STREAM_REACTOR_H
+#define STREAM_REACTOR_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include "block_delta.h"
+#include "http_stream.h"
+
+#define REACTOR_MAX_EVENTS	64
+
+static void client_close(StreamReactor *r, StreamClient *c);
+static int client_kick(StreamReactor *r, StreamClient *c);
+
+
+// Ring a frame eventfd is subscribed to: the annotated ring or a JPEG variant
+static inline FrameRing *source_ring(ReactorSource *src)
+{
+	return src->format == FRAME_ENC_JPEG ? &src->imgStruct->jpeg[src->variant].ring : &src->imgStruct->ring;
+}
+
+// Ring a viewer reads from
+static inline FrameRing *client_ring(StreamClient *c)
+{
+	return c->format == FRAME_ENC_JPEG ? &c->imgStruct->jpeg[c->variant].ring : &c->imgStruct->ring;
+}
+
+// Subscribe an eventfd to a camera's raw ring or one of its JPEG variants and add it to the epoll set
+static int reactor_add_frames(StreamReactor *r, ReactorSource *src, ImgCaptureStruct *imgStruct, int format,
+							  int variant)
+{
+	struct epoll_event ev;
+
+	src->kind = REACTOR_FRAMES;
+	src->imgStruct = imgStruct;
+	src->format = format;
+	src->variant = variant;
+	src->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (src->fd < 0 || frame_ring_subscribe(source_ring(src), src->fd) < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	return epoll_ctl(r->epfd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+// Create the epoll set of one reactor: every camera's listening socket and frame eventfds, and
+// the HTTP port unless http_fd is -1
+// Returns 0 on success, -1 on failure
+int reactor_init(StreamReactor *r, int id, ImgCaptureStruct **cameras, int *listen_fds, int num_cameras,
+				 int http_fd, bool zerocopy)
+{
+	struct epoll_event ev;
+
+	r->id = id;
+	r->num_cameras = num_cameras;
+	r->zerocopy = zerocopy;
+	SLIST_INIT(&r->clients);
+	SLIST_INIT(&r->closing);
+	r->num_clients.store(0);
+	r->accepted.store(0);
+	r->closed.store(0);
+	r->frames_sent.store(0);
+	r->frames_skipped.store(0);
+	r->backlogged.store(0);
+	r->bytes_sent.store(0);
+	r->bytes_copied.store(0);
+	r->zc_sends.store(0);
+	r->zc_fallbacks.store(0);
+	r->sys_us.store(0);
+	r->user_us.store(0);
+	r->http_requests.store(0);
+	r->http_timeouts.store(0);
+	r->frames_decimated.store(0);
+	r->adapt_down.store(0);
+	r->adapt_up.store(0);
+	r->delta_frames.store(0);
+	r->delta_keyframes.store(0);
+	r->delta_blocks.store(0);
+	r->delta_blocks_total.store(0);
+	r->delta_bytes.store(0);
+	r->delta_us.store(0);
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0)
+	{
+		syslog(LOG_DEBUG, "Reactor %d: epoll_create1 failed", id);
+		return -1;
+	}
+	r->http.kind = REACTOR_HTTP;
+	r->http.fd = http_fd;
+	r->http.imgStruct = NULL;
+	if (http_fd >= 0)
+	{
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = &r->http;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, http_fd, &ev) < 0)
+		{
+			syslog(LOG_DEBUG, "Reactor %d: cannot watch the HTTP port", id);
+			return -1;
+		}
+	}
+	for (int cam = 0; cam < num_cameras; cam++)
+	{
+		r->cameras[cam] = cameras[cam];
+		r->listen[cam].kind = REACTOR_LISTEN;
+		r->listen[cam].fd = listen_fds[cam];
+		r->listen[cam].imgStruct = cameras[cam];
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = &r->listen[cam];
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listen_fds[cam], &ev) < 0)
+		{
+			syslog(LOG_DEBUG, "Reactor %d: cannot watch port of camera %d", id, cam);
+			return -1;
+		}
+
+		if (reactor_add_frames(r, &r->frames[cam], cameras[cam], FRAME_ENC_RAW, 0) < 0)
+		{
+			syslog(LOG_DEBUG, "Reactor %d: cannot subscribe to frames of camera %d", id, cam);
+			return -1;
+		}
+		for (int v = 0; v < JPEG_VARIANTS; v++)
+			if (reactor_add_frames(r, &r->jpeg_frames[cam][v], cameras[cam], FRAME_ENC_JPEG, v) < 0)
+			{
+				syslog(LOG_DEBUG, "Reactor %d: cannot subscribe to JPEG frames of camera %d", id, cam);
+				return -1;
+			}
+	}
+	return 0;
+}
+
+// Free the clients closed during the last epoll batch
+static void reactor_reap(StreamReactor *r)
+{
+	while (!SLIST_EMPTY(&r->closing))
+	{
+		StreamClient *c = SLIST_FIRST(&r->closing);
+		SLIST_REMOVE_HEAD(&r->closing, entries);
+		delete c;
+	}
+}
+
+// Close every client and the reactor's own descriptors
+void reactor_destroy(StreamReactor *r)
+{
+	while (!SLIST_EMPTY(&r->clients))
+		client_close(r, SLIST_FIRST(&r->clients));
+	reactor_reap(r);
+	for (int cam = 0; cam < r->num_cameras; cam++)
+	{
+		frame_ring_unsubscribe(source_ring(&r->frames[cam]), r->frames[cam].fd);
+		close(r->frames[cam].fd);
+		for (int v = 0; v < JPEG_VARIANTS; v++)
+		{
+			frame_ring_unsubscribe(source_ring(&r->jpeg_frames[cam][v]), r->jpeg_frames[cam][v].fd);
+			close(r->jpeg_frames[cam][v].fd);
+		}
+	}
+	close(r->epfd);
+}
+
+// Watch a client for input, and for writability while a frame is outstanding
+static void client_watch(StreamReactor *r, StreamClient *c, bool out)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | (out ? (uint32_t)EPOLLOUT : 0u);
+	ev.data.ptr = c;
+	epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_out = out;
+}
+
+static void client_close(StreamReactor *r, StreamClient *c)
+{
+	DEBUG_LOG("Reactor %d: camera %d client on socket %d closed", r->id,
+			  c->imgStruct != NULL ? c->imgStruct->id : -1, c->fd);
+	if (c->slot != NULL)
+		frame_ring_release(c->slot);
+	if (c->format == FRAME_ENC_JPEG)
+		jpeg_variant_release(c->imgStruct, c->variant);
+	// The socket goes away with its unfinished zero-copy sends, nobody reads those pages any more
+	while (!c->zc_pending.empty())
+	{
+		frame_ring_zerocopy_release(c->zc_pending.front().ring, c->zc_pending.front().slot);
+		c->zc_pending.pop_front();
+	}
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	// Freed after the current epoll batch, later events of the batch may still point at it
+	SLIST_REMOVE(&r->clients, c, StreamClient, entries);
+	SLIST_INSERT_HEAD(&r->closing, c, entries);
+	c->kind = REACTOR_CLOSED;
+	c->slot = NULL;
+	r->num_clients.fetch_sub(1);
+	r->closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Write as much of the outstanding frame as the socket takes
+// Returns 1 when the frame is complete, 0 when the socket is full, -1 on a connection error
+// or once a one-shot response is complete (the caller closes the connection either way)
+static int client_flush(StreamReactor *r, StreamClient *c)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+
+	while (c->iovcnt > 0)
+	{
+		int first = c->iov_first;
+		int count = c->iovcnt;
+		int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		int payload = c->payload_iov;
+		// The payload goes out on its own with MSG_ZEROCOPY: the kernel reads the slot pages until
+		// the completion arrives, while the header is rewritten for the next frame and must be copied
+		if (c->zerocopy && c->slot != NULL && payload >= first && payload < first + count &&
+			c->iov[payload].iov_len >= STREAM_ZEROCOPY_MIN)
+		{
+			if (first < payload)
+				count = payload - first;
+			else if (frame_ring_zerocopy_pin(client_ring(c), c->slot))
+			{
+				count = 1;
+				flags |= MSG_ZEROCOPY;
+			}
+		}
+		msg.msg_iov = c->iov + first;
+		msg.msg_iovlen = count;
+		ssize_t sent = sendmsg(c->fd, &msg, flags);
+		if (sent < 0 && flags & MSG_ZEROCOPY)
+			frame_ring_zerocopy_release(client_ring(c), c->slot);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			break;
+		}
+		r->bytes_sent.fetch_add(sent, std::memory_order_relaxed);
+		if (flags & MSG_ZEROCOPY)
+		{
+			// Every successful zero-copy send gets the next completion id, keep the slot until then
+			ZeroCopyPin pin = { c->zc_next++, client_ring(c), c->slot, (uint32_t)sent };
+			c->zc_pending.push_back(pin);
+			r->zc_sends.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+			r->bytes_copied.fetch_add(sent, std::memory_order_relaxed);
+		// Skip the fully sent entries and trim the partly sent one
+		while (c->iovcnt > 0 && (size_t)sent >= c->iov[c->iov_first].iov_len)
+		{
+			sent -= c->iov[c->iov_first].iov_len;
+			c->iov_first++;
+			c->iovcnt--;
+		}
+		if (c->iovcnt > 0)
+		{
+			c->iov[c->iov_first].iov_base = (char*)c->iov[c->iov_first].iov_base + sent;
+			c->iov[c->iov_first].iov_len -= sent;
+		}
+	}
+
+	if (c->iovcnt == 0)
+	{
+		// Frame complete
+		if (c->slot != NULL)
+			frame_ring_release(c->slot);
+		c->slot = NULL;
+		c->sending = false;
+		r->frames_sent.fetch_add(1, std::memory_order_relaxed);
+		if (c->want_out)
+			client_watch(r, c, false);
+		return c->one_shot ? -1 : 1;
+	}
+
+	// Socket full: keep the rest in the backlog so the ring slot is not held by a slow viewer
+	// (zero-copy sends already queued keep their own pins until they complete)
+	if (c->slot != NULL)
+	{
+		size_t rest = 0;
+		for (int i = 0; i < c->iovcnt; i++)
+			rest += c->iov[c->iov_first + i].iov_len;
+		c->backlog.resize(rest);
+		size_t off = 0;
+		for (int i = 0; i < c->iovcnt; i++)
+		{
+			memcpy(&c->backlog[off], c->iov[c->iov_first + i].iov_base, c->iov[c->iov_first + i].iov_len);
+			off += c->iov[c->iov_first + i].iov_len;
+		}
+		c->iov[0].iov_base = c->backlog.data();
+		c->iov[0].iov_len = rest;
+		c->iov_first = 0;
+		c->iovcnt = 1;
+		c->payload_iov = -1;
+		frame_ring_release(c->slot);
+		c->slot = NULL;
+		r->backlogged.fetch_add(1, std::memory_order_relaxed);
+		r->bytes_copied.fetch_add(rest, std::memory_order_relaxed);
+	}
+	if (!c->want_out)
+		client_watch(r, c, true);
+	return 0;
+}
+
+// Read MSG_ZEROCOPY completions from the socket error queue and unpin the slots they cover
+// Returns -1 on a socket error other than a completion
+static int client_zerocopy_done(StreamReactor *r, StreamClient *c)
+{
+	char control[128];
+	struct msghdr msg;
+
+	while (true)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+				continue;
+			struct sock_extended_err *err = (struct sock_extended_err*)CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				return -1;
+			// Sends ee_info..ee_data are done, completions arrive in order
+			bool copied = err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+			while (!c->zc_pending.empty() && (int32_t)(c->zc_pending.front().id - err->ee_data) <= 0)
+			{
+				ZeroCopyPin pin = c->zc_pending.front();
+				c->zc_pending.pop_front();
+				if (copied)
+				{
+					r->zc_fallbacks.fetch_add(1, std::memory_order_relaxed);
+					r->bytes_copied.fetch_add(pin.len, std::memory_order_relaxed);
+				}
+				frame_ring_zerocopy_release(pin.ring, pin.slot);
+			}
+		}
+	}
+
+	// EPOLLERR is also raised for a pending socket error
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+		return -1;
+	return 0;
+}
+
+// Framed protocol: FrameHeader | FaceRecords of the slot | payload
+// tier scales the slot's face rectangles to a payload scaled down for the viewer
+static void client_pack_frame(StreamClient *c, FrameSlot *slot, Size size, int encoding,
+							  const void *payload, uint32_t payload_len, int tier)
+{
+	int rects[FRAME_MAX_FACES][4];
+	int num_faces = slot->faces.size() < FRAME_MAX_FACES ? slot->faces.size() : FRAME_MAX_FACES;
+	for (int i = 0; i < num_faces; i++)
+	{
+		rects[i][0] = slot->faces[i].x >> tier;
+		rects[i][1] = slot->faces[i].y >> tier;
+		rects[i][2] = slot->faces[i].width >> tier;
+		rects[i][3] = slot->faces[i].height >> tier;
+	}
+	frame_header_pack(&c->hdr, c->faces, slot->seq, &slot->ts, size.width, size.height,
+					  FRAME_PIX_GRAY8, encoding, rects, num_faces, payload_len);
+	c->iov[0].iov_base = &c->hdr;
+	c->iov[0].iov_len = sizeof(c->hdr);
+	c->iov[1].iov_base = c->faces;
+	c->iov[1].iov_len = num_faces * sizeof(FaceRecord);
+	c->iov[2].iov_base = (void*)payload;
+	c->iov[2].iov_len = payload_len;
+}
+
+// Delta mode: a raw keyframe every DELTA_KEYFRAME_INTERVAL frames or when most blocks changed,
+// otherwise the blocks that changed against the client's reference (block_delta.h)
+// img is the slot's image, or the client's copy of it scaled down to its tier
+// Returns true if the payload was packed from the client's own buffers and the slot is not needed
+static bool client_pack_delta(StreamReactor *r, StreamClient *c, FrameSlot *slot, const Mat &img, int tier)
+{
+	int blocks = ((img.cols + DELTA_BLOCK - 1) / DELTA_BLOCK) * ((img.rows + DELTA_BLOCK - 1) / DELTA_BLOCK);
+	double t = (double)getTickCount();
+	bool key = c->since_key >= DELTA_KEYFRAME_INTERVAL || c->reference.size() != img.size();
+	int changed = blocks;
+
+	// Scheduled keyframes skip the scan, and nothing is packed unless the delta is sent
+	if (!key)
+	{
+		changed = delta_changed(img, c->reference, (int)(blocks * DELTA_KEYFRAME_SHARE), c->delta_blocks);
+		key = changed < 0;
+		if (!key)
+			delta_encode(img, c->reference, c->delta_blocks, c->delta_buf);
+	}
+	if (key)
+	{
+		img.copyTo(c->reference);
+		c->since_key = 0;
+		client_pack_frame(c, slot, img.size(), FRAME_ENC_RAW, img.data, img.total(), tier);
+		r->delta_keyframes.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		c->since_key++;
+		client_pack_frame(c, slot, img.size(), FRAME_ENC_DELTA, c->delta_buf.data(), c->delta_buf.size(), tier);
+	}
+
+	r->delta_frames.fetch_add(1, std::memory_order_relaxed);
+	r->delta_blocks.fetch_add(key ? blocks : changed, std::memory_order_relaxed);
+	r->delta_blocks_total.fetch_add(blocks, std::memory_order_relaxed);
+	r->delta_bytes.fetch_add(c->iov[2].iov_len, std::memory_order_relaxed);
+	r->delta_us.fetch_add((uint64_t)(((double)getTickCount() - t) * 1e6 / getTickFrequency()),
+						  std::memory_order_relaxed);
+	return !key || img.data != slot->img.data;
+}
+
+// Resolution tier the viewer gets: subscribed tier, one smaller every second adaptive step
+static int client_tier(StreamClient *c)
+{
+	int tier = c->tier + c->adapt_level / 2;
+	return tier < STREAM_TIERS ? tier : STREAM_TIERS - 1;
+}
+
+// JPEG quality the viewer gets: subscribed quality or the camera default, lowered per adaptive step
+static int client_quality(StreamClient *c)
+{
+	int quality = c->quality > 0 ? c->quality : c->imgStruct->jpeg_quality;
+	int lowered = quality - c->adapt_level * ADAPT_QUALITY_STEP;
+	return std::max(lowered, std::min(quality, ADAPT_MIN_QUALITY));
+}
+
+// Capture time between frames the viewer gets, 0 for every frame
+static uint64_t client_interval_ns(StreamClient *c)
+{
+	double fps = c->fps > 0 ? std::min((float)c->fps, c->imgStruct->frame_rate) : c->imgStruct->frame_rate;
+	fps /= 1 << c->adapt_level;
+	if (fps >= c->imgStruct->frame_rate)
+		return 0;
+	return (uint64_t)(1e9 / std::max(fps, 1.0));
+}
+
+// Move a JPEG viewer to the variant matching its current tier and quality
+static void client_resubscribe(StreamClient *c)
+{
+	if (c->format != FRAME_ENC_JPEG)
+		return;
+	// Released first: a variant only this viewer watched is simply reconfigured
+	jpeg_variant_release(c->imgStruct, c->variant);
+	int variant = jpeg_variant_acquire(c->imgStruct, client_tier(c), client_quality(c));
+	if (variant != c->variant)
+		c->last_sent = 0;		// Sequence numbers of the two rings are unrelated
+	c->variant = variant;
+}
+
+// Adaptive viewers: step down when the previous frame was still being written as the next one
+// became due, back up once ADAPT_CLEAN_FRAMES frames in a row were done in time
+static void client_adapt(StreamReactor *r, StreamClient *c, bool backed_up)
+{
+	int level = c->adapt_level;
+	if (!c->adaptive)
+		return;
+	if (backed_up)
+	{
+		c->clean_frames = 0;
+		if (level < ADAPT_MAX_LEVEL)
+			level++;
+	}
+	else if (++c->clean_frames >= ADAPT_CLEAN_FRAMES && level > 0)
+	{
+		c->clean_frames = 0;
+		level--;
+	}
+	if (level == c->adapt_level)
+		return;
+	(level > c->adapt_level ? r->adapt_down : r->adapt_up).fetch_add(1, std::memory_order_relaxed);
+	TRACE_LOG("Reactor %d: client on socket %d adaptive level %d", r->id, c->fd, level);
+	c->adapt_level = level;
+	client_resubscribe(c);
+}
+
+// Apply one subscription parameter of a viewer: fps, tier, quality or adaptive
+// Returns -1 for an unknown parameter
+static int client_subscribe(StreamClient *c, const char *name, int value)
+{
+	if (strcmp(name, "fps") == 0)
+		c->fps = std::max(value, 0);
+	else if (strcmp(name, "tier") == 0)
+		c->tier = std::min(std::max(value, 0), STREAM_TIERS - 1);
+	else if (strcmp(name, "quality") == 0)
+		c->quality = std::min(std::max(value, 0), 100);
+	else if (strcmp(name, "adaptive") == 0)
+	{
+		c->adaptive = value != 0;
+		c->adapt_level = 0;
+		c->clean_frames = 0;
+	}
+	else
+		return -1;
+	c->next_due_ns = 0;
+	client_resubscribe(c);
+	return 0;
+}
+
+// Start sending the newest frame of the client's camera unless it already has it, or it is not
+// due yet at the client's frame rate
+// Returns -1 on a connection error
+static int client_kick(StreamReactor *r, StreamClient *c)
+{
+	if (c->sending)
+		return 0;
+	FrameSlot *slot = frame_ring_acquire(client_ring(c));
+	if (slot == NULL)
+		return 0;
+	if (slot->seq == c->last_sent)
+	{
+		frame_ring_release(slot);
+		return 0;
+	}
+
+	// Decimate by capture time, a snapshot takes whatever frame is there
+	uint64_t interval = client_interval_ns(c);
+	if (interval > 0 && !(c->protocol == CLIENT_HTTP && c->http_route == HTTP_SNAPSHOT))
+	{
+		uint64_t ts = (uint64_t)slot->ts.tv_sec * 1000000000ULL + slot->ts.tv_nsec;
+		// A frame slightly early still counts, capture jitter must not halve the rate
+		if (ts + interval / 4 < c->next_due_ns)
+		{
+			frame_ring_release(slot);
+			r->frames_decimated.fetch_add(1, std::memory_order_relaxed);
+			return 0;
+		}
+		// Keep the average rate, without a burst of catch-up frames after a stall
+		c->next_due_ns = ts > c->next_due_ns + interval ? ts + interval : c->next_due_ns + interval;
+	}
+
+	if (c->protocol == CLIENT_HTTP)
+	{
+		// Part header (response header too on the first frame) | JPEG | CRLF ending the part
+		static char crlf[] = "\r\n";
+		c->iov[0].iov_base = c->http_hdr;
+		c->iov[0].iov_len = http_frame_header(c->http_hdr, sizeof(c->http_hdr), c->http_route,
+											  !c->http_started, slot->seq, slot->data.size());
+		c->iov[1].iov_base = slot->data.data();
+		c->iov[1].iov_len = slot->data.size();
+		c->iov[2].iov_base = crlf;
+		c->iov[2].iov_len = 2;
+		c->iovcnt = c->http_route == HTTP_SNAPSHOT ? 2 : 3;
+		c->payload_iov = 1;
+		c->one_shot = c->http_route == HTTP_SNAPSHOT;
+		c->http_started = true;
+		c->http_deadline_ns = 0;
+	}
+	else
+	{
+		bool copied = false;
+		int tier = client_tier(c);
+		const Mat *img = &slot->img;
+		// Raw frames are scaled per viewer, JPEG variants come scaled from the encode stage
+		if (c->format == FRAME_ENC_RAW && tier > 0)
+		{
+			resize(slot->img, c->scaled, Size(), 1.0 / (1 << tier), 1.0 / (1 << tier), INTER_AREA);
+			img = &c->scaled;
+		}
+		if (c->delta)
+			copied = client_pack_delta(r, c, slot, *img, tier);
+		else if (c->format == FRAME_ENC_JPEG)
+			client_pack_frame(c, slot, slot->size, FRAME_ENC_JPEG, slot->data.data(), slot->data.size(), 0);
+		else
+		{
+			client_pack_frame(c, slot, img->size(), FRAME_ENC_RAW, img->data, img->total() * img->elemSize(), tier);
+			copied = img != &slot->img;
+		}
+		c->iovcnt = 3;
+		c->payload_iov = 2;
+		if (copied)
+		{
+			// The payload was copied out of the slot, it can go back to the ring right away
+			c->last_sent = slot->seq;
+			frame_ring_release(slot);
+			slot = NULL;
+		}
+	}
+	c->iov_first = 0;
+	c->slot = slot;
+	c->sending = true;
+	if (slot != NULL)
+		c->last_sent = slot->seq;
+	if (client_flush(r, c) < 0)
+		return -1;
+	// Not fitting in the socket at once is normal for frames larger than STREAM_NOTSENT_LOWAT,
+	// missing the next frame is what adaptive viewers step down on
+	client_adapt(r, c, c->backed_up);
+	c->backed_up = false;
+	return 0;
+}
+
+// Queue a short text response on an HTTP client, the connection closes once it is written
+// Returns -1 on a connection error
+static int client_respond(StreamReactor *r, StreamClient *c, int status, const char *text)
+{
+	char buf[256];
+	int len = http_text_response(buf, sizeof(buf), status, text);
+	c->backlog.assign(buf, buf + len);
+	c->iov[0].iov_base = c->backlog.data();
+	c->iov[0].iov_len = len;
+	c->iov_first = 0;
+	c->iovcnt = 1;
+	c->payload_iov = -1;
+	c->slot = NULL;
+	c->sending = true;
+	c->one_shot = true;
+	c->http_deadline_ns = 0;
+	return client_flush(r, c) < 0 ? -1 : 0;
+}
+
+// Answer HTTP clients that did not complete their request, or got no frame, in time: slow
+// or idle connections must not hold a socket forever, nor wait on a variant nobody encodes
+static void reactor_expire(StreamReactor *r, const struct timespec *now)
+{
+	uint64_t now_ns = (uint64_t)now->tv_sec * 1000000000ULL + now->tv_nsec;
+	StreamClient *c, *tmp;
+
+	SLIST_FOREACH_SAFE(c, &r->clients, entries, tmp)
+	{
+		if (c->http_deadline_ns == 0 || now_ns < c->http_deadline_ns || c->sending)
+			continue;
+		DEBUG_LOG("Reactor %d: HTTP client on socket %d timed out", r->id, c->fd);
+		r->http_timeouts.fetch_add(1, std::memory_order_relaxed);
+		if (client_respond(r, c, 503, "Timed out\n") < 0)
+			client_close(r, c);
+	}
+}
+
+// Accept every pending connection on a camera's port or the HTTP port
+static void reactor_accept(StreamReactor *r, ReactorSource *src)
+{
+	struct epoll_event ev;
+	int lowat = STREAM_NOTSENT_LOWAT;
+	int nodelay = 1;
+
+	while (true)
+	{
+		int fd = accept4(src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				syslog(LOG_DEBUG, "Reactor %d: accept failed, errno %d", r->id, errno);
+			return;
+		}
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+			syslog(LOG_DEBUG, "setsockopt(TCP_NOTSENT_LOWAT) failed");
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		// Kernels before 4.14 do not know SO_ZEROCOPY, such viewers are sent copies
+		bool zerocopy = r->zerocopy &&
+			setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &nodelay, sizeof(nodelay)) == 0;
+
+		StreamClient *c = new StreamClient;
+		c->kind = REACTOR_CLIENT;
+		c->fd = fd;
+		c->protocol = src->kind == REACTOR_HTTP ? CLIENT_HTTP : CLIENT_FRAMED;
+		c->imgStruct = src->imgStruct;
+		c->format = FRAME_ENC_RAW;
+		c->variant = 0;
+		c->fps = 0;
+		c->tier = 0;
+		c->quality = 0;
+		c->adaptive = false;
+		c->adapt_level = 0;
+		c->clean_frames = 0;
+		c->backed_up = false;
+		c->next_due_ns = 0;
+		c->slot = NULL;
+		c->sending = false;
+		c->want_out = false;
+		c->last_sent = 0;
+		c->iovcnt = 0;
+		c->iov_first = 0;
+		c->payload_iov = -1;
+		c->delta = false;
+		c->since_key = 0;
+		c->zerocopy = zerocopy;
+		c->zc_next = 0;
+		c->one_shot = false;
+		c->http_started = false;
+		c->http_deadline_ns = 0;
+		if (c->protocol == CLIENT_HTTP)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			c->http_deadline_ns = (uint64_t)(now.tv_sec + HTTP_TIMEOUT_SECONDS) * 1000000000ULL + now.tv_nsec;
+		}
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = c;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			close(fd);
+			delete c;
+			continue;
+		}
+		SLIST_INSERT_HEAD(&r->clients, c, entries);
+		r->num_clients.fetch_add(1);
+		r->accepted.fetch_add(1, std::memory_order_relaxed);
+		// HTTP clients name their camera in the request
+		if (c->protocol == CLIENT_HTTP)
+			continue;
+		DEBUG_LOG("Reactor %d: camera %d client connected on socket %d", r->id, c->imgStruct->id, fd);
+
+		// Send the current frame right away, even while the camera is paused
+		if (client_kick(r, c) < 0)
+			client_close(r, c);
+	}
+}
+
+// A camera published a new frame: start it on every idle client of that camera
+static void reactor_frames(StreamReactor *r, ReactorSource *src)
+{
+	uint64_t count;
+	StreamClient *c, *tmp;
+
+	if (read(src->fd, &count, sizeof(count)) < 0)
+		return;
+	SLIST_FOREACH_SAFE(c, &r->clients, entries, tmp)
+	{
+		if (c->imgStruct != src->imgStruct || c->format != src->format ||
+			(c->format == FRAME_ENC_JPEG && c->variant != src->variant))
+			continue;
+		if (c->sending)
+		{
+			// Still writing an older frame, the client gets the newest one when it drains.
+			// Frames it would have decimated anyway are no backpressure
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			uint64_t interval = client_interval_ns(c);
+			if (interval == 0 || (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec + interval / 4 >= c->next_due_ns)
+				c->backed_up = true;
+			r->frames_skipped.fetch_add(count, std::memory_order_relaxed);
+			continue;
+		}
+		if (client_kick(r, c) < 0)
+			client_close(r, c);
+	}
+}
+
+// Switch a viewer between raw and JPEG frames, from its next frame on
+static void client_set_format(StreamClient *c, int format)
+{
+	if (format == c->format)
+		return;
+	if (c->format == FRAME_ENC_JPEG)
+		jpeg_variant_release(c->imgStruct, c->variant);
+	if (format == FRAME_ENC_JPEG)
+		c->variant = jpeg_variant_acquire(c->imgStruct, client_tier(c), client_quality(c));
+	c->format = format;
+	c->last_sent = 0;			// Sequence numbers of the two rings are unrelated
+}
+
+// Answer a complete HTTP request: start the MJPEG stream, send a snapshot or apply a control code
+// Stream and snapshot subscribe to the JPEG variant of the requested tier and quality
+// Returns -1 when the connection is to be closed
+static int http_request(StreamReactor *r, StreamClient *c)
+{
+	HttpRequest req;
+	int status = http_parse_request(c->request.c_str(), c->request.size(), &req);
+	if (status == 0)
+		return 0;
+	r->http_requests.fetch_add(1, std::memory_order_relaxed);
+	if (status == 200 && (req.cam < 0 || req.cam >= r->num_cameras))
+		status = 404;
+	if (status != 200)
+		return client_respond(r, c, status, "Unknown request\n");
+	c->request.clear();
+	ImgCaptureStruct *imgStruct = r->cameras[req.cam];
+	DEBUG_LOG("Reactor %d: HTTP request %d for camera %d on socket %d", r->id, req.route, req.cam, c->fd);
+
+	if (req.route == HTTP_CONTROL)
+	{
+		// Output formats and frame rates are chosen per connection, they mean nothing here
+		if (handle_command(imgStruct, req.cmd) < 0)
+			return client_respond(r, c, 400, "Unknown control code, frame rates are set per viewer (fps=N)\n");
+		return client_respond(r, c, 200, "OK\n");
+	}
+
+	c->imgStruct = imgStruct;
+	c->format = FRAME_ENC_RAW;
+	client_subscribe(c, "fps", req.fps);
+	client_subscribe(c, "tier", req.tier);
+	client_subscribe(c, "quality", req.quality);
+	client_subscribe(c, "adaptive", req.adaptive);
+	client_set_format(c, FRAME_ENC_JPEG);
+	// Without other viewers of the variant the encoder skipped it and its newest frame may be old:
+	// wait for the next one, unless the camera is paused and no new one will come
+	JpegVariant *variant = &imgStruct->jpeg[c->variant];
+	if (variant->viewers.load() <= 1 && !imgStruct->pauseVideo)
+		c->last_sent = variant->ring.seq.load();
+	c->http_route = req.route;
+	return client_kick(r, c);
+}
+
+// Apply one command line of a framed client: a decimal control code or a name=value
+// subscription parameter
+static void client_command(StreamClient *c, char *line)
+{
+	char *value = strchr(line, '=');
+	if (value != NULL)
+	{
+		*value++ = '\0';
+		if (client_subscribe(c, line, atoi(value)) < 0)
+			DEBUG_LOG("Unknown subscription parameter %s", line);
+		else
+			DEBUG_LOG("Subscription: %s=%d", line, atoi(value));
+		return;
+	}
+	int userInput = atoi(line);
+	DEBUG_LOG("Data Received: %d", userInput);
+	if (userInput == CMD_FORMAT_RAW || userInput == CMD_FORMAT_JPEG || userInput == CMD_FORMAT_DELTA)
+	{
+		client_set_format(c, userInput == CMD_FORMAT_JPEG ? FRAME_ENC_JPEG : FRAME_ENC_RAW);
+		// Delta mode starts with a keyframe
+		c->delta = userInput == CMD_FORMAT_DELTA;
+		c->since_key = DELTA_KEYFRAME_INTERVAL;
+	}
+	// Older viewers send their frame rate as a bare number
+	else if (handle_command(c->imgStruct, userInput) < 0)
+		client_subscribe(c, "fps", userInput);
+}
+
+// Read control input from a client
+// Returns -1 when the client closed the connection
+static int client_input(StreamReactor *r, StreamClient *c)
+{
+	char buf[64];
+
+	while (true)
+	{
+		ssize_t bytes = recv(c->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (bytes == 0)
+		{
+			// A last command without its newline still counts
+			if (c->protocol == CLIENT_FRAMED && !c->request.empty())
+				client_command(c, &c->request[0]);
+			return -1;
+		}
+		if (bytes < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		buf[bytes] = '\0';
+		if (c->protocol == CLIENT_HTTP)
+		{
+			// Anything after the request (a POST body, a pipelined request) is ignored
+			if (c->imgStruct == NULL && !c->sending)
+			{
+				c->request.append(buf, bytes);
+				if (http_request(r, c) < 0)
+					return -1;
+			}
+			continue;
+		}
+		// Commands are newline terminated and may be split across reads: only complete lines are
+		// applied, the rest waits in the client's line buffer
+		c->request.append(buf, bytes);
+		size_t start = 0, end;
+		while ((end = c->request.find('\n', start)) != std::string::npos)
+		{
+			c->request[end] = '\0';
+			client_command(c, &c->request[start]);
+			start = end + 1;
+		}
+		c->request.erase(0, start);
+		if (c->request.size() > CLIENT_MAX_LINE)
+		{
+			DEBUG_LOG("Reactor %d: command line too long on socket %d, discarded", r->id, c->fd);
+			c->request.clear();
+		}
+	}
+}
+
+// Add the CPU time this reactor thread used since *prev to its counters
+static void reactor_cpu(StreamReactor *r, struct rusage *prev)
+{
+	struct rusage now;
+	if (getrusage(RUSAGE_THREAD, &now) < 0)
+		return;
+	r->sys_us.fetch_add((now.ru_stime.tv_sec - prev->ru_stime.tv_sec) * 1000000LL +
+						now.ru_stime.tv_usec - prev->ru_stime.tv_usec, std::memory_order_relaxed);
+	r->user_us.fetch_add((now.ru_utime.tv_sec - prev->ru_utime.tv_sec) * 1000000LL +
+						 now.ru_utime.tv_usec - prev->ru_utime.tv_usec, std::memory_order_relaxed);
+	*prev = now;
+}
+
+// Reactor thread: runs until END_PROGRAM is set
+void *reactor_thread(void *ptr)
+{
+	StreamReactor *r = (StreamReactor*) ptr;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct rusage cpu;
+	struct timespec now, last_cpu;
+
+	getrusage(RUSAGE_THREAD, &cpu);
+	clock_gettime(CLOCK_MONOTONIC, &last_cpu);
+
+	while (END_PROGRAM == 0)
+	{
+		// The timeout only bounds how long END_PROGRAM goes unnoticed
+		int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, 1000);
+		for (int i = 0; i < n; i++)
+		{
+			int kind = *(int*)events[i].data.ptr;
+			if (kind == REACTOR_LISTEN || kind == REACTOR_HTTP)
+			{
+				reactor_accept(r, (ReactorSource*)events[i].data.ptr);
+			}
+			else if (kind == REACTOR_FRAMES)
+			{
+				reactor_frames(r, (ReactorSource*)events[i].data.ptr);
+			}
+			else if (kind == REACTOR_CLIENT)
+			{
+				StreamClient *c = (StreamClient*)events[i].data.ptr;
+				if (events[i].events & EPOLLIN && client_input(r, c) < 0)
+				{
+					client_close(r, c);
+					continue;
+				}
+				// With zero-copy sends EPOLLERR mostly means completions are queued
+				if (events[i].events & EPOLLERR && c->zerocopy && client_zerocopy_done(r, c) < 0)
+				{
+					client_close(r, c);
+					continue;
+				}
+				if (events[i].events & (EPOLLHUP | EPOLLRDHUP) || (events[i].events & EPOLLERR && !c->zerocopy))
+				{
+					client_close(r, c);
+					continue;
+				}
+				if (events[i].events & EPOLLOUT)
+				{
+					// Outstanding frame drained: move on to the newest frame
+					int ret = client_flush(r, c);
+					if (ret > 0)
+						ret = client_kick(r, c);
+					if (ret < 0)
+						client_close(r, c);
+				}
+			}
+		}
+		reactor_reap(r);
+
+		// Kernel time is where copies into socket buffers show up, sampled once a second
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec != last_cpu.tv_sec)
+		{
+			reactor_cpu(r, &cpu);
+			reactor_expire(r, &now);
+			last_cpu = now;
+		}
+	}
+	DEBUG_LOG("Terminating Reactor %d", r->id);
+	return NULL;
+}
+
+#endif // STREAM_REACTOR_H
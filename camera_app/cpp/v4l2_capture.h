@@ -0,0 +1,261 @@
+/**************************************************************************************************
+* @file        v4l2_capture.h
+* @version     0.1.1
+* @type:       Native V4L2 memory mapped capture backend
+* @brief       Reads frames straight from /dev/videoN without going through VideoCapture.
+*                 - Requests GREY, falling back to YUYV, so the luma plane comes from the driver
+*                   and no BGR frame is ever produced
+*                 - Driver buffers are mmap'd; the Y samples are read in place and written once
+*                   into the caller's frame (GREY: one memcpy, YUYV: one extractChannel pass)
+*                 - Every grab drains the driver queue and keeps only the newest buffer, stale
+*                   buffers are re-queued and counted instead of being delivered late
+*                 - The driver timestamp is returned with the frame
+*              Works with any V4L2 capture node, including the vivid and v4l2loopback virtual
+*              devices, e.g. "modprobe vivid" and then "server -b v4l2 -d /dev/videoN".
+*
+* @author      Julian Abbott-Whitley (julian.abbott-whitley@Colorado.edu)
+* @license:    GNU GPLv3   (attached below)
+*
+* @references: The following sources were referenced during development
+*					- [V4L2 Streaming I/O (Memory Mapping)](https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/mmap.html)
+*
+**************************************************************************************************/
+
+#ifndef V4L2_CAPTURE_H
+#define V4L2_CAPTURE_H
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include "opencv2/opencv.hpp"
+
+using namespace cv;
+
+#define V4L2_NUM_BUFFERS	4		// Driver buffers to request
+
+typedef struct
+{
+	void *start;
+	size_t length;
+} V4l2Buffer;
+
+typedef struct
+{
+	int fd;
+	int width;
+	int height;
+	uint32_t pixfmt;				// V4L2_PIX_FMT_GREY or V4L2_PIX_FMT_YUYV
+	int bytesperline;
+	bool monotonic_ts;				// Driver timestamps use CLOCK_MONOTONIC
+	V4l2Buffer bufs[V4L2_NUM_BUFFERS];
+	int nbufs;
+	uint64_t stale_dropped;			// Queued frames skipped to deliver the newest one
+} V4l2Capture;
+
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+	int ret;
+	do
+	{
+		ret = ioctl(fd, req, arg);
+	} while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+// Stop streaming, unmap the buffers and close the device
+void v4l2_close(V4l2Capture *v4l2)
+{
+	if (v4l2->fd < 0)
+		return;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xioctl(v4l2->fd, VIDIOC_STREAMOFF, &type);
+	for (int i = 0; i < v4l2->nbufs; i++)
+		munmap(v4l2->bufs[i].start, v4l2->bufs[i].length);
+	v4l2->nbufs = 0;
+	close(v4l2->fd);
+	v4l2->fd = -1;
+}
+
+// Try to set a luma carrying pixel format at the requested size
+static bool v4l2_set_format(V4l2Capture *v4l2, uint32_t pixfmt, int width, int height)
+{
+	struct v4l2_format fmt;
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = width;
+	fmt.fmt.pix.height = height;
+	fmt.fmt.pix.pixelformat = pixfmt;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	// The pipeline's frame slots are preallocated, the driver must not pick another size
+	if (xioctl(v4l2->fd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix.pixelformat != pixfmt ||
+		(int)fmt.fmt.pix.width != width || (int)fmt.fmt.pix.height != height)
+		return false;
+	v4l2->pixfmt = pixfmt;
+	v4l2->width = fmt.fmt.pix.width;
+	v4l2->height = fmt.fmt.pix.height;
+	v4l2->bytesperline = fmt.fmt.pix.bytesperline;
+	return true;
+}
+
+// Open a V4L2 capture device, negotiate GREY/YUYV at width x height and start streaming
+// Returns 0 on success, -1 on failure (device left closed)
+int v4l2_open(V4l2Capture *v4l2, const char *path, int width, int height, float frame_rate)
+{
+	struct v4l2_capability cap;
+	struct v4l2_requestbuffers req;
+
+	memset(v4l2, 0, sizeof(*v4l2));
+	v4l2->fd = open(path, O_RDWR | O_NONBLOCK);
+	if (v4l2->fd < 0)
+	{
+		syslog(LOG_DEBUG, "v4l2: open(%s) failed: %s", path, strerror(errno));
+		return -1;
+	}
+	if (xioctl(v4l2->fd, VIDIOC_QUERYCAP, &cap) < 0 ||
+		!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(cap.capabilities & V4L2_CAP_STREAMING))
+	{
+		syslog(LOG_DEBUG, "v4l2: %s is not a streaming capture device", path);
+		close(v4l2->fd);
+		v4l2->fd = -1;
+		return -1;
+	}
+
+	// Prefer GREY (luma only), otherwise YUYV where every other byte is luma
+	if (!v4l2_set_format(v4l2, V4L2_PIX_FMT_GREY, width, height) &&
+		!v4l2_set_format(v4l2, V4L2_PIX_FMT_YUYV, width, height))
+	{
+		syslog(LOG_DEBUG, "v4l2: %s supports neither GREY nor YUYV", path);
+		close(v4l2->fd);
+		v4l2->fd = -1;
+		return -1;
+	}
+
+	// Ask the driver for the configured frame rate, not fatal if unsupported
+	struct v4l2_streamparm parm;
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.parm.capture.timeperframe.numerator = 1;
+	parm.parm.capture.timeperframe.denominator = (uint32_t)frame_rate;
+	xioctl(v4l2->fd, VIDIOC_S_PARM, &parm);
+
+	memset(&req, 0, sizeof(req));
+	req.count = V4L2_NUM_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(v4l2->fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2)
+	{
+		syslog(LOG_DEBUG, "v4l2: VIDIOC_REQBUFS failed on %s", path);
+		close(v4l2->fd);
+		v4l2->fd = -1;
+		return -1;
+	}
+
+	// Drivers may hand out more buffers than asked for, the extra ones are left unmapped and never
+	// queued, so the driver does not fill them
+	int wanted = std::min((int)req.count, V4L2_NUM_BUFFERS);
+	int queued = 0;
+	for (int i = 0; i < wanted; i++)
+	{
+		struct v4l2_buffer buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (xioctl(v4l2->fd, VIDIOC_QUERYBUF, &buf) < 0)
+			break;
+		v4l2->bufs[i].length = buf.length;
+		v4l2->bufs[i].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+								   v4l2->fd, buf.m.offset);
+		if (v4l2->bufs[i].start == MAP_FAILED)
+			break;
+		v4l2->nbufs++;
+		if (xioctl(v4l2->fd, VIDIOC_QBUF, &buf) < 0)
+			break;
+		queued++;
+		v4l2->monotonic_ts = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	}
+
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (queued != wanted || xioctl(v4l2->fd, VIDIOC_STREAMON, &type) < 0)
+	{
+		syslog(LOG_DEBUG, "v4l2: failed to start streaming on %s", path);
+		v4l2_close(v4l2);
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "v4l2: %s streaming %dx%d %s", path, v4l2->width, v4l2->height,
+		   v4l2->pixfmt == V4L2_PIX_FMT_GREY ? "GREY" : "YUYV");
+	return 0;
+}
+
+// Wait up to timeout_ms for a frame and write its luma plane into dst
+// Older frames still queued in the driver are skipped. ts receives the frame timestamp
+// Returns 0 on success, -1 on timeout or error
+int v4l2_grab(V4l2Capture *v4l2, Mat &dst, struct timespec *ts, int timeout_ms)
+{
+	struct pollfd pfd;
+	struct v4l2_buffer buf, newest;
+	bool have = false;
+
+	pfd.fd = v4l2->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return -1;
+
+	// Drain the queue, only the most recent buffer is delivered
+	while (true)
+	{
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(v4l2->fd, VIDIOC_DQBUF, &buf) < 0)
+			break;
+		if (have)
+		{
+			xioctl(v4l2->fd, VIDIOC_QBUF, &newest);
+			v4l2->stale_dropped++;
+		}
+		newest = buf;
+		have = true;
+	}
+	if (!have)
+		return -1;
+
+	uchar *data = (uchar*)v4l2->bufs[newest.index].start;
+	if (v4l2->pixfmt == V4L2_PIX_FMT_GREY)
+	{
+		Mat y(v4l2->height, v4l2->width, CV_8UC1, data, v4l2->bytesperline);
+		y.copyTo(dst);
+	}
+	else
+	{
+		// YUYV: Y0 U Y1 V, luma is channel 0 of a two channel view
+		Mat yuyv(v4l2->height, v4l2->width, CV_8UC2, data, v4l2->bytesperline);
+		extractChannel(yuyv, dst, 0);
+	}
+
+	if (v4l2->monotonic_ts)
+	{
+		ts->tv_sec = newest.timestamp.tv_sec;
+		ts->tv_nsec = newest.timestamp.tv_usec * 1000L;
+	}
+	else
+	{
+		clock_gettime(CLOCK_MONOTONIC, ts);
+	}
+
+	xioctl(v4l2->fd, VIDIOC_QBUF, &newest);
+	return 0;
+}
+
+#endif // V4L2_CAPTURE_H
@@ -2,18 +2,41 @@ import cv2
 import socket
 import sys
 import numpy as np
+import struct
 import errno
+import os
 from socket import error as socket_error
+from shm_reader import ShmReader, SHM_RING_PATH
 
 ds_factor=0.6
 
+# Wire format of the camera server, mirrors camera_app/cpp/frame_proto.h
+FRAME_MAGIC = 0x4d524643
+FRAME_PROTO_VERSION = 1
+FRAME_PIX_GRAY8 = 1
+FRAME_ENC_RAW = 0
+FRAME_ENC_JPEG = 1
+FRAME_ENC_DELTA = 2
+CMD_FORMAT_JPEG = 401
+CMD_FORMAT_DELTA = 402
+DELTA_INDEX = struct.Struct('<H')
+FRAME_HEADER = struct.Struct('<IHHQQHHBBHII')
+FACE_RECORD = struct.Struct('<HHHH')
+SERVER_COMMANDS = (100, 200, 300)	# Face detection, pause and record toggles
+
 class VideoCamera(object):
-	def __init__(self, HOST, PORT):
+	# fmt: CMD_FORMAT_JPEG (encoded once by the server) or CMD_FORMAT_DELTA (changed blocks only)
+	def __init__(self, HOST, PORT, fmt=CMD_FORMAT_JPEG):
 		#Setup socket connection
 		self.s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.last_seq = 0
+		self.missed = 0
+		self.faces = []
+		self.reference = None
 		try:
 			self.s.connect((HOST,PORT))
 			print("Connection accepted")
+			self.s.send(bytes("%d\n" % fmt, encoding='utf8'))
 		except socket_error as serr:
 			if serr.errno != errno.ECONNREFUSED:
 				raise serr
@@ -24,30 +47,173 @@ class VideoCamera(object):
 		print("Connection closed")
 
 	def send_data(self, data):
+		# The server applies commands once their newline arrives
 		print("Send data: %s" % data)
+		if not data.endswith("\n"):
+			data += "\n"
 		self.s.send(bytes(data, encoding='utf8'))
 
+	def subscribe(self, **params):
+		# Stream parameters of this connection: fps, tier (1/2^tier size), quality, adaptive=1
+		# A bare number sent with send_data is taken as fps too
+		for name, value in params.items():
+			self.send_data("%s=%d\n" % (name, int(value)))
+
+	def recv_exact(self, size):
+		# Read exactly size bytes, None if the server closed the connection
+		chunks = []
+		while size > 0:
+			data = self.s.recv(size)
+			if not data:
+				return None
+			chunks.append(data)
+			size -= len(data)
+		return b''.join(chunks)
+
+	def apply_delta(self, payload):
+		# Patch the reference with the changed blocks (see camera_app/cpp/block_delta.h)
+		if len(payload) < 4:
+			return False
+		block, num_blocks = struct.unpack_from('<HH', payload)
+		height, width = self.reference.shape
+		bcols = (width + block - 1) // block
+		off = 4
+		for i in range(num_blocks):
+			if off + DELTA_INDEX.size > len(payload):
+				return False
+			index, = DELTA_INDEX.unpack_from(payload, off)
+			off += DELTA_INDEX.size
+			x0 = (index % bcols) * block
+			y0 = (index // bcols) * block
+			w = min(block, width - x0)
+			h = min(block, height - y0)
+			if y0 >= height or off + w * h > len(payload):
+				return False
+			self.reference[y0:y0 + h, x0:x0 + w] = np.frombuffer(payload, dtype='uint8', count=w * h, offset=off).reshape([h, w])
+			off += w * h
+		return True
+
 	def get_data(self):
-		bytes = 0
-		data_list = []
-		while(bytes < 307200):
-			data = np.asarray(self.s.recv(307200))
-			bytes += data.nbytes
-			data_list.append(data.tostring())
-		if(len(data_list) > 0):
-			x = data_list[0]
-			for i in range(1, len(data_list)):
-				x += data_list[i]
-			imgData = np.fromstring(x, dtype='uint8')
-			if (imgData.size == 307200):
-				frame = imgData.reshape([480, 640])
-				ret, jpeg = cv2.imencode('.jpg', frame)
-#				cv2.imshow('Python OPENCV Video Client', frame)
-#				cv2.waitKey(1)
-				return jpeg.tobytes()
-#				if cv2.waitKey(1) == ord('q'):
-#					break
+		# Frame header (see camera_app/cpp/frame_proto.h), face records, then the payload
+		header = self.recv_exact(FRAME_HEADER.size)
+		if header is None:
+			return None
+		(magic, version, header_len, seq, timestamp_ns, width, height, pixfmt, encoding,
+			num_faces, payload_len, reserved) = FRAME_HEADER.unpack(header)
+		if magic != FRAME_MAGIC or version != FRAME_PROTO_VERSION:
+			print("bad frame header: magic 0x%08x version %d" % (magic, version))
+			return None
+		records = self.recv_exact(header_len - FRAME_HEADER.size)
+		payload = self.recv_exact(payload_len)
+		if records is None or payload is None:
+			return None
+		self.faces = [FACE_RECORD.unpack_from(records, i * FACE_RECORD.size) for i in range(num_faces)]
+		# Gaps in the sequence number are frames the server did not send to us
+		if self.last_seq and seq > self.last_seq + 1:
+			self.missed += seq - self.last_seq - 1
+		self.last_seq = seq
+		self.timestamp_ns = timestamp_ns
+
+		if encoding == FRAME_ENC_JPEG:
+			return payload
+		if encoding == FRAME_ENC_RAW and pixfmt == FRAME_PIX_GRAY8 and payload_len == width * height:
+			# Also the keyframe of delta mode
+			self.reference = np.frombuffer(payload, dtype='uint8').reshape([height, width]).copy()
+			ret, jpeg = cv2.imencode('.jpg', self.reference)
+			return jpeg.tobytes()
+		if encoding == FRAME_ENC_DELTA:
+			if self.reference is None or self.reference.shape != (height, width) or not self.apply_delta(payload):
+				print("delta frame without a matching keyframe")
+				return None
+			ret, jpeg = cv2.imencode('.jpg', self.reference)
+			return jpeg.tobytes()
+		print("unsupported frame: encoding %d pixfmt %d" % (encoding, pixfmt))
+		return None
+
+class ShmCamera(object):
+	# Frames of camera cam straight from the server's shared memory ring (published unless the
+	# server runs with -s), no socket copy. Control codes still go to the camera's port, one short connection each
+	def __init__(self, HOST, PORT, cam=0):
+		self.reader = ShmReader(cam)
+		self.host = HOST
+		self.port = PORT
+		self.missed = 0
+		self.faces = []
+		self.fps = 0
+		self.next_due_ns = 0
+		print("Reading camera %d from shared memory" % cam)
+	def __del__(self):
+		if hasattr(self, 'reader'):
+			self.reader.close()
+
+	def send_data(self, data):
+		print("Send data: %s" % data)
+		# Like the server, any other bare number is this viewer's frame rate
+		try:
+			value = int(str(data).strip())
+		except ValueError:
+			value = None
+		if value is not None and value not in SERVER_COMMANDS:
+			self.subscribe(fps=value)
+			return
+		s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		try:
+			s.connect((self.host, self.port))
+			s.send(bytes("%s\n" % data, encoding='utf8'))
+		except socket_error as serr:
+			print(serr.errno)
+		finally:
+			s.close()
+
+	def subscribe(self, **params):
+		# The ring carries every frame at full size: fps is applied here, the rest needs a socket viewer
+		for name, value in params.items():
+			if name == 'fps':
+				self.fps = max(int(value), 0)
+				self.next_due_ns = 0
 			else:
-				print("data mismatch: %dbytes received" %imgData.size)
+				print("Subscription ignored for shared memory frames: %s=%s" % (name, value))
 
+	def due(self, timestamp_ns):
+		# Decimate by capture time the way the server does for socket viewers
+		# A frame slightly early still counts, capture jitter must not halve the rate
+		return self.fps <= 0 or timestamp_ns + int(1e9 / self.fps) // 4 >= self.next_due_ns
 
+	def advance(self, timestamp_ns):
+		# Keep the average rate, without a burst of catch-up frames after a stall
+		if self.fps <= 0:
+			return
+		interval = int(1e9 / self.fps)
+		if timestamp_ns > self.next_due_ns + interval:
+			self.next_due_ns = timestamp_ns + interval
+		else:
+			self.next_due_ns += interval
+
+	def get_data(self):
+		# The ring holds raw greyscale frames: encode the shared pixels, then make sure the
+		# server did not rewrite the slot meanwhile
+		while True:
+			got = self.reader.next()
+			if got is None:
+				return None
+			seq, timestamp_ns, frame, slot, lock = got
+			if not self.due(timestamp_ns):
+				continue
+			self.timestamp_ns = timestamp_ns
+			ret, jpeg = cv2.imencode('.jpg', frame)
+			if self.reader.valid(slot, lock):
+				self.advance(timestamp_ns)
+				self.missed = self.reader.missed
+				self.faces = self.reader.faces
+				return jpeg.tobytes()
+
+def open_camera(HOST, PORT, cam=0):
+	# Shared memory when the server of this host publishes camera cam there, the socket otherwise
+	if os.path.exists(SHM_RING_PATH % cam):
+		try:
+			camera = ShmCamera(HOST, PORT, cam)
+			os.kill(camera.reader.pid, 0)
+			return camera
+		except OSError as err:
+			print("Shared memory ring of camera %d unusable (%s), using the socket" % (cam, err))
+	return VideoCamera(HOST, PORT)
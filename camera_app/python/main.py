@@ -2,7 +2,7 @@
 # main.py
 # import the necessary packages
 from flask import Flask, render_template, Response, request
-from camera import VideoCamera
+from camera import open_camera
 import socket
 import os
 import threading
@@ -61,9 +61,12 @@ def gen(vServer):
 			       b'Content-Type: image/jpeg\r\n\r\n' + frame + b'\r\n\r\n')
 
 
+# Camera N of the C++ server streams on LOCAL_PORT + N, select it with /video_feed?cam=N
+# Frames come from its shared memory ring instead when the server publishes one (not with -s)
 @app.route('/video_feed', methods=['GET', 'POST'])
 def video_feed():
-    video_feed = VideoCamera(LOCAL_HOST, LOCAL_PORT)
+    cam = request.args.get('cam', 0, type=int)
+    video_feed = open_camera(LOCAL_HOST, LOCAL_PORT + cam, cam)
     return Response(gen(video_feed),
                     mimetype='multipart/x-mixed-replace; boundary=frame')
 
@@ -0,0 +1,110 @@
+import ctypes
+import mmap
+import os
+import platform
+import struct
+import time
+import numpy as np
+
+# Shared memory frame ring of the camera server, mirrors camera_app/cpp/shm_ring.h
+SHM_RING_MAGIC = 0x474e5253
+SHM_RING_VERSION = 1
+SHM_RING_PATH = '/dev/shm/opencv_monitor_cam%d'
+RING_HEADER = struct.Struct('=IHHIIIIIIQII')
+SLOT_HEADER = struct.Struct('=IIQQHHBBHII')
+FACE_RECORD = struct.Struct('=HHHH')
+NOTIFY_OFFSET = 28		# ShmRingHeader.notify, futex word: low 32 bits of seq
+SEQ_OFFSET = 32			# ShmRingHeader.seq
+POLL_INTERVAL = 0.0005	# Fallback when the futex cannot be used
+FUTEX_WAIT = 0			# Process shared, the server wakes with FUTEX_WAKE
+SYS_FUTEX = {'x86_64': 202, 'aarch64': 98, 'armv7l': 240, 'armv6l': 240, 'i686': 240}.get(platform.machine())
+
+class Timespec(ctypes.Structure):
+	_fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+try:
+	libc = ctypes.CDLL(None, use_errno=True)
+	libc.syscall.restype = ctypes.c_long
+except (OSError, AttributeError):
+	libc = None
+
+class ShmReader(object):
+	# Map the frame ring of camera cam read-only, raises OSError if the server is not running
+	def __init__(self, cam=0):
+		fd = os.open(SHM_RING_PATH % cam, os.O_RDONLY)
+		try:
+			self.map = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+		finally:
+			os.close(fd)
+		(magic, version, num_slots, self.slot_offset, self.slot_stride, self.payload_offset,
+			self.capacity, notify, latest, seq, self.pid, reserved) = RING_HEADER.unpack_from(self.map, 0)
+		if magic != SHM_RING_MAGIC or version != SHM_RING_VERSION:
+			raise OSError("not a frame ring: magic 0x%08x version %d" % (magic, version))
+		self.last_seq = 0
+		self.missed = 0
+		self.faces = []
+		# The mapping is read-only, numpy still hands out the address of the futex word
+		self.notify = np.frombuffer(self.map, dtype='uint32', count=1, offset=NOTIFY_OFFSET)
+
+	def close(self):
+		self.notify = None
+		self.map.close()
+
+	def wait(self, seq, timeout):
+		# Sleep until the server publishes a frame after seq or timeout seconds pass
+		# ctypes releases the GIL for the call, other viewers keep running
+		if libc is None or SYS_FUTEX is None:
+			time.sleep(POLL_INTERVAL)
+			return
+		ts = Timespec(int(timeout), int((timeout % 1) * 1e9))
+		libc.syscall(ctypes.c_long(SYS_FUTEX), ctypes.c_void_p(self.notify.ctypes.data),
+			ctypes.c_int(FUTEX_WAIT), ctypes.c_uint32(seq & 0xffffffff), ctypes.byref(ts),
+			ctypes.c_void_p(None), ctypes.c_int(0))
+
+	def valid(self, slot, lock):
+		# True if the slot was not rewritten since lock was read: the frame used was intact
+		return struct.unpack_from('=I', self.map, slot)[0] == lock
+
+	def next(self, timeout=1.0):
+		# Wait for a frame newer than the last one returned
+		# Returns (seq, timestamp_ns, frame, slot, lock) or None on timeout. frame is a numpy view
+		# of the shared pixels, no copy: use it, then check valid(slot, lock) before trusting the result
+		deadline = time.monotonic() + timeout
+		while True:
+			seq = struct.unpack_from('=Q', self.map, SEQ_OFFSET)[0]
+			if seq == self.last_seq:
+				remaining = deadline - time.monotonic()
+				if remaining <= 0:
+					return None
+				# Returns at once if notify moved on since seq was read
+				self.wait(seq, remaining)
+				continue
+			latest = RING_HEADER.unpack_from(self.map, 0)[8]
+			slot = self.slot_offset + latest * self.slot_stride
+			(lock, reserved, seq, timestamp_ns, width, height, pixfmt, encoding, num_faces,
+				payload_len, reserved2) = SLOT_HEADER.unpack_from(self.map, slot)
+			if lock & 1 or payload_len != width * height or payload_len > self.capacity:
+				continue
+			faces = [FACE_RECORD.unpack_from(self.map, slot + SLOT_HEADER.size + i * FACE_RECORD.size)
+				for i in range(num_faces)]
+			frame = np.frombuffer(self.map, dtype='uint8', count=payload_len,
+				offset=slot + self.payload_offset).reshape([height, width])
+			if not self.valid(slot, lock):
+				continue
+			# Gaps in the sequence number are frames this reader did not see
+			if self.last_seq and seq > self.last_seq + 1:
+				self.missed += seq - self.last_seq - 1
+			self.last_seq = seq
+			self.faces = faces
+			return (seq, timestamp_ns, frame, slot, lock)
+
+	def get_frame(self, timeout=1.0):
+		# Copy of the next frame, for callers that keep frames around
+		while True:
+			got = self.next(timeout)
+			if got is None:
+				return None
+			seq, timestamp_ns, frame, slot, lock = got
+			copy = frame.copy()
+			if self.valid(slot, lock):
+				return copy
@@ -19,6 +19,9 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include "../../camera_app/cpp/frame_proto.h"
+#include "../../camera_app/cpp/block_delta.h"
+#include "../../camera_app/cpp/mcast_reader.h"
 
 using namespace cv;
 
@@ -29,30 +32,59 @@ int main(int argc, char** argv)
     //--------------------------------------------------------
     //networking stuff: socket , connect
     //--------------------------------------------------------
-    int         sokt;
+    int         sokt = -1;
     char*       serverIP;
     int         serverPort;
+    McastReader mreader;
 
     if (argc < 3) {
-           std::cerr << "Usage: cv_video_cli <serverIP> <serverPort> " << std::endl;
+           std::cerr << "Usage: cv_video_cli <serverIP> <serverPort> <frameRate> [raw|jpeg|delta]" << std::endl;
+           std::cerr << "       cv_video_cli <group>[@ifaddr] <port> <frameRate> mcast" << std::endl;
     }
 
     serverIP   = argv[1];
     serverPort = atoi(argv[2]);
 
-    struct  sockaddr_in serverAddr;
-    socklen_t           addrLen = sizeof(struct sockaddr_in);
-
-    if ((sokt = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        std::cerr << "socket() failed" << std::endl;
+    // Multicast: join the camera's group (server -U) instead of connecting to it
+    bool mcast = argc > 4 && strcmp(argv[4], "mcast") == 0;
+    if (mcast)
+    {
+        struct in_addr group, iface;
+        iface.s_addr = htonl(INADDR_ANY);
+        if (mcast_parse_address(serverIP, &group, &serverPort, &iface) < 0 ||
+            mcast_reader_open(&mreader, group, serverPort, iface) < 0)
+        {
+            std::cerr << "Cannot join multicast group " << serverIP << std::endl;
+            return 1;
+        }
     }
+    else
+    {
+        struct  sockaddr_in serverAddr;
+        socklen_t           addrLen = sizeof(struct sockaddr_in);
+
+        if ((sokt = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            std::cerr << "socket() failed" << std::endl;
+        }
 
-    serverAddr.sin_family = AF_INET;
-    inet_pton(AF_INET, serverIP, &(serverAddr.sin_addr));
-    serverAddr.sin_port = htons(serverPort);
+        serverAddr.sin_family = AF_INET;
+        inet_pton(AF_INET, serverIP, &(serverAddr.sin_addr));
+        serverAddr.sin_port = htons(serverPort);
 
-    if (connect(sokt, (sockaddr*)&serverAddr, addrLen) < 0) {
-        std::cerr << "connect() failed!" << std::endl;
+        if (connect(sokt, (sockaddr*)&serverAddr, addrLen) < 0) {
+            std::cerr << "connect() failed!" << std::endl;
+        }
+
+        // Stream format: raw frames unless asked for JPEG (401) or block deltas (402)
+        if (argc > 4)
+        {
+            const char *cmd = strcmp(argv[4], "jpeg") == 0 ? "401\n" : strcmp(argv[4], "delta") == 0 ? "402\n" : "400\n";
+            send(sokt, cmd, strlen(cmd), MSG_NOSIGNAL);
+        }
+        // The server decimates to the rate the recording plays at, capture keeps its native rate
+        char subscribe[32];
+        snprintf(subscribe, sizeof(subscribe), "fps=%d\n", atoi(argv[3]));
+        send(sokt, subscribe, strlen(subscribe), MSG_NOSIGNAL);
     }
 
 
@@ -62,35 +94,111 @@ int main(int argc, char** argv)
     //----------------------------------------------------------
 
     Mat img;
-    img = Mat::zeros(480 , 640, CV_8UC1);
-    int imgSize = img.total() * img.elemSize();
-    uchar *iptr = img.data;
-    int bytes = 0;
-    int key;
+    Mat reference;          // Delta mode: image rebuilt from the last keyframe and the deltas since
+    FrameHeader hdr;
+    FaceRecord faces[FRAME_MAX_FACES];
+    std::vector<uchar> payload;
+    uint64_t last_seq = 0;
+    uint64_t missed = 0;
     Size S = Size((int) 640,(int) 480);
-    //make img continuos
-    if ( ! img.isContinuous() ) {
-          img = img.clone();
-    }
 
     int frameRate = atoi(argv[3]);
 
-    std::cout << "Image Size:" << imgSize << std::endl;
     VideoWriter video;
     video.open("outcpp.avi", CV_FOURCC('M','J','P','G'), frameRate, S, 0);
 
     int fCount = 0;
     while (fCount < 100) {
 
-        if ((bytes = recv(sokt, iptr, imgSize , MSG_WAITALL)) == -1)
-	{
-            std::cerr << "recv failed, received bytes = " << bytes << std::endl;
+        if (mcast)
+        {
+            // A complete frame, framed like on the camera port
+            McastFrame frame;
+            if (mcast_reader_next(&mreader, 5000, &frame) <= 0)
+            {
+                std::cerr << "No multicast frames" << std::endl;
+                break;
+            }
+            memcpy(&hdr, frame.data, std::min((size_t)frame.len, sizeof(hdr)));
+            if (frame.len < sizeof(hdr) || frame_header_unpack(&hdr) < 0 || hdr.num_faces > FRAME_MAX_FACES ||
+                (uint32_t)hdr.header_len + hdr.payload_len != frame.len)
+            {
+                std::cerr << "Bad multicast frame" << std::endl;
+                continue;
+            }
+            memcpy(faces, frame.data + sizeof(hdr), hdr.num_faces * sizeof(FaceRecord));
+            payload.assign(frame.data + hdr.header_len, frame.data + frame.len);
+        }
+        else
+        {
+            // Frame header, then its face records and payload
+            if (recv_all(sokt, &hdr, sizeof(hdr)) < 0)
+            {
+                std::cerr << "recv failed, connection closed" << std::endl;
+                break;
+            }
+            if (frame_header_unpack(&hdr) < 0)
+            {
+                std::cerr << "Bad frame header (magic " << std::hex << hdr.magic << std::dec
+                          << ", version " << hdr.version << "), stream out of sync" << std::endl;
+                break;
+            }
+            if (hdr.num_faces > FRAME_MAX_FACES ||
+                recv_all(sokt, faces, hdr.num_faces * sizeof(FaceRecord)) < 0)
+                break;
+            payload.resize(hdr.payload_len);
+            if (recv_all(sokt, payload.data(), hdr.payload_len) < 0)
+                break;
+        }
+
+        // Gaps in the sequence number are frames the server did not send to this client,
+        // decimated for the subscribed rate included
+        if (last_seq != 0 && hdr.seq > last_seq + 1)
+            missed += hdr.seq - last_seq - 1;
+        last_seq = hdr.seq;
+
+        if (hdr.encoding == FRAME_ENC_JPEG)
+            img = imdecode(Mat(1, hdr.payload_len, CV_8UC1, payload.data()), IMREAD_GRAYSCALE);
+        else if (hdr.encoding == FRAME_ENC_RAW && hdr.pixfmt == FRAME_PIX_GRAY8 &&
+                 hdr.payload_len == (uint32_t)hdr.width * hdr.height)
+        {
+            // Also the keyframe the following deltas apply to
+            Mat(hdr.height, hdr.width, CV_8UC1, payload.data()).copyTo(reference);
+            img = reference;
         }
+        else if (hdr.encoding == FRAME_ENC_DELTA)
+        {
+            if (reference.cols != hdr.width || reference.rows != hdr.height ||
+                delta_apply(payload.data(), payload.size(), reference) < 0)
+            {
+                std::cerr << "Delta frame without a matching keyframe" << std::endl;
+                continue;
+            }
+            img = reference;
+        }
+        else
+        {
+            std::cerr << "Unsupported frame encoding " << (int)hdr.encoding << std::endl;
+            continue;
+        }
+        if (img.empty())
+            continue;
+        if (img.size() != S)
+            resize(img, img, S);
 	video << img;
  	fCount++;
     }
+    std::cout << "Frames written: " << fCount << ", frames missed: " << missed << std::endl;
 
     video.release();
-    close(sokt);
+    if (mcast)
+    {
+        std::cout << "Datagrams: " << mreader.datagrams << ", lost: " << mreader.lost
+                  << ", reordered: " << mreader.reordered << ", incomplete frames: " << mreader.incomplete
+                  << ", deltas waiting for a keyframe: " << mreader.unsynced << std::endl;
+        mcast_reader_close(&mreader);
+    }
+    else
+        close(sokt);
     return 0;
 }